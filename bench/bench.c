@@ -0,0 +1,152 @@
+/*
+	Microbenchmarks of the conversion stages and end-to-end throughput of
+	vdrsub, with the results written to stdout as JSON
+
+	bench [-vdrsub path] [stream ...]
+
+	Each stage is timed on display sets from synth.c for at least
+	BENCH_MIN_NS, at each coding and at SD and HD sizes; the end-to-end
+	figures come from running vdrsub on each given stream
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "synth.h"
+#include "../stats.h"
+#include "../output.h"
+
+#ifndef BENCH_VERSION
+#define BENCH_VERSION "unknown"
+#endif
+
+#define BENCH_MIN_NS 300000000ULL	// time each case for at least 0.3 s
+#define BENCH_SETS 32				// distinct display sets per case
+
+// in dvbsub.c :
+size_t encode_vobsub(byte *data, subpicture *src);
+
+static int results = 0;
+
+// Start a JSON result object; the caller adds its own fields and closes it
+static void result(const char *bench)
+{
+	printf("%s\n  {\"bench\":\"%s\"",results++ ? "," : "",bench);
+}
+
+static const struct synth_opt cases[] = {
+	{ 720, 80, 1, 0, 2 }, { 720, 80, 1, 0, 4 }, { 720, 80, 1, 0, 8 },
+	{ 1920, 120, 1, 0, 2 }, { 1920, 120, 1, 0, 4 }, { 1920, 120, 1, 0, 8 },
+};
+
+static void bench_case(const struct synth_opt *opt)
+{
+	static byte *sets[BENCH_SETS];
+	static int lens[BENCH_SETS];
+	size_t total = 0;
+
+	synth_seed(1);
+	for (int i = 0; i < BENCH_SETS; i++)
+	{
+		if (sets[i] == NULL)
+			sets[i] = malloc(SYNTH_MAX);
+		lens[i] = synth_display_set(sets[i], opt, i, 1);
+		total += lens[i];
+	}
+
+	// decode_dvbsub(): whole display sets, as vdrsub passes them
+	subpicture ctx = init_subp();
+	qword n = 0, t = stats_clock(), elapsed;
+	do
+	{
+		for (int i = 0; i < BENCH_SETS; i++)
+			decode_dvbsub(sets[i] + 2, lens[i] - 3, &ctx);
+		n += BENCH_SETS;
+	}
+	while ((elapsed = stats_clock() - t) < BENCH_MIN_NS);
+	result("decode_dvbsub");
+	printf(",\"size\":\"%dx%d\",\"coding\":%d,\"ns_per_set\":%.0f,\"mb_per_s\":%.2f}",
+	 opt->w, opt->h, opt->coding, (double) elapsed / n,
+	 total * (n / BENCH_SETS) / (elapsed / 1e3));
+
+	// encode_vobsub(): the last subpicture decoded, over and over
+	byte *vobsub = malloc(VOBSUB_MAX(ctx.w, ctx.h));
+	n = 0; t = stats_clock();
+	do
+	{
+		encode_vobsub(vobsub, &ctx);
+		n++;
+	}
+	while ((elapsed = stats_clock() - t) < BENCH_MIN_NS);
+	result("encode_vobsub");
+	printf(",\"size\":\"%dx%d\",\"coding\":%d,\"ns_per_subpicture\":%.0f,\"mpixel_per_s\":%.2f}",
+	 opt->w, opt->h, opt->coding, (double) elapsed / n,
+	 (double) ctx.w * ctx.h * n / (elapsed / 1e3));
+
+	// output_subpicture(): PS packetising of that subpicture into the
+	// output ring, timed until the writer thread has drained it to /dev/null
+	FILE *sub = fopen("/dev/null", "wb"), *idx = fopen("/dev/null", "wb");
+	output *out = sub && idx ? output_open(sub, idx, 0) : NULL;
+	if (out == NULL)
+	{ fprintf(stderr,"Unable to write /dev/null\n"); exit(1); }
+	size_t len = vobsub[0] << 8 | vobsub[1], written = 0;
+	n = 0; t = stats_clock();
+	do
+	{
+		written += output_subpicture(out, vobsub, len, n * 3600);
+		n++;
+	}
+	while (stats_clock() - t < BENCH_MIN_NS);
+	output_close(out);
+	elapsed = stats_clock() - t;
+	result("output_subpicture");
+	printf(",\"size\":\"%dx%d\",\"coding\":%d,\"ns_per_subpicture\":%.0f,\"mb_per_s\":%.2f}",
+	 opt->w, opt->h, opt->coding, (double) elapsed / n, written / (elapsed / 1e3));
+
+	free(vobsub);
+	release_subp(ctx);
+}
+
+static void bench_end_to_end(const char *vdrsub, const char *name)
+{
+	struct stat st;
+	if (stat(name, &st) < 0)
+	{ fprintf(stderr,"Unable to open: %s\n",name); return; }
+
+	char *cmd = malloc(strlen(vdrsub) + strlen(name) + 32);
+	sprintf(cmd, "%s '%s' > /dev/null", vdrsub, name);
+	qword t = stats_clock();
+	int status = system(cmd);
+	qword elapsed = stats_clock() - t;
+	free(cmd);
+
+	result("end_to_end");
+	printf(",\"stream\":\"%s\",\"bytes\":%lld,\"status\":%d,\"seconds\":%.3f,\"mb_per_s\":%.2f}",
+	 name, (long long) st.st_size, status, elapsed / 1e9, st.st_size / (elapsed / 1e3));
+}
+
+int main(int argc, char *argv[])
+{
+	const char *vdrsub = "./vdrsub";
+
+	printf("{\"version\":\"%s\",\"results\":[", BENCH_VERSION);
+	for (int i = 0; i < sizeof cases / sizeof cases[0]; i++)
+	{
+		bench_case(&cases[i]);
+		fflush(stdout);
+	}
+	for (int i = 1; i < argc; i++)
+		if (!strcmp(argv[i],"-vdrsub") && i < argc-1)
+			vdrsub = argv[++i];
+		else
+		{
+			bench_end_to_end(vdrsub, argv[i]);
+			fflush(stdout);
+		}
+	printf("\n]}\n");
+	return 0;
+}
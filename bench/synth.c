@@ -0,0 +1,206 @@
+/*
+	Synthetic DVB subtitle display sets; see synth.h
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "synth.h"
+
+static qword rnd_state;
+
+void synth_seed(qword seed)
+{
+	rnd_state = seed * 0x9E3779B97F4A7C15ULL | 1;
+}
+
+// xorshift64
+qword synth_rnd(void)
+{
+	rnd_state ^= rnd_state << 13; rnd_state ^= rnd_state >> 7; rnd_state ^= rnd_state << 17;
+	return rnd_state;
+}
+
+/////////////////////////////////
+//
+// Bit writer for the pixel-code strings
+
+static byte *bw_p; static int bw_n;	// current byte, bits used in it
+static void putbits(unsigned v, int bits)
+{
+	while (bits--)
+	{
+		if (bw_n == 0) *bw_p = 0;
+		*bw_p |= ((v >> bits) & 1) << (7 - bw_n);
+		if (++bw_n == 8) { bw_n = 0; bw_p++; }
+	}
+}
+static void alignbits(void) { if (bw_n) { bw_n = 0; bw_p++; } }
+
+// Encode one row of pixels into a 2-bit/pixel code string (EN 300 743 7.2.5.2)
+static void code2(const byte *pix, int w)
+{
+	putbits(0x10, 8);
+	for (int i = 0, n; i < w; i += n)
+	{
+		byte c = pix[i];
+		for (n = 1; i+n < w && pix[i+n] == c && n < 284; n++);
+		if (n >= 29) { putbits(0, 2); putbits(0, 2); putbits(3, 2); putbits(n-29, 8); putbits(c, 2); }
+		else if (n >= 12) { n = n > 27 ? 27 : n; putbits(0, 4); putbits(2, 2); putbits(n-12, 4); putbits(c, 2); }
+		else if (n >= 3) { n = n > 10 ? 10 : n; putbits(0, 2); putbits(1, 1); putbits(n-3, 3); putbits(c, 2); }
+		else if (c) { n = 1; putbits(c, 2); }
+		else if (n == 2) { putbits(0, 4); putbits(1, 2); }
+		else { putbits(0, 3); putbits(1, 1); }
+	}
+	putbits(0, 6); alignbits();
+}
+
+static void code4(const byte *pix, int w)
+{
+	putbits(0x11, 8);
+	for (int i = 0, n; i < w; i += n)
+	{
+		byte c = pix[i];
+		for (n = 1; i+n < w && pix[i+n] == c && n < 280; n++);
+		if (n >= 25) { putbits(0, 4); putbits(0xF, 4); putbits(n-25, 8); putbits(c, 4); }
+		else if (n >= 9) { putbits(0, 4); putbits(0xE, 4); putbits(n-9, 4); putbits(c, 4); }
+		else if (!c && n >= 3) { putbits(0, 4); putbits(0, 1); putbits(n-2, 3); }
+		else if (n >= 4) { n = n > 7 ? 7 : n; putbits(0, 4); putbits(2, 2); putbits(n-4, 2); putbits(c, 4); }
+		else if (c) { n = 1; putbits(c, 4); }
+		else if (n == 2) { putbits(0, 4); putbits(0xD, 4); }
+		else { putbits(0, 4); putbits(0xC, 4); }
+	}
+	putbits(0, 8); alignbits();
+}
+
+static void code8(const byte *pix, int w)
+{
+	putbits(0x12, 8);
+	for (int i = 0, n; i < w; i += n)
+	{
+		byte c = pix[i];
+		for (n = 1; i+n < w && pix[i+n] == c && n < 127; n++);
+		if (!c) { putbits(0, 8); putbits(0, 1); putbits(n, 7); }
+		else if (n >= 3) { putbits(0, 8); putbits(1, 1); putbits(n, 7); putbits(c, 8); }
+		else { n = 1; putbits(c, 8); }
+	}
+	putbits(0, 16); alignbits();
+}
+
+/////////////////////////////////
+//
+// Subtitle display sets
+
+static byte *put16(byte *p, unsigned v) { p[0] = v >> 8; p[1] = v; return p+2; }
+
+static byte *segment(byte *p, byte type, const byte *data, int len)
+{
+	*(p++) = 0x0F; *(p++) = type; p = put16(p, 1); p = put16(p, len);
+	memcpy(p, data, len);
+	return p + len;
+}
+
+// Text-like bitmap: rows of glyph strokes on a transparent background
+static void draw_bitmap(byte *pix, int w, int h, int colours)
+{
+	memset(pix, 0, w*h);
+	int margin = h / 8;
+	for (int y = margin; y < h - margin; y++)
+		for (int x = 16, n; x < w - 16; x += n)
+		{
+			n = 1 + synth_rnd() % 24;
+			if (x + n > w - 16) n = w - 16 - x;
+			byte c = synth_rnd() % 2 ? 0 : 1 + synth_rnd() % (colours-1);
+			memset(pix + y*w + x, c, n);
+		}
+}
+
+int synth_display_set(byte *buf, const struct synth_opt *opt, int serial, int draw)
+{
+	static byte version;
+	static byte seg[65536];
+	byte *p = buf, *s;
+
+	*(p++) = 0x20; *(p++) = 0x00;	// data_identifier, subtitle_stream_id
+
+	// SD subtitles go on a 720x576 page, larger ones on 1920x1080
+	int hd = opt->w > 720 || opt->h > 288;
+	int page_w = hd ? 1920 : 720, page_h = hd ? 1080 : 576;
+	if (hd)
+	{
+		s = seg; *(s++) = (version & 0xF) << 4;
+		s = put16(s, page_w-1); s = put16(s, page_h-1);
+		p = segment(p, 0x14, seg, s-seg);
+	}
+
+	s = seg; *(s++) = 10; *(s++) = (version++ & 0xF) << 4 | 2 << 2;
+	if (!draw)
+	{
+		p = segment(p, 0x10, seg, s-seg);
+		*(p++) = 0xFF;
+		return p - buf;
+	}
+
+	int coding = opt->coding ? opt->coding : (int []) {2,4,8}[serial % 3];
+	int colours = coding == 2 ? 4 : coding == 4 ? 16 : 64;
+	int depth = coding == 2 ? 1 : coding == 4 ? 2 : 3;
+	int ry[2] = { page_h - 40 - opt->h, opt->far ? 40 : page_h - 40 - 2*opt->h - 8 };
+	for (int r = 0; r < opt->regions; r++)
+	{
+		*(s++) = r; *(s++) = 0xFF;
+		s = put16(s, (page_w - opt->w) / 2 & ~3); s = put16(s, ry[r]);
+	}
+	p = segment(p, 0x10, seg, s-seg);
+
+	for (int r = 0; r < opt->regions; r++)
+	{
+		s = seg; *(s++) = r; *(s++) = (version & 0xF) << 4 | 0x08;
+		s = put16(s, opt->w); s = put16(s, opt->h);
+		*(s++) = depth << 5 | depth << 2;
+		*(s++) = 0; *(s++) = 0; *(s++) = 0;
+		s = put16(s, r); s = put16(s, 0); s = put16(s, 0);
+		p = segment(p, 0x11, seg, s-seg);
+	}
+
+	s = seg; *(s++) = 0; *(s++) = (version & 0xF) << 4;
+	for (int i = 0; i < colours; i++)
+	{
+		*(s++) = i; *(s++) = 0xE1;
+		*(s++) = i ? 16 + i * 219 / colours : 16; *(s++) = 128; *(s++) = 128;
+		*(s++) = i ? 0 : 0xFF;
+	}
+	p = segment(p, 0x12, seg, s-seg);
+
+	byte *pix = malloc(opt->w * opt->h);
+	for (int r = 0; r < opt->regions; r++)
+	{
+		draw_bitmap(pix, opt->w, opt->h, colours);
+		s = seg; s = put16(s, r); *(s++) = (version & 0xF) << 4;
+		byte *lengths = s; s += 4;
+		bw_p = s; bw_n = 0;
+		for (int field = 0; field < 2; field++)
+		{
+			byte *start = bw_p;
+			for (int y = field; y < opt->h; y += 2)
+			{
+				if (coding == 2) code2(pix + y*opt->w, opt->w);
+				else if (coding == 4) code4(pix + y*opt->w, opt->w);
+				else code8(pix + y*opt->w, opt->w);
+				putbits(0xF0, 8);
+				if (bw_p - seg > sizeof seg - 4096)
+				{ free(pix); return 0; }
+			}
+			put16(lengths + 2*field, bw_p - start);
+		}
+		s = bw_p;
+		if ((s - seg) & 1) *(s++) = 0;
+		if (p - buf + 6 + (s - seg) + 8 > SYNTH_MAX)
+		{ free(pix); return 0; }
+		p = segment(p, 0x13, seg, s-seg);
+	}
+	free(pix);
+
+	p = segment(p, 0x80, seg, 0);
+	*(p++) = 0xFF;
+	return p - buf;
+}
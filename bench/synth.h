@@ -0,0 +1,38 @@
+/*
+
+ Synthetic DVB subtitle display sets for the benchmarks
+
+ Each display set carries one or two regions of text-like bitmaps, coded
+ with the 2-, 4- or 8-bit pixel-code strings of EN 300 743. Output depends
+ only on the options and the seed, so that runs are reproducible
+
+*/
+
+#ifndef __SYNTH_H
+#define __SYNTH_H
+
+#include "../dvbsub.h"
+
+struct synth_opt {
+	int w, h;			// size of each region (and its one object)
+	int regions;		// 1 or 2 (bottom, and top or just above the bottom one)
+	int far;			// place the second region at the top of the screen
+	int coding;			// 2, 4, 8 or 0 (=rotate through all three)
+};
+
+// Largest display set synth_display_set() will put together
+#define SYNTH_MAX 65000
+
+// Seed the generator; the same seed gives the same sequence of everything
+void synth_seed(qword seed);
+
+// Next pseudo-random number
+qword synth_rnd(void);
+
+// Put together display set number 'serial' into buf (SYNTH_MAX bytes) as
+// PES_data_field, i.e. starting with data_identifier 0x20 and ending with
+// the 0xFF marker; 'draw' = 0 gives a page that wipes the previous one
+// Returns its length, or 0 if the set would not fit
+int synth_display_set(byte *buf, const struct synth_opt *opt, int serial, int draw);
+
+#endif
@@ -0,0 +1,188 @@
+/*
+	Deterministic synthetic DVB subtitle stream generator for benchmarking
+
+	Writes a .ts (PAT, PMT, video and DVB subtitle PIDs) or a .vdr (bare PES
+	sequence, as recorded by VDR < 1.7) stream of the given duration, with
+	display sets from synth.c and video PES filling up the mux bitrate
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "synth.h"
+
+#define PMT_PID 0x100
+#define VIDEO_PID 0x200
+#define SUB_PID 0x300
+
+static struct {
+	enum { TS, VDR } format;
+	struct synth_opt set;
+	int seconds;		// stream duration
+	int per_minute;		// display sets per minute
+	long bitrate;		// total mux bitrate, bits/s
+	qword seed;
+} opt = { TS, { 720, 80, 1, 0, 0 }, 60, 20, 4000000, 1 };
+
+static FILE *out;
+
+static byte *put16(byte *p, unsigned v) { p[0] = v >> 8; p[1] = v; return p+2; }
+
+/////////////////////////////////
+//
+// Containers
+
+static byte *pes_header(byte *p, byte stream_id, int payload, qword pts)
+{
+	*(p++) = 0; *(p++) = 0; *(p++) = 1; *(p++) = stream_id;
+	p = put16(p, payload > 65535-8 ? 0 : payload + 8);
+	*(p++) = 0x81; *(p++) = 0x80; *(p++) = 5;
+	*(p++) = 0x21 | (pts >> 29 & 0x0E); *(p++) = pts >> 22;
+	*(p++) = pts >> 14 | 1; *(p++) = pts >> 7; *(p++) = pts << 1 | 1;
+	return p;
+}
+
+static byte cc[0x2000];
+static void ts_write(word pid, const byte *data, int len, int unit_start, int stuffing)
+{
+	while (len > 0)
+	{
+		byte pkt[188] = { 0x47, (unit_start ? 0x40 : 0) | pid >> 8, pid };
+		int n = len > 184 ? 184 : len;
+		if (n < 184 && stuffing)
+		{	// PSI: fill the rest of the payload with 0xFF
+			pkt[3] = 0x10 | (cc[pid]++ & 0xF);
+			memset(pkt+4+n, 0xFF, 184-n);
+			memcpy(pkt+4, data, n);
+			fwrite(pkt, 1, 188, out);
+			return;
+		}
+		if (n < 184)
+		{	// pad with an adaptation field
+			pkt[3] = 0x30 | (cc[pid]++ & 0xF);
+			pkt[4] = 183 - n;
+			if (pkt[4]) { pkt[5] = 0; memset(pkt+6, 0xFF, pkt[4]-1); }
+		}
+		else pkt[3] = 0x10 | (cc[pid]++ & 0xF);
+		memcpy(pkt + 188 - n, data, n);
+		fwrite(pkt, 1, 188, out);
+		data += n; len -= n; unit_start = 0;
+	}
+}
+
+static unsigned crc32(const byte *p, int len)
+{
+	unsigned crc = 0xFFFFFFFF;
+	while (len--)
+	{
+		crc ^= (unsigned) *(p++) << 24;
+		for (int i = 0; i < 8; i++)
+			crc = crc & 0x80000000 ? crc << 1 ^ 0x04C11DB7 : crc << 1;
+	}
+	return crc;
+}
+
+static void ts_section(word pid, byte *sec, int len)
+{
+	unsigned crc = crc32(sec, len);
+	sec[len] = crc >> 24; sec[len+1] = crc >> 16; sec[len+2] = crc >> 8; sec[len+3] = crc;
+	byte buf[1024] = { 0 };	// pointer_field
+	memcpy(buf+1, sec, len+4);
+	ts_write(pid, buf, len+5, 1, 1);
+}
+
+static void ts_psi(void)
+{
+	byte pat[] = { 0, 0xB0, 13, 0,1, 0xC1, 0,0, 0,1, 0xE0 | PMT_PID >> 8, PMT_PID & 0xFF, 0,0,0,0 };
+	ts_section(0, pat, sizeof pat - 4);
+	byte pmt[] = { 2, 0xB0, 33, 0,1, 0xC1, 0,0, 0xE0 | VIDEO_PID >> 8, VIDEO_PID & 0xFF, 0xF0,0,
+		2, 0xE0 | VIDEO_PID >> 8, VIDEO_PID & 0xFF, 0xF0,0,
+		6, 0xE0 | SUB_PID >> 8, SUB_PID & 0xFF, 0xF0,10, 0x59,8, 'f','i','n', 0x10, 0,1, 0,1,
+		0,0,0,0 };
+	ts_section(PMT_PID, pmt, sizeof pmt - 4);
+}
+
+static void vdr_pes(byte stream_id, const byte *prefix, int prefix_len, const byte *data, int len, qword pts)
+{
+	byte hdr[14];
+	pes_header(hdr, stream_id, prefix_len + len, pts);
+	fwrite(hdr, 1, 14, out);
+	fwrite(prefix, 1, prefix_len, out);
+	fwrite(data, 1, len, out);
+}
+
+int main(int argc, char *argv[])
+{
+	char *name = NULL;
+	for (int i=1; i < argc; i++)
+		if (!strcmp(argv[i],"-vdr")) opt.format = VDR;
+		else if (!strcmp(argv[i],"-ts")) opt.format = TS;
+		else if (!strcmp(argv[i],"-far")) opt.set.far = 1;
+		else if (i == argc-1 && argv[i][0] != '-') name = argv[i];
+		else if (i < argc-1)
+		{
+			char *a = argv[i], *v = argv[++i];
+			if (!strcmp(a,"-size")) sscanf(v,"%dx%d",&opt.set.w,&opt.set.h);
+			else if (!strcmp(a,"-regions")) opt.set.regions = atoi(v) > 1 ? 2 : 1;
+			else if (!strcmp(a,"-coding")) opt.set.coding = atoi(v);
+			else if (!strcmp(a,"-t")) opt.seconds = atoi(v);
+			else if (!strcmp(a,"-density")) opt.per_minute = atoi(v);
+			else if (!strcmp(a,"-bitrate")) opt.bitrate = atol(v);
+			else if (!strcmp(a,"-seed")) opt.seed = atoll(v);
+			else name = NULL, i = argc;
+		}
+	if (!name)
+	{
+		fprintf(stderr,"tsgen [-ts|-vdr] [-size WxH] [-regions 1|2] [-far] [-coding 0|2|4|8]\n");
+		fprintf(stderr,"      [-t seconds] [-density sets/min] [-bitrate bits/s] [-seed n] output\n");
+		return 1;
+	}
+	if ((out = fopen(name,"wb")) == NULL)
+	{ fprintf(stderr,"Unable to write: %s\n",name); return 1; }
+	synth_seed(opt.seed);
+
+	byte *ds = malloc(SYNTH_MAX), *video = malloc(1 << 20);
+	int frames = opt.seconds * 25, period = opt.per_minute ? 1500 / opt.per_minute : frames+1;
+	int frame_bytes = opt.bitrate / 8 / 25;
+	qword pts0 = 900000;
+	for (int f = 0, serial = 0; f < frames; f++)
+	{
+		qword pts = pts0 + f * 3600;
+		if (opt.format == TS && f % 10 == 0)
+			ts_psi();
+
+		// video: one PES per frame, filler payload up to the mux bitrate
+		int vlen = frame_bytes > 200 ? frame_bytes - 200 : 0;
+		for (int i = 0; i < vlen; i++) video[14+i] = synth_rnd();
+		if (opt.format == TS)
+		{
+			pes_header(video, 0xE0, vlen, pts);
+			ts_write(VIDEO_PID, video, 14 + vlen, 1, 0);
+		}
+		else for (int off = 0; off < vlen || off == 0; off += 60000)
+			vdr_pes(0xE0, NULL, 0, video+14+off, vlen-off > 60000 ? 60000 : vlen-off, pts);
+
+		// subtitles: draw at the start of each period, wipe two thirds into it
+		int draw = f % period == 0, wipe = f % period == period*2/3;
+		if (!draw && !wipe)
+			continue;
+		int len = synth_display_set(ds, &opt.set, serial++, draw);
+		if (len == 0)
+		{ fprintf(stderr,"Display set does not fit into a PES packet, try a smaller -size\n"); return 1; }
+		if (opt.format == TS)
+		{
+			byte *pes = malloc(len + 14);
+			pes_header(pes, 0xBD, len, pts);
+			memcpy(pes + 14, ds, len);
+			ts_write(SUB_PID, pes, len + 14, 1, 0);
+			free(pes);
+		}
+		else for (int off = 0; off < len; off += 2000)
+			vdr_pes(0xBD, (byte []) {0x20, 0x01, 0x00, off ? 0x01 : 0x00}, 4,
+			 ds + off, len-off > 2000 ? 2000 : len-off, pts);
+	}
+	free(ds); free(video);
+	fclose(out);
+	return 0;
+}
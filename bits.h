@@ -0,0 +1,85 @@
+/*
+
+ Reader for MSB-first bit fields, such as DVB pixel-code strings and the
+ packed fields of CLUT entries and PES headers
+
+ Up to 63 bits are cached in a 64-bit word, left-aligned. Refills load a
+ whole big-endian word while at least 8 bytes of input remain, and byte by
+ byte after that. Bits past the end of input read as zeros
+
+ The reader is header-only so that the decoders using it inline it fully
+
+*/
+
+#ifndef __BITS_H
+#define __BITS_H
+
+#include <string.h>
+#include "dvbsub.h"
+
+struct bitreader {
+	qword cache;		// next bits of input, MSB first
+	int n;				// valid bits in cache; < 0 once read past the end
+	byte *p, *end;		// next byte to load, end of input
+};
+
+static inline void br_init(struct bitreader *br, byte *p, byte *end)
+{
+	br->cache = 0; br->n = 0;
+	br->p = p; br->end = end;
+}
+
+// Top up the cache to at least 56 bits, or with what input is left
+// NOTE: bits below the valid ones are either zero or the following input,
+// so a refill may safely OR the same bits in again
+static inline void br_refill(struct bitreader *br)
+{
+	if (br->end - br->p >= 8)
+	{
+		qword w;
+		memcpy(&w, br->p, 8);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+		w = __builtin_bswap64(w);
+#endif
+		br->cache |= w >> br->n;
+		br->p += (63 - br->n) >> 3;		// whole bytes that fit in
+		br->n |= 56;
+	}
+	else while (br->n < 56 && br->p < br->end)
+	{
+		br->cache |= (qword) *(br->p++) << (56 - br->n);
+		br->n += 8;
+	}
+}
+
+// Return the next 1-32 bits without consuming them (no refill)
+static inline unsigned br_peek(struct bitreader *br, int bits)
+{
+	return br->cache >> (64 - bits);
+}
+
+// Consume bits already peeked at
+static inline void br_skip(struct bitreader *br, int bits)
+{
+	br->cache <<= bits;
+	br->n -= bits;
+}
+
+// Consume and return the next 1-32 bits
+static inline unsigned br_get(struct bitreader *br, int bits)
+{
+	if (br->n < bits)
+		br_refill(br);
+	unsigned v = br_peek(br, bits);
+	br_skip(br, bits);
+	return v;
+}
+
+// Return the byte following the last bit consumed, i.e. the position after
+// the bit field once stuffed to a byte boundary (past 'end' on an overrun)
+static inline byte *br_tell(struct bitreader *br)
+{
+	return br->p - (br->n >> 3);	// >> rounds negative n down as well
+}
+
+#endif
@@ -0,0 +1,417 @@
+/*
+	Daemon mode: a watch on a directory tree of recordings; see daemon.h
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "daemon.h"
+#include "hash.h"
+#include "trace.h"
+
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_SHIFT 13
+
+#define NONE ((size_t) -1)
+
+enum { PENDING, QUEUED, RUNNING, DONE, FAILED, GONE };
+
+// A recording file known of
+struct entry {
+	char *name;
+	int state;
+	int again;			// finished anew while being converted
+	qword size;			// as converted (or failed to)
+	time_t mtime;
+	size_t next;		// in the queue
+};
+
+struct daemon {
+	const struct daemon_config *cfg;
+	int (*convert)(void *arg, const char *name);
+	void *arg;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;	// something queued, or stopping
+	int stopping;
+
+	struct entry *e;	// appended to only, so that indexes stay put
+	size_t n, room;
+	size_t *slot;		// indexes into e[] by a hash of the name, open addressing
+	size_t slots;		// a power of two, at least twice n
+	size_t head, tail;	// the queue, linked through e[].next
+	size_t pending;
+
+	FILE *state;		// appended to as files are converted
+	int inotify;
+	char **dir;			// the path of each watch descriptor
+	int dirs;
+};
+
+static int is_recording(const char *name)
+{
+	const char *ext = strrchr(name,'.');
+	return ext != NULL && (!strcmp(ext,".ts") || !strcmp(ext,".vdr") || !strcmp(ext,".m2ts"));
+}
+
+// Look up the entry of file 'name', adding it as PENDING if new and 'add'
+static size_t find(struct daemon *d, const char *name, int add)
+{
+	if (2 * (d->n + 1) > d->slots)
+	{
+		free(d->slot);
+		d->slots = d->slots ? 2 * d->slots : 1024;
+		d->slot = (size_t *) malloc(d->slots * sizeof *d->slot);
+		memset(d->slot, 0xFF, d->slots * sizeof *d->slot);
+		for (size_t i = 0; i < d->n; i++)
+		{
+			size_t k = hash64((const byte *) d->e[i].name, strlen(d->e[i].name), 0);
+			while (d->slot[k & (d->slots-1)] != NONE)
+				k++;
+			d->slot[k & (d->slots-1)] = i;
+		}
+	}
+
+	size_t k = hash64((const byte *) name, strlen(name), 0);
+	for (; d->slot[k & (d->slots-1)] != NONE; k++)
+		if (!strcmp(d->e[d->slot[k & (d->slots-1)]].name, name))
+			return d->slot[k & (d->slots-1)];
+	if (!add)
+		return NONE;
+	if (d->n == d->room)
+	{
+		d->room = d->room ? 2 * d->room : 1024;
+		d->e = (struct entry *) realloc(d->e, d->room * sizeof *d->e);
+	}
+	d->e[d->n] = (struct entry) { strdup(name), PENDING };
+	d->pending++;
+	d->slot[k & (d->slots-1)] = d->n;
+	return d->n++;
+}
+
+static void enqueue(struct daemon *d, size_t i)
+{
+	if (d->e[i].state == PENDING)
+		d->pending--;
+	d->e[i].state = QUEUED;
+	d->e[i].next = NONE;
+	if (d->head == NONE)
+		d->head = i;
+	else
+		d->e[d->tail].next = i;
+	d->tail = i;
+	pthread_cond_signal(&d->cond);
+}
+
+// Recording file 'name' turned up, or was closed by its writer
+static void seen(struct daemon *d, const char *name, int closed)
+{
+	struct stat st;
+
+	if (stat(name, &st) || !S_ISREG(st.st_mode))
+		return;
+	pthread_mutex_lock(&d->lock);
+	size_t i = find(d, name, 1);
+	struct entry *e = &d->e[i];
+	switch (e->state)
+	{
+	case GONE:
+		e->state = PENDING;
+		d->pending++;
+		// fall through
+	case PENDING:
+		if (closed)
+			enqueue(d, i);
+		break;
+	case RUNNING:
+		e->again |= closed;
+		break;
+	case DONE:
+	case FAILED:
+		// unless it has changed since, that is
+		if (e->size != st.st_size || e->mtime != st.st_mtim.tv_sec)
+		{
+			e->state = PENDING;
+			d->pending++;
+			if (closed)
+				enqueue(d, i);
+		}
+		break;
+	}
+	pthread_mutex_unlock(&d->lock);
+}
+
+// Queue the pending files that have gone unwritten for long enough
+static void settle(struct daemon *d)
+{
+	time_t now = time(NULL);
+	struct stat st;
+
+	pthread_mutex_lock(&d->lock);
+	for (size_t i = 0; d->pending && i < d->n; i++)
+		if (d->e[i].state == PENDING)
+		{
+			if (stat(d->e[i].name, &st))
+			{ d->e[i].state = GONE; d->pending--; }
+			else if (now - st.st_mtim.tv_sec >= d->cfg->settle)
+				enqueue(d, i);
+		}
+	pthread_mutex_unlock(&d->lock);
+}
+
+// Watch directory 'path' and those under it, taking note of the recordings
+static void watch_tree(struct daemon *d, const char *path)
+{
+	int wd = inotify_add_watch(d->inotify, path,
+	 IN_CREATE | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ONLYDIR);
+	DIR *dir;
+	struct dirent *de;
+
+	if (wd < 0)
+	{ fprintf(stderr,"Unable to watch %s: %s\n",path,strerror(errno)); return; }
+	if (wd >= d->dirs)
+	{
+		d->dir = (char **) realloc(d->dir, (wd + 64) * sizeof *d->dir);
+		memset(d->dir + d->dirs, 0, (wd + 64 - d->dirs) * sizeof *d->dir);
+		d->dirs = wd + 64;
+	}
+	free(d->dir[wd]);
+	d->dir[wd] = strdup(path);
+
+	if ((dir = opendir(path)) == NULL)
+		return;
+	while ((de = readdir(dir)) != NULL)
+	{
+		if (!strcmp(de->d_name,".") || !strcmp(de->d_name,".."))
+			continue;
+		char *name = (char *) malloc(strlen(path) + strlen(de->d_name) + 2);
+		sprintf(name, "%s/%s", path, de->d_name);
+		struct stat st;
+		int type = de->d_type;
+		if (type == DT_UNKNOWN && lstat(name, &st) == 0)
+			type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+		if (type == DT_DIR)
+			watch_tree(d, name);
+		else if (type == DT_REG && is_recording(name))
+			seen(d, name, 0);
+		free(name);
+	}
+	closedir(dir);
+}
+
+// Take in the events of the watch
+static void watch_events(struct daemon *d, const char *top)
+{
+	char events[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	ssize_t len = read(d->inotify, events, sizeof events);
+
+	for (char *p = events; len > 0 && p < events + len; p += sizeof (struct inotify_event) + ((struct inotify_event *) p)->len)
+	{
+		struct inotify_event *e = (struct inotify_event *) p;
+		if (e->mask & IN_Q_OVERFLOW)
+		{
+			// events were lost: look the whole tree over again
+			verb(1,"Too many changes at once, rescanning %s\n",top);
+			watch_tree(d, top);
+			continue;
+		}
+		if (e->wd < 0 || e->wd >= d->dirs || d->dir[e->wd] == NULL)
+			continue;
+		if (e->mask & IN_IGNORED)
+		{ free(d->dir[e->wd]); d->dir[e->wd] = NULL; continue; }
+		if (e->len == 0)
+			continue;
+
+		char *name = (char *) malloc(strlen(d->dir[e->wd]) + strlen(e->name) + 2);
+		sprintf(name, "%s/%s", d->dir[e->wd], e->name);
+		if (e->mask & IN_ISDIR)
+			watch_tree(d, name);
+		else if (is_recording(name))
+			seen(d, name, (e->mask & IN_CLOSE_WRITE) != 0);
+		free(name);
+	}
+}
+
+// Note entry 'i' as converted, or failed to, in the state file
+static void note(struct daemon *d, size_t i)
+{
+	struct entry *e = &d->e[i];
+	fprintf(d->state, "%llu %lld %s %s\n", e->size, (long long) e->mtime,
+	 e->state == DONE ? "ok" : "failed", e->name);
+	if (fflush(d->state) || fdatasync(fileno(d->state)))
+		fprintf(stderr,"Unable to write the state file %s\n",d->cfg->state);
+}
+
+// Read in the state file, and write it anew with just the last word on
+// each file still there, so that it does not grow without end
+static int load_state(struct daemon *d)
+{
+	const char *name = d->cfg->state;
+	FILE *f = fopen(name, "r");
+	char line[4096 + 64], *tmp;
+	struct stat st;
+
+	while (f && fgets(line, sizeof line, f))
+	{
+		unsigned long long size;
+		long long mtime;
+		char ok[8];
+		int at;
+		if (sscanf(line, "%llu %lld %7s %n", &size, &mtime, ok, &at) < 3 || line[at] == 0)
+			continue;
+		line[strcspn(line, "\n")] = 0;
+		size_t i = find(d, line + at, 1);
+		if (d->e[i].state == PENDING)
+			d->pending--;
+		d->e[i].state = strcmp(ok, "ok") ? FAILED : DONE;
+		d->e[i].size = size;
+		d->e[i].mtime = mtime;
+	}
+	if (f)
+		fclose(f);
+
+	tmp = (char *) malloc(strlen(name) + 5);
+	sprintf(tmp, "%s.new", name);
+	if ((d->state = fopen(tmp, "w")) == NULL)
+	{ fprintf(stderr,"Unable to write the state file %s\n",name); free(tmp); return 1; }
+	for (size_t i = 0; i < d->n; i++)
+		if (stat(d->e[i].name, &st) == 0)
+			fprintf(d->state, "%llu %lld %s %s\n", d->e[i].size, (long long) d->e[i].mtime,
+			 d->e[i].state == DONE ? "ok" : "failed", d->e[i].name);
+		else
+			d->e[i].state = GONE;
+	if (fflush(d->state) || fdatasync(fileno(d->state)) || rename(tmp, name))
+	{ fprintf(stderr,"Unable to write the state file %s\n",name); free(tmp); return 1; }
+	free(tmp);
+	return 0;
+}
+
+static void *worker_thread(void *arg)
+{
+	struct daemon *d = (struct daemon *) arg;
+	const struct daemon_config *cfg = d->cfg;
+
+	// for this thread and those it starts, e.g. the output writer
+	if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), cfg->nice))
+		fprintf(stderr,"Unable to set the priority of conversions: %s\n",strerror(errno));
+	if (cfg->ioclass && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+	 cfg->ioclass << IOPRIO_CLASS_SHIFT | cfg->iolevel))
+		fprintf(stderr,"Unable to set the I/O priority of conversions: %s\n",strerror(errno));
+
+	pthread_mutex_lock(&d->lock);
+	while (1)
+	{
+		while (d->head == NONE && !d->stopping)
+			pthread_cond_wait(&d->cond, &d->lock);
+		if (d->stopping)
+			break;
+		size_t i = d->head;
+		d->head = d->e[i].next;
+		d->e[i].state = RUNNING;
+		char *name = strdup(d->e[i].name);
+		pthread_mutex_unlock(&d->lock);
+
+		// as it was to begin with: a change meanwhile will not go unnoticed
+		struct stat st;
+		int gone = stat(name, &st) != 0;
+		int status = gone || d->convert(d->arg, name);
+
+		pthread_mutex_lock(&d->lock);
+		struct entry *e = &d->e[i];
+		e->state = gone ? GONE : status ? FAILED : DONE;
+		if (!gone)
+		{
+			e->size = st.st_size;
+			e->mtime = st.st_mtim.tv_sec;
+			note(d, i);
+		}
+		if (e->again)
+		{
+			e->again = 0;
+			e->state = PENDING;
+			d->pending++;
+			enqueue(d, i);
+		}
+		free(name);
+	}
+	pthread_mutex_unlock(&d->lock);
+	return NULL;
+}
+
+int daemon_run(const char *dir, const struct daemon_config *cfg,
+ int (*convert)(void *arg, const char *name), void *arg)
+{
+	struct daemon d = { cfg, convert, arg, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+	pthread_t *thread = (pthread_t *) calloc(cfg->workers, sizeof *thread);
+	int started = 0, sfd;
+	struct stat st;
+	sigset_t sigs;
+
+	d.head = NONE;
+	if (stat(dir, &st) || !S_ISDIR(st.st_mode))
+	{ fprintf(stderr,"Not a directory: %s\n",dir); free(thread); return 1; }
+	if (load_state(&d))
+	{ free(thread); return 1; }
+
+	// taken in by the watch rather than handled, so that the conversions
+	// under way are finished first
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+	if ((sfd = signalfd(-1, &sigs, SFD_CLOEXEC)) < 0
+	 || (d.inotify = inotify_init1(IN_CLOEXEC)) < 0)
+	{ fprintf(stderr,"Unable to watch %s: %s\n",dir,strerror(errno)); free(thread); return 1; }
+	watch_tree(&d, dir);
+
+	for (int k = 0; k < cfg->workers; k++)
+		if (pthread_create(&thread[started], NULL, worker_thread, &d) == 0)
+			started++;
+	if (started == 0)
+		fprintf(stderr,"Unable to start converting\n");
+	verb(1,"Watching %s, %zu recordings known, converting %d at a time\n",dir,d.n,started);
+
+	while (started)
+	{
+		settle(&d);
+		struct pollfd pfd[2] = { { d.inotify, POLLIN }, { sfd, POLLIN } };
+		int r = poll(pfd, 2, d.pending ? cfg->settle * 1000 : -1);
+		if (r < 0 && errno != EINTR)
+			break;
+		if (pfd[1].revents)
+			break;
+		if (pfd[0].revents)
+			watch_events(&d, dir);
+	}
+
+	pthread_mutex_lock(&d.lock);
+	d.stopping = 1;
+	pthread_cond_broadcast(&d.cond);
+	pthread_mutex_unlock(&d.lock);
+	for (int k = 0; k < started; k++)
+		pthread_join(thread[k], NULL);
+
+	fclose(d.state);
+	close(d.inotify);
+	close(sfd);
+	for (size_t i = 0; i < d.n; i++)
+		free(d.e[i].name);
+	for (int k = 0; k < d.dirs; k++)
+		free(d.dir[k]);
+	free(d.e); free(d.slot); free(d.dir); free(thread);
+	return 0;
+}
@@ -0,0 +1,39 @@
+/*
+
+ Daemon mode: a watch on a directory tree of recordings (e.g. the VDR video
+ directory) converting each recording file once it is finished
+
+ Every directory of the tree is watched with inotify, new ones as they are
+ made. A recording file counts as finished once its writer closes it, or,
+ for one found there at start-up or moved in, once it has gone unwritten
+ for a while. Finished files are queued and converted in turn on a fixed
+ number of threads, at the CPU and I/O priority asked for, so that the
+ conversions only take what the recordings leave over
+
+ Each file converted is noted in a state file with its size and time of
+ modification, so that it is not converted again, not even by a daemon
+ started anew, unless it changes
+
+*/
+
+#ifndef __DAEMON_H
+#define __DAEMON_H
+
+#include "dvbsub.h"
+
+struct daemon_config {
+	int workers;		// conversions at once
+	int nice;			// CPU priority of the conversions, as with nice(1)
+	int ioclass, iolevel;	// ... and I/O priority, as with ionice(1): 1 =realtime,
+						// 2 =best effort, 3 =idle; 0 =left as it is
+	int settle;			// seconds unwritten for a file not seen closed to count as finished
+	const char *state;	// the state file
+};
+
+// Convert each recording file (.ts, .vdr, .m2ts) under 'dir' once finished,
+// by convert(arg, name) returning 0 once done, until SIGINT or SIGTERM
+// Returns 1 if the directory or the state file cannot be set up, else 0
+int daemon_run(const char *dir, const struct daemon_config *cfg,
+ int (*convert)(void *arg, const char *name), void *arg);
+
+#endif
@@ -5,204 +5,471 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <stdarg.h>
 #include <arpa/inet.h> // ntohs()
+#include <pthread.h>
 
 #include "dvbsub.h"
+#include "trace.h"
+#include "stats.h"
+#include "bits.h"
+#include "hash.h"
+
+#if defined VOBSUB && defined __x86_64__	// where SSE2 can be taken for granted
+#include <immintrin.h>
+#define RLE_X86
+#endif
 
 #define min(x,y) ((x)<(y) ? (x) : (y))
 #define max(x,y) ((x)>(y) ? (x) : (y))
 
-int verbose_level = 0;
-void init_verbose(int level)
+// Pixel-code strings (EN 300 743, 7.2.5.2) are decoded a code at a time :
+// the leading bits of a code index a table giving its length and run, and
+// whether a run_length field and a pixel code are still to follow
+//
+struct code {
+	byte len;		// bits taken by the table index part of the code
+	byte run;		// pixels, or what to add to the run_length field
+	byte colour;	// pixel code, unless one follows
+	byte ext;		// width of a following run_length field, plus :
+};
+#define CODE_COLOUR 0x10	// a pixel code follows (after any run_length)
+#define CODE_END	0x80	// end_of_string_signal
+
+static struct code twobit_codes[1 << 6], fourbit_codes[1 << 8];
+
+#define code(l,r,c,e) ((struct code) { l,r,c,e })
+
+static void init_codes_once(void)
 {
-    char *verb = getenv("SUB_VERBOSE");
-    if (verb != NULL) verbose_level=atoi(verb);
-    else verbose_level = level;
+
+	for (int i = 0; i < 1 << 6; i++)
+		if (i >> 4)		twobit_codes[i] = code(2, 1, i >> 4, 0);	// CC
+		else if (i & 8)	twobit_codes[i] = code(6, (i&7)+3, 0, CODE_COLOUR);	// 00 1 LLL
+		else if (i & 4)	twobit_codes[i] = code(4, 1, 0, 0);			// 00 01
+		else switch (i & 3)
+		{
+		case 0: twobit_codes[i] = code(6, 0, 0, CODE_END); break;	// 00 00 00
+		case 1: twobit_codes[i] = code(6, 2, 0, 0); break;			// 00 00 01
+		case 2: twobit_codes[i] = code(6, 12, 0, 4|CODE_COLOUR); break;	// 00 00 10
+		case 3: twobit_codes[i] = code(6, 29, 0, 8|CODE_COLOUR); break;	// 00 00 11
+		}
+
+	for (int i = 0; i < 1 << 8; i++)
+		if (i >> 4)		fourbit_codes[i] = code(4, 1, i >> 4, 0);	// CCCC
+		else if (~i & 8) fourbit_codes[i] = (i & 7)					// 0000 0 LLL
+			? code(8, (i&7)+2, 0, 0) : code(8, 0, 0, CODE_END);
+		else if (~i & 4) fourbit_codes[i] = code(8, (i&3)+4, 0, CODE_COLOUR);	// 0000 10 LL
+		else switch (i & 3)
+		{
+		case 0: fourbit_codes[i] = code(8, 1, 0, 0); break;			// 0000 1100
+		case 1: fourbit_codes[i] = code(8, 2, 0, 0); break;			// 0000 1101
+		case 2: fourbit_codes[i] = code(8, 9, 0, 4|CODE_COLOUR); break;	// 0000 1110
+		case 3: fourbit_codes[i] = code(8, 25, 0, 8|CODE_COLOUR); break;	// 0000 1111
+		}
 }
 
-#ifdef VERBOSE
-void verb(int level, const char *format, ...)
+// filled in once for all contexts, whichever thread gets there first
+static void init_codes(void)
 {
-	va_list args;
-	va_start(args,format);
-
-	if ((level & verbose_level) != level) return;
-	vfprintf(stderr,format,args);
-	va_end(args);
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	pthread_once(&once, init_codes_once);
 }
 
-#else
-#define verb(x,f,...)
+// Where decoded pixels go: either a row of pixels in a raster, or the run
+// list of a row of a region (see struct subregion in dvbsub.h)
+struct sink {
+	byte *pix, *lim;			// raster: next pixel, region edge
+	struct region *r;			// runs: the region, NULL for a raster
+	int row, room;				// runs: row of the region, pixels left in it
+};
 
-#endif
+static void add_run(struct sink *s, int run, byte colour);
 
-// load a number of bits from data pointed to by *p and update *p as necessary
-// during a bit-field, caller must maintain 'byte b, mask=0' and pass &b,&mask
-//
-qword loadbits(int bits, byte **p, byte *b, byte *mask)
+// write a run of pixels, dropping those at or beyond the region edge
+static inline void put_run(struct sink *s, int run, byte colour)
 {
-	qword r = 0;
-
-	if (bits == 0) *mask = 0;
-	while (bits--)
+	if (s->r != NULL)
 	{
-		if (! *mask)
-		{
-			*mask=0xFF; *b = *(p[0]++);
-		}
-		r <<= 1;
-		r |= (((*b) & 0x80) != 0);
-		*b <<= 1; *mask <<= 1;
+		add_run(s, run, colour);
+		return;
 	}
-	return r;
+	if (s->pix >= s->lim)
+		return;
+	if (run == 1)
+	{
+		*(s->pix++) = colour;
+		return;
+	}
+	if (run > s->lim - s->pix)
+		run = s->lim - s->pix;
+	memset(s->pix, colour, run);
+	s->pix += run;
 }
 
-#define smpl2(x) (x)
-#define smpl4(x) (x)
-
-void twobit_coding(byte **pix, byte **p)
+// the 2- and 4-bit strings only differ by their tables and field widths
+static inline void decode_string(struct sink *d, struct bitreader *br,
+ const struct code *codes, int index_bits, int colour_bits)
 {
-    byte b,mask=0;
-
 	while (1)
 	{
-		byte twobits = loadbits(2,p,&b,&mask);
-		if (twobits) *((*pix)++) = smpl2(twobits);
-		else if (loadbits(1,p,&b,&mask))
-		{
-			int i = loadbits(3,p,&b,&mask)+3;
-			twobits = loadbits(2,p,&b,&mask);
-			while (i--) *((*pix)++) = smpl2(twobits);
-		}
-		else if (loadbits(1,p,&b,&mask)) *((*pix)++) = smpl2(0);
-		else switch (loadbits(2,p,&b,&mask))
+		if (br->n < 24)		// enough for any one code
+			br_refill(br);
+		struct code c = codes[br_peek(br,index_bits)];
+		br_skip(br,c.len);
+		if (c.ext == 0)
+			put_run(d,c.run,c.colour);
+		else if (c.ext & CODE_END)
+			break;
+		else
 		{
-        case 0: loadbits(0,NULL,NULL,&mask); return;
-        case 1: *((*pix)++) = smpl2(0); *((*pix)++) = smpl2(0); break;
-        case 2: {
-                int i = loadbits(4,p,&b,&mask)+12;
-            	twobits = loadbits(2,p,&b,&mask);
-            	while (i--) *((*pix)++) = smpl2(twobits);
-				break;
-                }
-        case 3: {
-                int i = loadbits(8,p,&b,&mask)+29;
-            	twobits = loadbits(2,p,&b,&mask);
-            	while (i--) *((*pix)++) = smpl2(twobits);
-				break;
-                }
+			int run = c.run;
+			if (c.ext & 0x0F)
+				run += br_get(br,c.ext & 0x0F);
+			put_run(d,run,br_get(br,colour_bits));
 		}
 	}
 }
 
-void fourbit_coding(byte **pix, byte **p)
+static void twobit_coding(struct sink *d, struct bitreader *br)
 {
-    byte b,mask=0;
+	decode_string(d,br,twobit_codes,6,2);
+}
+
+static void fourbit_coding(struct sink *d, struct bitreader *br)
+{
+	decode_string(d,br,fourbit_codes,8,4);
+}
 
+// 8-bit codes are few enough to pick apart from 24 bits without a table
+static void eightbit_coding(struct sink *d, struct bitreader *br)
+{
 	while (1)
 	{
-		byte fourbits = loadbits(4,p,&b,&mask);
-		if (fourbits) *((*pix)++) = smpl4(fourbits);
-		else if (!loadbits(1,p,&b,&mask))
+		if (br->n < 24)
+			br_refill(br);
+		unsigned bits = br_peek(br,24);
+		if (bits >> 16)					// CCCCCCCC
 		{
-			int i = loadbits(3,p,&b,&mask)+2;
-			if (i==2) { loadbits(0,NULL,NULL,&mask); return; }
-			while (i--) *((*pix)++) = smpl4(0);
+			put_run(d,1,bits >> 16);
+			br_skip(br,8);
 		}
-		else if (!loadbits(1,p,&b,&mask))
+		else if (bits & 0x8000)			// 00000000 1 LLLLLLL CCCCCCCC
 		{
-			int i = loadbits(2,p,&b,&mask)+4;
-            fourbits = loadbits(4,p,&b,&mask);
-            while (i--) *((*pix)++) = smpl4(fourbits);
+			put_run(d,(bits >> 8) & 0x7F,bits);
+			br_skip(br,24);
 		}
-		else switch (loadbits(2,p,&b,&mask))
-		{
-		case 0: *((*pix)++) = smpl4(0); break;
-        case 1: *((*pix)++) = smpl4(0); *((*pix)++) = smpl4(0); break;
-        case 2: {
-                int i = loadbits(4,p,&b,&mask)+9;
-            	fourbits = loadbits(4,p,&b,&mask);
-            	while (i--) *((*pix)++) = smpl4(fourbits);
-				break;
-                }
-        case 3: {
-                int i = loadbits(8,p,&b,&mask)+25;
-            	fourbits = loadbits(4,p,&b,&mask);
-            	while (i--) *((*pix)++) = smpl4(fourbits);
-				break;
-                }
-        }
-	}
-}
-
-void eightbit_coding(byte **pix, byte **p)
-{
-    byte b,mask=0;
-
-	while (1)
-	{
-		byte eightbits = loadbits(8,p,&b,&mask);
-		if (eightbits) *((*pix)++) = eightbits;
-		else if (!loadbits(1,p,&b,&mask))
+		else if (bits & 0x7F00)			// 00000000 0 LLLLLLL
 		{
-			int i = loadbits(7,p,&b,&mask)+1;
-			if (i==1) { loadbits(0,NULL,NULL,&mask); return; }
-			while (i--) *((*pix)++) = 0;
+			put_run(d,bits >> 8,0);
+			br_skip(br,16);
 		}
-		else
+		else							// 00000000 0 0000000
 		{
-			int i = loadbits(7,p,&b,&mask)+3;
-            eightbits = loadbits(8,p,&b,&mask);
-            while (i--) *((*pix)++) = eightbits;
+			br_skip(br,16);
+			break;
 		}
 	}
 }
 
-struct region { int x,y, w,h; };
-struct object { int x,y; int r; };
+// Regions and objects of the page, the few there are kept in small arrays
+// looked up by id, so that neither takes memory by how large the ids are
+// Each region keeps its pixels apart, in buffers kept for the next region in
+// its slot, so that only the area of the regions is decoded, kept and encoded
+// The pixels are kept as runs, as decoded, for as long as the region has had
+// one object decoded into it since it was filled, and as a raster otherwise,
+// e.g. where objects overlap
+#define DVB_REGIONS 16
+#define DVB_OBJECTS 64
+struct region {
+    int id;
+    int x,y, w,h;                   // position on the page, size
+    int shown;                      // listed in the latest page composition
+    byte background;                // pixel code it was last filled with
+    int objects;                    // decoded into it since
+    int raster;                     // in pix rather than in runs
+    byte *pix;                      // w x h pixels, as indexes to the clut
+    size_t size;                    // allocated
+    struct pixel_run *run;          // runs row by row, see struct subregion
+    size_t runs, run_size;          // in use, allocated
+    unsigned *first, *n;            // first run of each row and their number
+    size_t rows;                    // allocated
+};
+struct object { int id; int x,y; int r; };
+
+// A vobsub packet encoded lately, kept for when the same subpicture recurs
+#define VOBSUB_CACHE 8
+struct vobsub_packet {
+    qword hash;                     // of the subpicture, see subpicture_hash()
+    int x,y, w,h;
+    qword used;                     // when last drawn, 0 =never (empty)
+    byte *data;
+    size_t size;                    // allocated, at least VOBSUB_MAX(w,h)
+};
 
 // define the actual context data (pointed to by subpicture.ctx) used
 // by decode_dvbsub to keep constant state between received data frames
 typedef struct {
     // regions, i.e. on-screen rectangles
-    struct region *r;
+    struct region r[DVB_REGIONS];
+    struct subregion on_display[DVB_REGIONS];   // subpicture.regions
     // objects, i.e. positions within regions
-    struct object *o;
-    size_t r_n, o_n;                // currently received count of the above
+    struct object o[DVB_OBJECTS];
+    int r_n, o_n;                   // currently received count of the above
+    // vobsub packets of the latest subpictures, the least recently drawn
+    // of them reused for the next one
+    struct vobsub_packet cache[VOBSUB_CACHE];
+    qword draws;                    // count, as the clock of cache[].used
+    int showing;                    // a subpicture is on, not wiped since
+    qword shown;                    // ... with this hash
+    // the CLUT in subpicture.clut, or -1 while there is none
+    int clut_id, clut_version;
+    // ... and what it maps to in vobsub, derived once per CLUT version
+    int clut_mapped;
+    byte code[256];                 // CLUT entry -> 2-bit vobsub pixel code
+    byte colour[4], alpha[4];       // palette index and alpha of each code
+    // vobsub palette as 0xRRGGBB, filled up as new colours turn up
+    dword palette[16];
+    int palette_n, palette_changes;
 } dvb_ctx;
 
 subpicture init_subp(void)
 {
+	init_codes();
 	subpicture subp = (subpicture) {
         NONE,                       // live_state
-        9999,9999, 0,0,             // x,y,w,h (enclosing rectangle)
-        NULL,                       // pix (decoded pixel data)
+        0,0, 0,0,                   // x,y,w,h (enclosing rectangle)
+        NULL,0,                     // regions on display
         {{0,0,0}},                  // clut
         malloc(sizeof (dvb_ctx))    // ctx
     };
-    *((dvb_ctx *) subp.ctx) = (dvb_ctx) { NULL, NULL, 0,0 };
+    memset(subp.ctx, 0, sizeof (dvb_ctx));
+    ((dvb_ctx *) subp.ctx)->clut_id = ((dvb_ctx *) subp.ctx)->clut_version = -1;
+    ((dvb_ctx *) subp.ctx)->palette_n = 1;  // entry 0 (black) for transparency
     return subp;
 }
 
 void release_subp(subpicture subp)
 {
-    if (subp.pix != NULL)
-        free(subp.pix);
-    if (((dvb_ctx *) subp.ctx)->r != NULL)
-        free(((dvb_ctx *) subp.ctx)->r);
-    if (((dvb_ctx *) subp.ctx)->o != NULL)
-        free(((dvb_ctx *) subp.ctx)->o);
+    for (int i = 0; i < DVB_REGIONS; i++)
+    {
+        struct region *r = &((dvb_ctx *) subp.ctx)->r[i];
+        free(r->pix); free(r->run); free(r->first); free(r->n);
+    }
+    for (int i = 0; i < VOBSUB_CACHE; i++)
+        free(((dvb_ctx *) subp.ctx)->cache[i].data);
     free(subp.ctx);
 }
 
+// Return the region with the given id, or with 'add' a new one if there is
+// none yet (and room for it); NULL if there is no such region
+static struct region *region_of(dvb_ctx *ctx, int id, int add)
+{
+	for (int i = 0; i < ctx->r_n; i++)
+		if (ctx->r[i].id == id)
+			return &ctx->r[i];
+	if (!add || ctx->r_n == DVB_REGIONS)
+		return NULL;
+	struct region *r = &ctx->r[ctx->r_n++];
+	r->id = id;
+	r->x = r->y = r->w = r->h = r->shown = 0;	// the buffer stays for reuse
+	return r;
+}
+
+// ... and likewise for objects
+static struct object *object_of(dvb_ctx *ctx, int id, int add)
+{
+	for (int i = 0; i < ctx->o_n; i++)
+		if (ctx->o[i].id == id)
+			return &ctx->o[i];
+	if (!add || ctx->o_n == DVB_OBJECTS)
+		return NULL;
+	ctx->o[ctx->o_n].id = id;
+	return &ctx->o[ctx->o_n++];
+}
+
+// Fill region r with its background colour, keeping it as runs from now on
+static void fill_region(struct region *r)
+{
+	if (r->rows < (size_t) r->h)
+	{
+		r->rows = r->h;
+		r->first = (unsigned *) realloc(r->first, r->rows * sizeof (unsigned));
+		r->n = (unsigned *) realloc(r->n, r->rows * sizeof (unsigned));
+	}
+	memset(r->n, 0, r->h * sizeof (unsigned));
+	r->runs = 0;
+	r->raster = 0;
+	r->objects = 0;
+}
+
+// Turn the runs of region r into a raster, e.g. for another object to be
+// decoded over what is there
+static void region_to_raster(struct region *r)
+{
+	size_t size = (size_t) r->w * r->h;
+	if (r->size < size)
+	{
+		r->size = size;
+		r->pix = (byte *) realloc(r->pix, r->size);
+	}
+	for (int k = 0; k < r->h; k++)
+	{
+		byte *d = r->pix + (size_t) k * r->w;
+		if (r->n[k] == 0)
+			memset(d, r->background, r->w);
+		for (unsigned i = r->first[k]; i < r->first[k] + r->n[k]; i++)
+		{
+			memset(d, r->run[i].colour, r->run[i].len);
+			d += r->run[i].len;
+		}
+	}
+	r->raster = 1;
+}
+
+// Append a run to the row at hand of a region kept as runs
+static void add_run(struct sink *s, int run, byte colour)
+{
+	struct region *r = s->r;
+	if (run > s->room)
+		run = s->room;
+	if (run <= 0)
+		return;
+	s->room -= run;
+	if (r->n[s->row] && r->run[r->runs-1].colour == colour)
+	{
+		r->run[r->runs-1].len += run;	// within the row, so it fits a word
+		return;
+	}
+	if (r->runs == r->run_size)
+	{
+		r->run_size = r->run_size ? 2 * r->run_size : 256;
+		r->run = (struct pixel_run *) realloc(r->run,
+		 r->run_size * sizeof (struct pixel_run));
+	}
+	r->run[r->runs++] = (struct pixel_run) { run, colour };
+	r->n[s->row]++;
+}
+
+// Start row 'row' of region r at x, with the pixels up to there in the
+// background colour; a row out of the region gets no pixels
+static void start_row(struct sink *s, struct region *r, int x, int row)
+{
+	*s = (struct sink) { NULL, NULL, NULL, 0, 0 };
+	if (row < 0 || row >= r->h || x < 0 || x >= r->w)
+		return;
+	if (r->raster)
+	{
+		s->pix = r->pix + (size_t) row * r->w + x;
+		s->lim = s->pix + r->w - x;
+		return;
+	}
+	*s = (struct sink) { NULL, NULL, r, row, r->w };
+	r->first[row] = r->runs;
+	r->n[row] = 0;
+	add_run(s, x, r->background);
+}
+
+// ... and end it, with the rest of the row in the background colour
+static void end_row(struct sink *s)
+{
+	if (s->r != NULL)
+		add_run(s, s->room, s->r->background);
+}
+
+// List the regions on display in dst, and set its enclosing rectangle
+// to theirs; returns the number of regions
+static int show_regions(dvb_ctx *ctx, subpicture *dst)
+{
+	int n = 0, right = 0, bottom = 0;
+
+	dst->x = dst->y = dst->w = dst->h = 0;
+	for (int i = 0; i < ctx->r_n; i++)
+	{
+		struct region *r = &ctx->r[i];
+		if (!r->shown || r->w == 0 || r->h == 0)
+			continue;
+		ctx->on_display[n] = (struct subregion) { r->x,r->y, r->w,r->h,
+		 r->raster ? r->pix : NULL, r->run, r->first, r->n, r->background };
+		if (n++ == 0)
+		{ dst->x = r->x; dst->y = r->y; }
+		dst->x = min(dst->x, r->x);
+		dst->y = min(dst->y, r->y);
+		right = max(right, r->x + r->w);
+		bottom = max(bottom, r->y + r->h);
+	}
+	if (n > 0)
+	{ dst->w = right - dst->x; dst->h = bottom - dst->y; }
+	dst->regions = ctx->on_display;
+	dst->n_regions = n;
+	return n;
+}
+
+byte subpicture_pixel(const subpicture *subp, int x, int y)
+{
+	for (int i = subp->n_regions - 1; i >= 0; i--)
+	{
+		const struct subregion *r = &subp->regions[i];
+		if (x < r->x || x >= r->x + r->w || y < r->y || y >= r->y + r->h)
+			continue;
+		x -= r->x; y -= r->y;
+		if (r->pix != NULL)
+			return r->pix[y * r->w + x];
+		for (unsigned k = r->first[y]; k < r->first[y] + r->n[y]; k++)
+			if ((x -= r->run[k].len) < 0)
+				return r->run[k].colour;
+		return r->background;
+	}
+	return 0;
+}
+
 // take word x in network (bigendian) order, as read from the dvb stream
 // if necessary, adjust x to (a little-endian) host byte order
 #define NETWORD(x) (x = (word) ntohs(x))
 
+// Decode the pixel data sub-block of one field of an object at x,y of region
+// r into rows 'row', row+2, ... of it; pixels beyond the region are dropped
+// Returns the end of the data read (> endp on overflow)
+static byte *decode_field(byte *p, byte *endp, struct region *r,
+ int x, int y, int row)
+{
+	struct bitreader br;
+	struct sink d;
+
+	while (1)
+	{
+		// locate the current row, or take no pixels if it is out of bounds
+		start_row(&d, r, x, y + row);
+
+		while (p < endp)
+		{
+			byte type = *(p++);
+			if (type == 0xF0)	// end_of_object_line_code
+				break;
+			switch (type)
+			{
+			case 0x10: case 0x11: case 0x12:
+				br_init(&br,p,endp);
+				if (type == 0x10) twobit_coding(&d,&br);
+				else if (type == 0x11) fourbit_coding(&d,&br);
+				else eightbit_coding(&d,&br);
+				p = br_tell(&br);
+				break;
+			case 0x20: p+=2; break;
+			case 0x21: p+=4; break;
+			case 0x22: p+=16; break;
+			default: verb(1,"%c%02X",row & 1 ? '_' : '^',type); break;
+			}
+		}
+		end_row(&d);
+		if (p >= endp)
+			return p;
+		row += 2;
+	}
+}
+
 void decode_dvbsub(byte *data, size_t len, subpicture *dst)
 {
-    verb(2,"DVBSUB decoding frame with %d bytes :\n",len);
+    verb(2,"DVBSUB decoding frame with %zu bytes :\n",len);
     // Assume any previous draw or wipe operation be committed by the caller
     if (dst->live_state == WIPE)
         dst->live_state = NONE;
@@ -229,10 +496,11 @@ void decode_dvbsub(byte *data, size_t len, subpicture *dst)
 			 subseg.sync_byte);
 			break;
 		}
-        verb(2,"DVBSUB: %d bytes of payload left, next segment takes (%d+)%d\n",
+        verb(2,"DVBSUB: %zu bytes of payload left, next segment takes (%zu+)%d\n",
              len - (p-data),sizeof subseg,subseg.segment_length);
 		p += sizeof subseg;
 
+		STATS_ADD(segments[subseg.segment_type],1);
 		switch (subseg.segment_type)
 		{
 		case 0x10: verb(2," page composition segment\n");
@@ -257,16 +525,18 @@ void decode_dvbsub(byte *data, size_t len, subpicture *dst)
                 {
                     if (dst->live_state == STAY)
                         dst->live_state = WIPE;
-                    // delete old region + object definitions
-                    if (ctx->r != NULL) free(ctx->r); ctx->r=NULL;ctx->r_n = 0;
-                    if (ctx->o != NULL) free(ctx->o); ctx->o=NULL;ctx->o_n = 0;
-                    // enclosing rectangle needs to be calculated anew
-                    dst->x = dst->y = 9999; dst->w = dst->h = 0;
-					if (dst->pix != NULL) { free(dst->pix); dst->pix = NULL; }
+                    // forget old region + object definitions
+                    ctx->r_n = ctx->o_n = 0;
                 }
+                // a mode change starts a new epoch, with CLUT versions anew
+                if ((pageseg.page_ver_state & 0x0C) == 0x08)
+                    ctx->clut_id = ctx->clut_version = -1;
 
 				verb(2," regions:\n");
 
+                // only the regions listed are on display from now on
+                for (int i = 0; i < ctx->r_n; i++)
+                    ctx->r[i].shown = 0;
                 byte *endp = p+subseg.segment_length-2;
                 while (p < endp)
 				{
@@ -280,20 +550,17 @@ void decode_dvbsub(byte *data, size_t len, subpicture *dst)
 					NETWORD(reg.region_horizontal_address);
 					NETWORD(reg.region_vertical_address);
 
-                    if (ctx->r_n <= reg.region_id)
+                    struct region *r = region_of(ctx, reg.region_id, 1);
+                    if (r == NULL)
                     {
-                        ctx->r_n = reg.region_id+1;
-                        ctx->r = (struct region *) realloc(ctx->r,
-                         sizeof (struct region) * ctx->r_n);
+                        verb(1,"ERROR: More than %d regions on the page\n",
+                         DVB_REGIONS);
+                        continue;
                     }
                     // store region position into context data
-                    ctx->r[reg.region_id] = (struct region) {
-					 reg.region_horizontal_address,
-					 reg.region_vertical_address, 0,0 };
-
-                    // also update the enclosing rectangle position
-                    dst->x = min( dst->x, reg.region_horizontal_address);
-                    dst->y = min( dst->y, reg.region_vertical_address);
+                    r->x = reg.region_horizontal_address;
+                    r->y = reg.region_vertical_address;
+                    r->shown = 1;
 
                     verb(2, "  - region_id=%d, hor_addr=%d, ver_addr=%d\n",
 					 reg.region_id,
@@ -319,26 +586,29 @@ void decode_dvbsub(byte *data, size_t len, subpicture *dst)
 				NETWORD(regseg.region_height);
 
                 verb(2,"for region %d :\n",regseg.region_id);
-                if (ctx->r_n <= regseg.region_id)
+                struct region *r = region_of(ctx, regseg.region_id, 0);
+                if (r == NULL)
                 {
                     verb(1,"ERROR: Composing undeclared region\n");
                     p += subseg.segment_length-10; break;
                 }
-                // store region size into context data
-				ctx->r[regseg.region_id].w = regseg.region_width;
-				ctx->r[regseg.region_id].h = regseg.region_height;
-
-                // make this region also fit inside the enclosing rectangle
-                int new_w = ctx->r[regseg.region_id].x
-                        +ctx->r[regseg.region_id].w - dst->x;
-                int new_h = ctx->r[regseg.region_id].y
-                        +ctx->r[regseg.region_id].h - dst->y;
-                if (dst->w < new_w || dst->h < new_h)
+                // a new region, or one set to be filled, starts out in its
+                // background colour, i.e. the pixel code for its depth
+                int depth = (regseg.reg_compat_depth >> 2) & 0x07;
+                byte background = depth == 1 ? (regseg.region_4_2bit >> 2) & 3
+                 : depth == 2 ? regseg.region_4_2bit >> 4 : regseg.region_8bit;
+                int fill = regseg.reg_ver_fillflag & 0x08;
+                if (r->w != regseg.region_width || r->h != regseg.region_height)
+                {
+                    // store region size into context data
+                    r->w = regseg.region_width;
+                    r->h = regseg.region_height;
+                    fill = 1;
+                }
+                if (fill)
                 {
-                    dst->w = max( dst->w, new_w );
-                    dst->h = max( dst->h, new_h );
-                    dst->pix = (byte *) realloc(dst->pix, dst->w*dst->h);
-					memset(dst->pix, 0, dst->w * dst->h);
+                    r->background = background;
+                    fill_region(r);
                 }
 
 				verb(2,"  ver=%d, fill=%d, width=%d, height=%d, compatibility=%d\n",
@@ -366,16 +636,15 @@ void decode_dvbsub(byte *data, size_t len, subpicture *dst)
 					NETWORD(obj.obj_vertical);
 
                     // store object pos. + referenced region into context data
-                    if (ctx->o_n <= obj.object_id)
-                    {
-                        ctx->o_n = obj.object_id+1;
-                        ctx->o = (struct object *) realloc(ctx->o,
-                            sizeof (struct object) * ctx->o_n);
-                    }
-					ctx->o[obj.object_id] = (struct object) {
-                        obj.obj_type_prov_horiz & 0xFFF,
-                        obj.obj_vertical & 0xFFF,
-                        regseg.region_id };
+                    struct object *o = object_of(ctx, obj.object_id, 1);
+                    if (o != NULL)
+                        *o = (struct object) { obj.object_id,
+                            obj.obj_type_prov_horiz & 0xFFF,
+                            obj.obj_vertical & 0xFFF,
+                            regseg.region_id };
+                    else
+                        verb(1,"ERROR: More than %d objects on the page\n",
+                         DVB_OBJECTS);
 
 					verb(2,"  - id=%d, type&prov=0x%X, hor_pos=%d, ver_pos=%d\n",
 					 obj.object_id,
@@ -405,6 +674,17 @@ void decode_dvbsub(byte *data, size_t len, subpicture *dst)
                 verb(2,"id=%d, version=%d, entries:\n",clutseg.clut_id,
 				 clutseg.clut_version);
 
+                // a CLUT of the same version is the same CLUT all over again
+                if (clutseg.clut_id == ctx->clut_id
+                 && clutseg.clut_version >> 4 == ctx->clut_version)
+                {
+                    verb(2,"  (unchanged)\n");
+                    p += subseg.segment_length-2; break;
+                }
+                ctx->clut_id = clutseg.clut_id;
+                ctx->clut_version = clutseg.clut_version >> 4;
+                ctx->clut_mapped = 0;
+
                 // clear clut, so undefined entries get signalled by y=0
                 memset(dst->clut, 0, sizeof dst->clut);
 
@@ -424,11 +704,12 @@ void decode_dvbsub(byte *data, size_t len, subpicture *dst)
 					}
 					else
 					{
-                        byte b,mask=0; // for loadbits()
-                        entry.y = loadbits(6,&p,&b,&mask) << 2;
-                        entry.cr = loadbits(4,&p,&b,&mask) << 4;
-                        entry.cb = loadbits(4,&p,&b,&mask) << 4;
-                        entry.t = loadbits(2,&p,&b,&mask) << 6;
+                        struct bitreader br;
+                        br_init(&br,p,p+2); p+=2;
+                        entry.y = br_get(&br,6) << 2;
+                        entry.cr = br_get(&br,4) << 4;
+                        entry.cb = br_get(&br,4) << 4;
+                        entry.t = br_get(&br,2) << 6;
 					}
                     dst->clut[entry.entry_id] = (struct colour)
 					 { entry.y? entry.y :1, entry.cr, entry.cb, entry.t };
@@ -456,16 +737,14 @@ void decode_dvbsub(byte *data, size_t len, subpicture *dst)
 				memcpy(&objseg,p,3); p+=3;
 				NETWORD(objseg.object_id);
 
-                if (objseg.object_id >= ctx->o_n)
+                struct object *o = object_of(ctx, objseg.object_id, 0);
+                struct region *r = o ? region_of(ctx, o->r, 0) : NULL;
+                if (r == NULL)
                 {
                     verb(1,"ERROR: Receiving data for undeclared object %d\n",
 					 objseg.object_id);
                     p += subseg.segment_length-3; break;
                 }
-                struct region reg = ctx->r[ctx->o[objseg.object_id].r];
-                reg.x += ctx->o[objseg.object_id].x - dst->x;
-                reg.y += ctx->o[objseg.object_id].y - dst->y;
-				// reg now has x,y relative to our enclosing rectangle
 
 				verb(2,"for obj %d, version=%d, coding=%d, colour=%d\n",
 				 objseg.object_id,objseg.obj_ver_code_colour >> 4,
@@ -493,57 +772,29 @@ void decode_dvbsub(byte *data, size_t len, subpicture *dst)
                 }
                 verb(2,"  top=%d,bottom=%d, top+bottom=%d\n",objseg.top_length,
                  objseg.bottom_length,objseg.top_length+objseg.bottom_length);
-                verb(2,"  decoding pixel data to (%d,%d), size %d x %d\n",
-					reg.x,reg.y,reg.w,reg.h);
+                verb(2,"  decoding pixel data to (%d,%d) of region %d, size %d x %d\n",
+					o->x,o->y,r->id,r->w,r->h);
 
-                int row = 0;
-                byte *pix = dst->pix + reg.y * dst->w + reg.x;
-                byte *endp = p+objseg.top_length;
-                while (p < endp)
+                // decode the one object of a region as runs, any more over
+                // what is there already
+                if (r->objects++ && !r->raster)
                 {
-                    byte type = *(p++);
-                    switch (type)
-                    {
-                    case 0x10: twobit_coding(&pix,&p); break;
-                    case 0x11: fourbit_coding(&pix,&p); break;
-                    case 0x12: eightbit_coding(&pix,&p); break;
-                    case 0x20: p+=2; break;
-                    case 0x21: p+=4; break;
-                    case 0x22: p+=16; break;
-                    case 0xF0:
-                        pix = dst->pix + (reg.y + (row+=2)) * dst->w + reg.x;
-                        break;
-                    default: verb(1,"^%02X",type); break;
-                    }
+                    verb(2,"  more than one object in region %d, decoding into a raster\n",
+                     r->id);
+                    region_to_raster(r);
                 }
+                byte *endp = p+objseg.top_length;
+                p = decode_field(p,endp,r,o->x,o->y,0);
                 if (p > endp)
                 {
-                    verb(1,"ERROR: Top field overflow by %d bytes\n",p-endp);
+                    verb(1,"ERROR: Top field overflow by %td bytes\n",p-endp);
                     return;
                 }
-                row = 1;
-                pix = dst->pix + (reg.y +1) * dst->w + reg.x;
                 endp = p+objseg.bottom_length;
-                while (p < endp)
-                {
-                    byte type = *(p++);
-                    switch (type)
-                    {
-                    case 0x10: twobit_coding(&pix,&p); break;
-                    case 0x11: fourbit_coding(&pix,&p); break;
-                    case 0x12: eightbit_coding(&pix,&p); break;
-                    case 0x20: p+=2; break;
-                    case 0x21: p+=4; break;
-                    case 0x22: p+=16; break;
-                    case 0xF0:
-                        pix = dst->pix + (reg.y + (row+=2)) * dst->w + reg.x;
-                        break;
-                    default: verb(1,"_%02X",type); break;
-                    }
-                }
+                p = decode_field(p,endp,r,o->x,o->y,1);
                 if (p > endp)
                 {
-                    verb(1,"ERROR: Bottom field overflow by %d bytes\n",p-endp);
+                    verb(1,"ERROR: Bottom field overflow by %td bytes\n",p-endp);
                     return;
                 }
                 // step over possible word alignment byte
@@ -553,9 +804,14 @@ void decode_dvbsub(byte *data, size_t len, subpicture *dst)
 		case 0x14: verb(2,"display definition segment found, skipping\n");
 			p += subseg.segment_length; break;
         case 0x80: {
+			// e.o.d.s. signals the end of a subpicture definition, which
+			// with no regions to show is that of an empty page
+			if (show_regions(ctx,dst))
+				dst->live_state = DRAW;
+			else if (dst->live_state == STAY)
+				dst->live_state = WIPE;
 			verb(2," end of display set segment (subpicture: %d x %d)\n",
 			 dst->w,dst->h);
-			dst->live_state = DRAW;   // e.o.d.s. signals the end of a subpicture definition
             break; }
 		case 0xFF: verb(2," stuffing segment\n"); break;
 		default: if (subseg.segment_type >= 0x81 && subseg.segment_type <= 0xEF)
@@ -571,67 +827,373 @@ void decode_dvbsub(byte *data, size_t len, subpicture *dst)
 //
 // VobSub encoder model :
 
-byte * encode_rle_row(int w,byte *input,byte clut[],byte *p)
+// VobSub (and DVD) subtitles use the following encode sequences
+// (let one digit signify two bits and 'c' a palette index to be encoded) :
+// - special sequence 00 00 00 0c signals 'c till the end of the line'
+// - for 'c into klmn pixels' (with 'klmn' within 1-255) the sequences are
+// for j=klmn (in 64-255):  00 0k [lm] (nc)
+// for j= lmn (in 16-63):      00 [lm] (nc)
+// for j=  mn (in 4-15):           0m  (nc)
+// for j=   n (in 1-3):                 nc
+// i.e. the code is always j<<2 | c, in as many nibbles as rle_nibbles[j]
+static byte rle_nibbles[256];
+
+static void init_rle_once(void)
 {
-#define storenb(p,n) ((subix^=1) ? (*(p) = ((n)<<4)) : \
-                                    (*((p)++) |= ((byte) (n))&0xF))
-#define alignnb(p) ((subix) ? ++(p) + ((subix)=0) : p)
+	for (int j = 0; j < 256; j++)
+		rle_nibbles[j] = j < 4 ? 1 : j < 16 ? 2 : j < 64 ? 3 : 4;
+}
 
-    // VobSub (and DVD) subtitles use the following encode sequences
-    // (let one digit signify two bits and 'c' a palette index to be encoded) :
-    // - special sequence 00 00 00 0c signals 'c till the end of the line'
-    // - for 'c into klmn pixels' (with 'klmn' within 1-255) the sequences are
-    // for j=klmn (in 64-255):  00 0k [lm] (nc)
-    // for j= lmn (in 16-63):      00 [lm] (nc)
-    // for j=  mn (in 4-15):           0m  (nc)
-    // for j=   n (in 1-3):                 nc
+static void init_rle(void)
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	pthread_once(&once, init_rle_once);
+}
 
-    int i, j, subix=0;
+// codes are gathered MSB first into 'acc' and stored 4 bytes at a time
+struct nibbles {
+	qword acc;
+	int n;			// nibbles in acc not yet stored (< 8)
+	byte *p;
+};
 
-    for (i=0; i < w; i += j)
-    {
-		byte c = clut[input[i]];
-        for (j=1; i+j < w; j++)
-			if (clut[input[i+j]] != c) break;	// j=length
-        if (i+j == w && j > 63)
-        {
-            if (subix)  *(++p) = ( *(++p) = 0 ) | c << 4;
-            else        *(p++) = ( *(p++) = 0 ) | c;
-			break;                              // end of the line, exit
-        }
-		if (j > 255) j=255;
-        if (j > 15) storenb(p,0);    // store the leading '00' nibble
-        if (j > 63) storenb(p,j>>6); // store the '0k' nibble
-        if (j > 3)  storenb(p,j>>2); // store the '[lm]' or '0m' nibble
-                    storenb(p,j<<2 | c); // store the '(nc)' or 'nc' nibble
-    }
-    return alignnb(p);
+static inline void put_code(struct nibbles *nb, unsigned code, int n)
+{
+	nb->acc = nb->acc << 4*n | code;
+	nb->n += n;
+	if (nb->n >= 8)
+	{
+		nb->n -= 8;
+		unsigned bytes = htonl(nb->acc >> 4*nb->n);
+		memcpy(nb->p, &bytes, 4);
+		nb->p += 4;
+	}
+}
+
+// store what is left, padding to a whole byte at the end of a line
+static inline byte *flush_codes(struct nibbles *nb)
+{
+	if (nb->n & 1)
+		put_code(nb, 0, 1);
+	for (; nb->n > 0; nb->n -= 2)
+		*(nb->p++) = nb->acc >> 4*(nb->n-2);
+	return nb->p;
+}
+
+// map a line of pixels through clut[] into m[]
+static void map_row_scalar(int w, const byte *input, const byte clut[], byte *m)
+{
+	for (int i = 0; i < w; i++)
+		m[i] = clut[input[i]];
 }
 
-void encode_vobsub(byte *data, subpicture *src)
+#ifdef RLE_X86
+
+// 16 pixels at a time with pshufb, for as long as they index the first 16
+// entries of clut[] (i.e. always with 2- and 4-bit DVB subtitles)
+__attribute__((target("ssse3")))
+static void map_row_ssse3(int w, const byte *input, const byte clut[], byte *m)
 {
-	byte *p = data + 4, clut[256] = {0};
+	const __m128i lut = _mm_loadu_si128((const __m128i *) clut);
+	const __m128i high = _mm_set1_epi8(0xF0);
 	int i;
 
-    // map src->clut by 'y' value into greyscale table { 0, 0x13, 0x86, 0xD6 }
-    for (i=1; i < 256 && src->clut[i].y; i++)
-        clut[i] = src->clut[i].y < 0x50 ? 1
-         : src->clut[i].y < 0xBB ? 2 : 3;
+	for (i = 0; i + 16 <= w; i += 16)
+	{
+		__m128i x = _mm_loadu_si128((const __m128i *) (input + i));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(x, high),
+		 _mm_setzero_si128())) == 0xFFFF)
+			_mm_storeu_si128((__m128i *) (m + i), _mm_shuffle_epi8(lut, x));
+		else
+			map_row_scalar(16, input + i, clut, m + i);
+	}
+	map_row_scalar(w - i, input + i, clut, m + i);
+}
+
+#endif
+
+static void map_row(int w, const byte *input, const byte clut[], byte *m)
+{
+#ifdef RLE_X86
+	static int have_ssse3 = -1;
+	if (have_ssse3 < 0)
+		have_ssse3 = __builtin_cpu_supports("ssse3");
+	if (have_ssse3)
+	{
+		map_row_ssse3(w, input, clut, m);
+		return;
+	}
+#endif
+	map_row_scalar(w, input, clut, m);
+}
+
+// return the end of the run of pixels starting at m[i]; the line in m[]
+// must be followed by 16 bytes that differ from any colour
+static inline int run_end(const byte *m, int i)
+{
+	int k = i+1;
+#ifdef RLE_X86
+	const __m128i c = _mm_set1_epi8(m[i]);
+	for (;; k += 16)
+	{
+		unsigned diff = ~_mm_movemask_epi8(_mm_cmpeq_epi8(
+			_mm_loadu_si128((const __m128i *) (m + k)), c)) & 0xFFFF;
+		if (diff)
+			return k + __builtin_ctz(diff);
+	}
+#else
+	while (m[k] == m[i])
+		k++;
+	return k;
+#endif
+}
+
+// Put the codes for j pixels of pixel code c, the rest of the line if 'last'
+static void put_rle_run(struct nibbles *nb, int j, byte c, int last)
+{
+	while (j > 0)
+	{
+		if (last && j > 63)
+		{
+			put_code(nb, c, 4);		// 00 00 00 0c
+			return;					// end of the line
+		}
+		int k = j > 255 ? 255 : j;
+		put_code(nb, k<<2 | c, rle_nibbles[k]);
+		j -= k;
+	}
+}
+
+// Encode a row straight from the runs of the regions crossing it, given in
+// order of x with no overlap, merging the runs that map to the same code
+static byte *encode_runs_row(subpicture *src, struct subregion **cross, int n,
+ int y, byte clut[], byte *p)
+{
+	struct nibbles nb = { 0, 0, p };
+	int x = 0, len = 0;			// pixels encoded, and pending in ...
+	byte c = 0;					// ... this code
+
+#define RUN(j, code) do { \
+		byte c_ = (code); \
+		if (len > 0 && c_ != c) put_rle_run(&nb, len, c, 0), len = 0; \
+		c = c_; len += (j); } while (0)
+
+	for (int i = 0; i < n; i++)
+	{
+		struct subregion *r = cross[i];
+		int k = y - r->y;
+		if (r->x - src->x > x)
+			RUN(r->x - src->x - x, 0);
+		if (r->n[k] == 0)
+			RUN(r->w, clut[r->background]);
+		for (unsigned j = r->first[k]; j < r->first[k] + r->n[k]; j++)
+			RUN(r->run[j].len, clut[r->run[j].colour]);
+		x = r->x - src->x + r->w;
+	}
+	if (src->w > x)
+		RUN(src->w - x, 0);
+#undef RUN
+	put_rle_run(&nb, len, c, 1);
+	return flush_codes(&nb);
+}
+
+// Encode row 'row' of subpicture src, whose regions are given in order of x,
+// mapping their pixels through clut[] and leaving the rest transparent
+byte * encode_rle_row(subpicture *src,struct subregion **order,int row,byte clut[],byte *p)
+{
+	struct subregion *cross[src->n_regions];
+	int w = src->w, y = src->y + row, n = 0, runs = 1, x = 0;
+	int i, j, end = 0;
+
+	for (i=0; i < src->n_regions; i++)
+	{
+		struct subregion *r = order[i];
+		if (y < r->y || y >= r->y + r->h)
+			continue;
+		if (r->pix != NULL || r->x - src->x < x)
+			runs = 0;			// a raster, or overlapping regions
+		x = r->x - src->x + r->w;
+		cross[n++] = r;
+	}
+	if (n == 0 && w > 63)
+	{
+		*(p++) = 0; *(p++) = 0;		// 00 00 00 00: transparent to the end
+		return p;
+	}
+	if (runs)
+		return encode_runs_row(src, cross, n, y, clut, p);
+
+	// otherwise map a row of pixels, in which the regions are painted in turn
+	byte m[w + 16];
+	struct nibbles nb = { 0, 0, p };
+	memset(m, 0, w);
+	for (i=0; i < src->n_regions; i++)
+	{
+		struct subregion *r = &src->regions[i];
+		int k = y - r->y;
+		if (k < 0 || k >= r->h)
+			continue;
+		byte *d = m + r->x - src->x;
+		if (r->pix != NULL)
+			map_row(r->w, r->pix + k * r->w, clut, d);
+		else if (r->n[k] == 0)
+			memset(d, clut[r->background], r->w);
+		else for (unsigned q = r->first[k]; q < r->first[k] + r->n[k]; q++)
+		{
+			memset(d, clut[r->run[q].colour], r->run[q].len);
+			d += r->run[q].len;
+		}
+	}
+	memset(m + w, 0xFF, 16);
+
+	for (i=0; i < w; i += j)
+	{
+		if (i >= end)
+			end = run_end(m, i);
+		j = end - i;				// j=length
+		byte c = m[i];
+		if (end == w && j > 63)
+		{
+			put_code(&nb, c, 4);	// 00 00 00 0c
+			break;					// end of the line, exit
+		}
+		if (j > 255) j=255;
+		put_code(&nb, j<<2 | c, rle_nibbles[j]);
+	}
+	return flush_codes(&nb);
+}
+
+// Return the index of colour c (ITU-R BT.601 Y, Cr, Cb) in the palette,
+// adding it if new and there is room, or else the index of the nearest one
+static int palette_index(dvb_ctx *dvb, struct colour c)
+{
+	int y = 298 * (c.y - 16), cr = c.cr - 128, cb = c.cb - 128;
+	int rgb[3] = {
+		(y + 409*cr + 128) >> 8,
+		(y - 100*cb - 208*cr + 128) >> 8,
+		(y + 516*cb + 128) >> 8 };
+	dword colour = 0;
+	for (int k = 0; k < 3; k++)
+		colour = colour << 8 | (rgb[k] < 0 ? 0 : rgb[k] > 255 ? 255 : rgb[k]);
+
+	int i, best = 0;
+	long best_d = -1;
+	for (i = 0; i < dvb->palette_n; i++)
+	{
+		long d = 0;
+		for (int k = 16; k >= 0; k -= 8)
+		{
+			int e = (int) ((dvb->palette[i] >> k) & 0xFF) - (int) ((colour >> k) & 0xFF);
+			d += e * e;
+		}
+		if (d == 0)
+			return i;
+		if (best_d < 0 || d < best_d)
+		{ best = i; best_d = d; }
+	}
+	if (dvb->palette_n == 16)
+		return best;
+	dvb->palette[dvb->palette_n] = colour;
+	dvb->palette_changes++;
+	return dvb->palette_n++;
+}
+
+// Quantise the CLUT into the four pixel codes of vobsub: code 0 for the
+// transparent and undefined entries, codes 1-3 for the rest in order of Y,
+// either a colour each or, if there are more than three, the mean colour of
+// the entries in each of three bands of Y
+static void map_clut(dvb_ctx *dvb, const struct colour clut[256])
+{
+	struct colour c[4];
+	qword sum[4][5] = {{0}};	// y, cr, cb, t and entries of each code
+	int i, k, n = 0;
+
+	memset(dvb->code, 0, sizeof dvb->code);
+	for (i=0; i < 256 && n <= 3; i++)
+		if (clut[i].y && clut[i].t != 0xFF)
+		{
+			for (k=0; k < n && memcmp(&c[k], &clut[i], sizeof c[k]); k++);
+			if (k == n)
+				c[n++] = clut[i];
+		}
+	// with up to three colours, in order of Y, each gets a code of its own
+	for (i=1; i < n && n <= 3; i++)
+		for (k=i; k > 0 && c[k].y < c[k-1].y; k--)
+		{ struct colour t = c[k]; c[k] = c[k-1]; c[k-1] = t; }
+
+	for (i=0; i < 256; i++)
+		if (clut[i].y && clut[i].t != 0xFF)
+		{
+			if (n <= 3)
+				for (k=0; memcmp(&c[k], &clut[i], sizeof c[k]); k++);
+			else
+				k = clut[i].y < 0x50 ? 0 : clut[i].y < 0xBB ? 1 : 2;
+			dvb->code[i] = k+1;
+			sum[k+1][0] += clut[i].y; sum[k+1][1] += clut[i].cr;
+			sum[k+1][2] += clut[i].cb; sum[k+1][3] += clut[i].t;
+			sum[k+1][4]++;
+		}
+
+	dvb->colour[0] = dvb->alpha[0] = 0;		// palette entry 0 is black
+	for (k=1; k < 4; k++)
+	{
+		qword m = sum[k][4];
+		if (m == 0)
+		{ dvb->colour[k] = dvb->alpha[k] = 0; continue; }
+		struct colour mean = { sum[k][0]/m, sum[k][1]/m, sum[k][2]/m, sum[k][3]/m };
+		dvb->colour[k] = palette_index(dvb, mean);
+		dvb->alpha[k] = (0xFF - mean.t) >> 4;	// t counts up to transparent
+	}
+	dvb->clut_mapped = 1;
+}
+
+int vobsub_palette(subpicture *ctx, dword rgb[16])
+{
+	dvb_ctx *dvb = (dvb_ctx *) ctx->ctx;
+	for (int i = 0; i < 16; i++)
+		rgb[i] = i < dvb->palette_n ? dvb->palette[i] : 0;
+	return dvb->palette_changes;
+}
+
+// Encode src into data (VOBSUB_MAX(src->w,src->h) bytes)
+// Returns the length of the packet, or 0 if it would not fit in 64 KiB
+size_t encode_vobsub(byte *data, subpicture *src)
+{
+	dvb_ctx *dvb = (dvb_ctx *) src->ctx;
+	struct subregion *order[src->n_regions];
+	byte *p = data + 4;
+	int i, k;
+
+	init_rle();
+
+	// map src->clut to pixel codes, palette indices and alpha values
+	if (!dvb->clut_mapped)
+		map_clut(dvb, src->clut);
+
+	// the regions from left to right, for encoding a row a run at a time
+	for (i=0; i < src->n_regions; i++)
+	{
+		for (k=i; k > 0 && order[k-1]->x > src->regions[i].x; k--)
+			order[k] = order[k-1];
+		order[k] = &src->regions[i];
+	}
 
     for(i=0; i < src->h; i+=2)
-		p = encode_rle_row(src->w, src->pix + i * src->w, clut, p);
+		p = encode_rle_row(src, order, i, dvb->code, p);
 
     int bottom_ptr = p - data;
     for(i=1; i < src->h; i+=2)
-		p = encode_rle_row(src->w, src->pix + i * src->w, clut, p);
+		p = encode_rle_row(src, order, i, dvb->code, p);
     data[2] = (p-data) >> 8; data[3] = p-data;
 
 	byte dcsq[] = {
 		0,0,										// delay=0
 		data[2],data[3],                            // pointer to self
 		1,											// start display
-		3, 0x32, 0x10,								// set palette indices
-		4, 0xFF, 0xF0,								// set alpha values
+		3, dvb->colour[3]<<4 | dvb->colour[2],		// set palette indices
+		 dvb->colour[1]<<4 | dvb->colour[0],
+		4, dvb->alpha[3]<<4 | dvb->alpha[2],		// set alpha values
+		 dvb->alpha[1]<<4 | dvb->alpha[0],
 		5,											// set display area [bits]:
 		src->x>>4,                                  // left [11-4]
         src->x<<4 | (((src->x+src->w-1)>>8) & 0xF), // left [3-0], right [11-8]
@@ -643,24 +1205,118 @@ void encode_vobsub(byte *data, subpicture *src)
 		0xFF, 0xFF									// end command seq.
     };
 	memcpy(p, dcsq, sizeof dcsq);
-	size_t len = (p + sizeof dcsq - data) & 0xFFFE;
+	size_t len = (p + sizeof dcsq - data) & ~(size_t) 1;
+	if (len > 0xFFFF)
+		return 0;
 	data[0] = len >> 8; data[1] = len;
+	return len;
+}
+
+// Hash of everything the vobsub packet of a subpicture is made of: the
+// position, the size, the regions and what the CLUT maps their pixels to
+static qword subpicture_hash(subpicture *src, dvb_ctx *dvb)
+{
+	struct {
+		int x,y, w,h;
+		byte code[256], colour[4], alpha[4];
+	} key;
+	memset(&key, 0, sizeof key);
+	key.x = src->x; key.y = src->y; key.w = src->w; key.h = src->h;
+	memcpy(key.code, dvb->code, sizeof key.code);
+	memcpy(key.colour, dvb->colour, sizeof key.colour);
+	memcpy(key.alpha, dvb->alpha, sizeof key.alpha);
+	qword hash = hash64((const byte *) &key, sizeof key, 0);
+	for (int i = 0; i < src->n_regions; i++)
+	{
+		struct subregion *r = &src->regions[i];
+		int at[5] = { r->x, r->y, r->w, r->h, r->pix == NULL ? r->background : -1 };
+		hash = hash64((const byte *) at, sizeof at, hash);
+		if (r->pix != NULL)
+			hash = hash64(r->pix, (size_t) r->w * r->h, hash);
+		else for (int k = 0; k < r->h; k++)
+			hash = hash64((const byte *) (r->run + r->first[k]),
+			 r->n[k] * sizeof (struct pixel_run), hash);
+	}
+	return hash;
+}
+
+// Return the vobsub packet of subpicture src, from the cache if it has been
+// encoded lately or else encoded into the least recently drawn entry
+static byte *vobsub_packet(subpicture *src, dvb_ctx *dvb, qword hash)
+{
+	struct vobsub_packet *e = NULL;
+
+	for (int i = 0; i < VOBSUB_CACHE; i++)
+	{
+		struct vobsub_packet *c = &dvb->cache[i];
+		if (c->used && c->hash == hash && c->x == src->x && c->y == src->y
+		 && c->w == src->w && c->h == src->h)
+		{
+			c->used = ++dvb->draws;
+			STATS_ADD(reused,1);
+			return c->data;
+		}
+		if (e == NULL || c->used < e->used)
+			e = c;
+	}
+
+	if (e->size < VOBSUB_MAX(src->w,src->h))
+	{
+		e->size = VOBSUB_MAX(src->w,src->h);
+		e->data = (byte *) realloc(e->data,e->size);
+	}
+	STATS_START(t);
+	size_t size = encode_vobsub(e->data,src);
+	STATS_STOP(t_encode,t);
+	if (size == 0)
+	{
+		e->used = 0;
+		return NULL;
+	}
+	*e = (struct vobsub_packet) { hash, src->x,src->y, src->w,src->h, ++dvb->draws,
+	 e->data, e->size };
+	return e->data;
 }
 
 byte *dvb2vobsub_translation(byte *data,size_t len,subpicture *ctx)
 {
+	STATS_START(t);
 	decode_dvbsub(data,len,ctx);
+	STATS_STOP(t_decode,t);
 
     switch (ctx->live_state)
 	{
         case NONE: case STAY: return NULL;      // No operation right now
         case DRAW:                      // New subpicture to display
-            data = (byte *) malloc(ctx->w*ctx->h + 25); // Maximum sub size?
-            encode_vobsub(data,ctx);
-            return data;
+        {
+            dvb_ctx *dvb = (dvb_ctx *) ctx->ctx;
+            if (!dvb->clut_mapped)
+                map_clut(dvb, ctx->clut);
+            t = stats_enabled ? stats_clock() : 0;
+            qword hash = subpicture_hash(ctx,dvb);
+            STATS_STOP(t_encode,t);
+            // the same display set over again, e.g. at an acquisition point
+            if (dvb->showing && hash == dvb->shown)
+            {
+                STATS_ADD(coalesced,1);
+                return NULL;
+            }
+            byte *vobsub = vobsub_packet(ctx,dvb,hash);
+            if (vobsub == NULL)
+            {
+                verb(1,"ERROR: %dx%d subpicture too large for a vobsub packet\n",
+                 ctx->w,ctx->h);
+                return NULL;
+            }
+            dvb->showing = 1; dvb->shown = hash;
+            STATS_ADD(drawn,1);
+            return vobsub;
+        }
         case WIPE:                      // Wipe off prev. picture at this PTS
         {
-            const byte spu_stop_packet[] = {
+            ((dvb_ctx *) ctx->ctx)->showing = 0;
+            STATS_ADD(wiped,1);
+            static byte spu_stop_packet[] = {
                 0,24,               // #  0  size of this packet
                 0,5,                // #  2  DCSQ address
                 0x40,               // #  4  run-length for 1 pixel of colour 0
@@ -672,9 +1328,7 @@ byte *dvb2vobsub_translation(byte *data,size_t len,subpicture *ctx)
                 0x06, 0,4,0,4,      // # 18  offset to top & bottom field
                 0xFF                // # 23  quit
             };
-            data = (byte *) malloc(sizeof spu_stop_packet);
-            memcpy(data,spu_stop_packet,sizeof spu_stop_packet);
-            return data;
+            return spu_stop_packet;
         }
     }
 	verb(1,"ERROR: DVBsub decoder has unspecified state %d\n",
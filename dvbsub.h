@@ -22,10 +22,25 @@ typedef unsigned long long qword;
 enum live_state_flag { WIPE, NONE, DRAW, STAY };
 struct colour { byte y,cr,cb,t; }; // values as per ITU-R BT.601
 
+// A run of pixels of one colour
+struct pixel_run { word len, colour; };
+
+// A region of a subpicture, positioned on the page like the subpicture
+struct subregion {
+    int x,y, w,h;
+    byte *pix;                  // pixel data as indexes to the clut, or NULL
+    // if kept as runs instead: row k is n[k] runs from run[first[k]] on,
+    // which span the row, or with n[k] == 0 all of it in the background
+    struct pixel_run *run;
+    unsigned *first, *n;
+    byte background;
+};
+
 typedef struct {
     enum live_state_flag live_state;	// see above
-    int x,y, w,h;               // left, top, width, height
-    byte *pix;                  // pixel data as indexes to the clut
+    int x,y, w,h;               // left, top, width, height, enclosing the regions
+    struct subregion *regions;  // the regions on display, each in a buffer of its
+    int n_regions;              // own; nothing else of the rectangle is shown
 	struct colour clut[256];
 	void *ctx;	// internal context data for continuous dvbsub processing
 } subpicture;
@@ -35,6 +50,8 @@ typedef struct {
 // 0 =none; 1 =errors; 2 =decoded subtitling segments; 3 =both
 // NOTE: level gets overridden by env. variable SUB_VERBOSE, if found
 // NOTE: -DVERBOSE is needed when compiling dvbsub.c to actually enable output
+// NOTE: implemented in trace.c, which also describes the other levels and the
+// output formats available through env. variable SUB_TRACE
 void init_verbose(int level);
 
 // Initialize and return a new context for dvbsub stream decoding
@@ -47,15 +64,34 @@ void release_subp(subpicture subp);
 // Decode given data, update live_state and fill in possible decoded picture
 void decode_dvbsub(byte *data, size_t len, subpicture *dst);
 
+// Return the pixel at x,y of the page in a decoded subpicture, 0 outside its
+// regions; slow, e.g. for printing the subpicture when debugging
+byte subpicture_pixel(const subpicture *subp, int x, int y);
+
 /////////////
 // The following is implemented in dvbsub.c iff -DVOBSUB is given on compile :
 
+// Upper bound on the size of the vobsub packet of a w x h subpicture :
+// no run code takes more nibbles than it has pixels, so a line takes at
+// most (w+1)/2 bytes with its padding; add the 4-byte packet header and
+// the 25-byte display control sequence
+#define VOBSUB_MAX(w,h) (4 + (size_t) (h) * (((w)+1)/2) + 25)
+
 // Decode a dvbsub packet in 'data' with length 'len' and encode the
 // possible generated subpicture into a bare vobsub packet
 // (w/o the PS headers and stuffing needed in an actual .sub file)
-// Returns the generated packet or NULL if no draw or wipe is to be done
-// NOTE: freeing of the returned data pointer ('p') is up to the caller;
-// length of the vobsub packet can be determined by p[0]<<8 | p[1]
+// Returns the generated packet or NULL if no draw or wipe is to be done,
+// which includes drawing again what is already on display
+// NOTE: the returned packet ('p') lives in a buffer of ctx, which may be
+// reused by the next call; length of the packet can be determined by
+// p[0]<<8 | p[1]
+// NOTE: the packets of the latest few subpictures are kept, so that one
+// recurring (e.g. resent at an acquisition point) is not encoded again
 byte *dvb2vobsub_translation(byte *data,size_t len,subpicture *ctx);
 
+// Fill in the 16-colour palette (0xRRGGBB) the vobsub packets so far refer
+// to, as quantised from the CLUTs of the stream one CLUT version at a time
+// Returns the number of times it has changed, for telling whether it has
+int vobsub_palette(subpicture *ctx, dword rgb[16]);
+
 #endif
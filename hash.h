@@ -0,0 +1,91 @@
+/*
+
+ 64-bit hash of a run of bytes for telling repeated content apart, e.g. a
+ subpicture resent at each acquisition point
+
+ This is XXH64 (https://xxhash.com), which takes 32 bytes a round in four
+ independent lanes. Words are read in host byte order, so that hashes are
+ only comparable within one host, which is all that is asked of them here
+
+ The hash is header-only so that its one user inlines it fully
+
+*/
+
+#ifndef __HASH_H
+#define __HASH_H
+
+#include <string.h>
+#include "dvbsub.h"
+
+#define XXH_P1 11400714785074694791ULL
+#define XXH_P2 14029467366897019727ULL
+#define XXH_P3 1609587929392839161ULL
+#define XXH_P4 9650029242287828579ULL
+#define XXH_P5 2870177450012600261ULL
+
+static inline qword xxh_rotl(qword x, int r)
+{
+	return x << r | x >> (64 - r);
+}
+
+static inline qword xxh_round(qword acc, qword input)
+{
+	return xxh_rotl(acc + input * XXH_P2, 31) * XXH_P1;
+}
+
+static inline qword xxh_merge(qword h, qword v)
+{
+	return (h ^ xxh_round(0, v)) * XXH_P1 + XXH_P4;
+}
+
+static inline qword xxh_read64(const byte *p)
+{
+	qword w;
+	memcpy(&w, p, 8);
+	return w;
+}
+
+// Hash 'len' bytes at 'p', starting from 'seed' (e.g. the hash of a header)
+static inline qword hash64(const byte *p, size_t len, qword seed)
+{
+	const byte *end = p + len;
+	qword h;
+
+	if (len >= 32)
+	{
+		qword v1 = seed + XXH_P1 + XXH_P2, v2 = seed + XXH_P2;
+		qword v3 = seed, v4 = seed - XXH_P1;
+		for (; end - p >= 32; p += 32)
+		{
+			v1 = xxh_round(v1, xxh_read64(p));
+			v2 = xxh_round(v2, xxh_read64(p + 8));
+			v3 = xxh_round(v3, xxh_read64(p + 16));
+			v4 = xxh_round(v4, xxh_read64(p + 24));
+		}
+		h = xxh_rotl(v1, 1) + xxh_rotl(v2, 7) + xxh_rotl(v3, 12) + xxh_rotl(v4, 18);
+		h = xxh_merge(h, v1); h = xxh_merge(h, v2);
+		h = xxh_merge(h, v3); h = xxh_merge(h, v4);
+	}
+	else
+		h = seed + XXH_P5;
+	h += len;
+
+	for (; end - p >= 8; p += 8)
+		h = xxh_rotl(h ^ xxh_round(0, xxh_read64(p)), 27) * XXH_P1 + XXH_P4;
+	if (end - p >= 4)
+	{
+		unsigned w;
+		memcpy(&w, p, 4);
+		h = xxh_rotl(h ^ (qword) w * XXH_P1, 23) * XXH_P2 + XXH_P3;
+		p += 4;
+	}
+	for (; p < end; p++)
+		h = xxh_rotl(h ^ *p * XXH_P5, 11) * XXH_P1;
+
+	h ^= h >> 33; h *= XXH_P2;
+	h ^= h >> 29; h *= XXH_P3;
+	h ^= h >> 32;
+	return h;
+}
+
+#endif
@@ -0,0 +1,339 @@
+/*
+	Input backends for sequential reading of recordings; see input.h
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+
+#include "input.h"
+
+#define STREAM_BUFSIZE (1 << 20)	// size of each of the two stream buffers
+#define DROP_CHUNK (16 << 20)		// release consumed mmap pages this often
+
+struct buffer {
+	byte *mem;		// INPUT_MAX_PEEK bytes of headroom, then the data
+	byte *data;
+	size_t len;
+	int full, eof;	// set by the reader thread, 'full' cleared by the consumer
+};
+
+struct input {
+	int fd;
+	enum input_backend backend;
+	byte *cur, *end;	// unread part of the current window
+	int last;			// no data follows the current window
+	qword position;		// bytes consumed so far
+
+	// mmap backend
+	byte *map;
+	off_t size, dropped;
+
+	// stream backend
+	struct buffer buf[2];
+	int active;			// buffer being consumed
+	int seekable, quit;
+	off_t offset;		// file offset of the next read
+	pthread_t reader;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	// following a file still being written
+	int follow;			// idle timeout in seconds, 0 =not following
+	int inotify;		// watching the file for writes and its closing
+	int wake;			// eventfd to get the reader out of poll() on close
+	int closed;			// the writer is done with the file
+};
+
+/////////////////////////////////
+//
+// mmap backend :
+
+static int open_mmap(input *in)
+{
+	struct stat st;
+	if (fstat(in->fd, &st) || !S_ISREG(st.st_mode))
+		return -1;
+	in->size = st.st_size;
+	in->last = 1;
+	if (in->size == 0)
+		return 0;
+	if ((in->map = mmap(NULL, in->size, PROT_READ, MAP_SHARED, in->fd, 0)) == MAP_FAILED)
+	{ in->map = NULL; return -1; }
+	madvise(in->map, in->size, MADV_SEQUENTIAL);
+	in->cur = in->map; in->end = in->map + in->size;
+	return 0;
+}
+
+// give back the pages (and the page cache) of everything consumed so far
+static void drop_pages(input *in)
+{
+	off_t upto = (in->cur - in->map) & ~((off_t) sysconf(_SC_PAGESIZE) - 1);
+	if (upto <= in->dropped)
+		return;
+	madvise(in->map + in->dropped, upto - in->dropped, MADV_DONTNEED);
+	posix_fadvise(in->fd, in->dropped, upto - in->dropped, POSIX_FADV_DONTNEED);
+	in->dropped = upto;
+}
+
+/////////////////////////////////
+//
+// stream backend :
+
+// Wait for the file being followed to grow, without polling it
+// Returns 1 when there may be more to read, and 0 once the last write has
+// been read, the idle timeout passes or the input is being closed
+static int wait_growth(input *in)
+{
+	char events[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	struct pollfd pfd[2] = { { in->inotify, POLLIN }, { in->wake, POLLIN } };
+
+	if (in->closed)
+		return 0;			// the read after closing was the last one
+	while (1)
+	{
+		int r = poll(pfd, 2, in->follow * 1000);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0 || pfd[1].revents)
+		{
+			if (r == 0)
+				fprintf(stderr,"No more input in %d s, giving up on following it\n",in->follow);
+			return 0;
+		}
+		ssize_t len = read(in->inotify, events, sizeof events);
+		for (char *e = events; len > 0 && e < events + len;
+		 e += sizeof (struct inotify_event) + ((struct inotify_event *) e)->len)
+			if (((struct inotify_event *) e)->mask & (IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF))
+				in->closed = 1;
+		return 1;
+	}
+}
+
+static void *reader_thread(void *arg)
+{
+	input *in = (input *) arg;
+
+	for (int i = 0; ; i ^= 1)
+	{
+		struct buffer *b = &in->buf[i];
+
+		pthread_mutex_lock(&in->lock);
+		while (b->full && !in->quit)
+			pthread_cond_wait(&in->cond, &in->lock);
+		int quit = in->quit;
+		pthread_mutex_unlock(&in->lock);
+		if (quit)
+			break;
+
+		size_t len = 0;
+		ssize_t r = 1;
+		int eof = 0;
+		while (len < STREAM_BUFSIZE)
+		{
+			r = in->seekable
+				? pread(in->fd, b->data + len, STREAM_BUFSIZE - len, in->offset)
+				: read(in->fd, b->data + len, STREAM_BUFSIZE - len);
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r == 0 && in->follow)
+			{
+				// caught up with the writer: hand over what there is
+				// right away, or else wait for more
+				if (len > 0)
+					break;
+				if (wait_growth(in))
+					continue;
+			}
+			if (r <= 0)
+			{
+				eof = 1;
+				break;
+			}
+			len += r; in->offset += r;
+		}
+		if (r < 0)
+			fprintf(stderr,"Read error: %s\n",strerror(errno));
+
+		pthread_mutex_lock(&in->lock);
+		b->len = len; b->eof = eof; b->full = 1;
+		pthread_cond_broadcast(&in->cond);
+		pthread_mutex_unlock(&in->lock);
+		if (eof)
+			break;
+	}
+	return NULL;
+}
+
+static int open_stream(input *in)
+{
+	for (int i = 0; i < 2; i++)
+	{
+		if ((in->buf[i].mem = malloc(INPUT_MAX_PEEK + STREAM_BUFSIZE)) == NULL)
+			return -1;
+		in->buf[i].data = in->buf[i].mem + INPUT_MAX_PEEK;
+	}
+	in->offset = lseek(in->fd, 0, SEEK_CUR);
+	in->seekable = in->offset != (off_t) -1;
+	if (!in->seekable)
+		in->offset = 0;
+	else
+		posix_fadvise(in->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	// start out with an empty window in front of the first buffer
+	in->active = 1;
+	in->cur = in->end = in->buf[1].data;
+	in->buf[1].full = 1;
+
+	pthread_mutex_init(&in->lock, NULL);
+	pthread_cond_init(&in->cond, NULL);
+	return pthread_create(&in->reader, NULL, reader_thread, in) ? -1 : 0;
+}
+
+// move on to the other buffer, carrying the unread tail of the current one
+// over into the headroom in front of the new data
+static void next_buffer(input *in)
+{
+	struct buffer *b = &in->buf[in->active], *n = &in->buf[in->active ^ 1];
+	size_t tail = in->end - in->cur;
+
+	pthread_mutex_lock(&in->lock);
+	while (!n->full)
+		pthread_cond_wait(&in->cond, &in->lock);
+	pthread_mutex_unlock(&in->lock);
+
+	memcpy(n->data - tail, in->cur, tail);
+	in->cur = n->data - tail;
+	in->end = n->data + n->len;
+	in->last = n->eof;
+	in->active ^= 1;
+
+	pthread_mutex_lock(&in->lock);
+	b->full = 0;
+	pthread_cond_broadcast(&in->cond);
+	pthread_mutex_unlock(&in->lock);
+}
+
+/////////////////////////////////
+//
+// Common interface :
+
+input *input_open(const char *name, enum input_backend backend, int follow)
+{
+	input *in = (input *) calloc(1, sizeof (input));
+	if (in == NULL)
+		return NULL;
+	in->inotify = in->wake = -1;
+	if ((in->fd = name ? open(name, O_RDONLY) : STDIN_FILENO) < 0)
+	{ free(in); return NULL; }
+
+	// a growing file is read as a stream, waking up on inotify events
+	if (follow && name)
+	{
+		if ((in->inotify = inotify_init1(IN_CLOEXEC)) < 0
+		 || inotify_add_watch(in->inotify, name,
+		  IN_MODIFY | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF) < 0
+		 || (in->wake = eventfd(0, EFD_CLOEXEC)) < 0)
+		{ fprintf(stderr,"Unable to follow %s: %s\n",name,strerror(errno)); input_close(in); return NULL; }
+		if (backend == IO_MMAP)
+			fprintf(stderr,"Unable to follow a mapped file, reading it as a stream\n");
+		backend = IO_STREAM;
+		in->follow = follow;
+	}
+
+	if (backend != IO_STREAM && open_mmap(in) == 0)
+		in->backend = IO_MMAP;
+	else if (backend == IO_MMAP)
+		fprintf(stderr,"Unable to mmap input, reading it as a stream\n");
+	if (in->backend != IO_MMAP)
+	{
+		in->last = 0;
+		if (open_stream(in))
+		{ fprintf(stderr,"Unable to set up input buffers\n"); input_close(in); return NULL; }
+		in->backend = IO_STREAM;
+	}
+	return in;
+}
+
+input *input_open_range(const char *name, qword from, qword to)
+{
+	input *in = (input *) calloc(1, sizeof (input));
+	if (in == NULL)
+		return NULL;
+	in->inotify = in->wake = -1;
+	if ((in->fd = open(name, O_RDONLY)) < 0 || open_mmap(in))
+	{ input_close(in); return NULL; }
+	in->backend = IO_MMAP;
+
+	if (to > in->size)
+		to = in->size;
+	if (from > to)
+		from = to;
+	in->cur = in->map + from; in->end = in->map + to;
+	in->position = from;
+	in->dropped = from & ~((off_t) sysconf(_SC_PAGESIZE) - 1);
+	return in;
+}
+
+void input_close(input *in)
+{
+	if (in->backend == IO_MMAP && in->map)
+		munmap(in->map, in->size);
+	if (in->backend == IO_STREAM)
+	{
+		if (in->wake >= 0)
+			eventfd_write(in->wake, 1);
+		pthread_mutex_lock(&in->lock);
+		in->quit = 1;
+		pthread_cond_broadcast(&in->cond);
+		pthread_mutex_unlock(&in->lock);
+		pthread_join(in->reader, NULL);
+		pthread_mutex_destroy(&in->lock);
+		pthread_cond_destroy(&in->cond);
+	}
+	for (int i = 0; i < 2; i++)
+		free(in->buf[i].mem);
+	if (in->fd != STDIN_FILENO)
+		close(in->fd);
+	if (in->inotify >= 0)
+		close(in->inotify);
+	if (in->wake >= 0)
+		close(in->wake);
+	free(in);
+}
+
+size_t input_peek(input *in, size_t need, byte **p)
+{
+	while ((size_t) (in->end - in->cur) < need && !in->last)
+		next_buffer(in);
+	*p = in->cur;
+	return in->end - in->cur;
+}
+
+void input_skip(input *in, size_t n)
+{
+	in->cur += n;
+	in->position += n;
+	if (in->map && in->cur - in->map - in->dropped >= DROP_CHUNK)
+		drop_pages(in);
+}
+
+qword input_position(input *in)
+{
+	return in->position;
+}
+
+enum input_backend input_backend(input *in)
+{
+	return in->backend;
+}
@@ -0,0 +1,62 @@
+/*
+
+ Input layer for vdrsub: sequential reading of a recording with pointers
+ handed out straight into the read buffer, i.e. without a copy per packet
+
+ Backends :
+ -mmap maps the whole file, advises sequential access and drops the pages
+  that have already been consumed (regular files only)
+ -stream reads into two alternating buffers on a separate reader thread,
+  using pread() on seekable files and read() on pipes, sockets etc.
+
+ A file still being written (e.g. a recording in progress) can be followed:
+ at its end the stream backend hands over what it has read and sleeps on
+ inotify until the file grows, is closed by its writer, or stays idle for
+ too long, which is when the input ends
+
+*/
+
+#ifndef __INPUT_H
+#define __INPUT_H
+
+#include <stddef.h>
+#include "dvbsub.h"
+
+enum input_backend { IO_AUTO, IO_MMAP, IO_STREAM };
+
+// Largest contiguous span that may be requested from input_peek(),
+// enough to hold a maximum-size PES packet (6 + 65535 bytes) in one piece
+#define INPUT_MAX_PEEK (6 + 65535 + 1)
+
+typedef struct input input;
+
+// Open the named file (or standard input when name is NULL) for reading
+// IO_AUTO selects mmap for regular files and the stream backend otherwise
+// 'follow' >0 follows the named file as it grows, for up to 'follow'
+// seconds without new data, and implies the stream backend
+// Returns NULL if the file cannot be opened
+input *input_open(const char *name, enum input_backend backend, int follow);
+
+// Open bytes 'from' to 'to' of the named regular file with the mmap backend,
+// e.g. for one of several threads scanning parts of it; the position starts
+// out at 'from' rather than 0. Returns NULL if the file cannot be mapped
+input *input_open_range(const char *name, qword from, qword to);
+
+// Release the buffers and close the file (standard input is left open)
+void input_close(input *in);
+
+// Set *p to the current position and return the number of contiguous bytes
+// available there, which is at least 'need' (<= INPUT_MAX_PEEK) except at
+// the end of input; the data remains valid until the next input_peek()
+size_t input_peek(input *in, size_t need, byte **p);
+
+// Advance the current position by 'n' bytes, at most as many as last peeked
+void input_skip(input *in, size_t n);
+
+// Return the number of bytes consumed (skipped) so far
+qword input_position(input *in);
+
+// Return the backend actually in use
+enum input_backend input_backend(input *in);
+
+#endif
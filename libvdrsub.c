@@ -0,0 +1,1330 @@
+/*
+	Conversion of the DVB subtitles of a TS or .VDR stream; see libvdrsub.h
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "libvdrsub.h"
+#include "trace.h"
+#include "pidfilter.h"
+#include "stats.h"
+#include "bits.h"
+#include "tsread.h"
+
+#define NETWORD(x) (x = (word) ntohs(x))
+
+// Buffer for putting together a PES packet or PSI section split over TS
+// packets, or the subtitle payload of consecutive .VDR PES packets
+// NOTE: allocated once at the largest size expected and then reused, so
+// that there are no allocator calls in steady state
+struct reassembly {
+	byte *data;
+	size_t size, len;		// allocated, currently held
+	size_t complete_len;	// length expected in total, -1 =not known
+	byte counter;			// last TS continuity_counter (16 =none yet)
+};
+
+#define PES_MAX (6 + 65535)		// header + maximum PES_packet_length
+#define PSI_MAX (3 + 4095)		// header + maximum section_length
+
+#define VDRSUB_BLOCK 1024	// TS packets filtered at once
+#define VDRSUB_TRACKS 64	// subtitle tracks converted at once, at most
+#define VDRSUB_PROGRAMS 64	// programs of a TS followed, at most
+
+// A program the PAT lists, and what its PMT tells of it
+struct program {
+	word number, pmt_pid;
+	byte version;				// of the PMT last parsed, 0xFF =none yet
+	word video_pid;				// 0xFFFF =none listed
+	qword first_video_pts;		// 0 =not yet
+	struct reassembly pmt;		// its PMT section, when split over TS packets
+};
+
+// A subtitle track being converted, i.e. a subtitling descriptor entry
+struct track {
+	struct vdrsub_stream s;		// its PID, language and page ids
+	struct program *prog;		// whose video its PTS count from, NULL =v->psi
+	void *user;					// passed to the callbacks of its subpictures
+	subpicture subp;			// the subpicture decoding context
+	struct reassembly sub_pes;	// the subtitle PES packet being put together
+	qword sub_pes_first;		// offset of the TS packet sub_pes began in
+	byte *pages;				// when the PID carries other tracks too, the
+								// segments of its own pages are picked into here
+	byte version;				// of the PMT that last listed it
+};
+
+struct vdrsub {
+	struct vdrsub_config cfg;
+	struct vdrsub_callbacks cb;
+	void *user;
+
+	struct track track[VDRSUB_TRACKS];	// the one chosen, or with cfg.all_tracks
+	int tracks;					// ... all found so far
+	struct vdrsub_psi psi;		// PIDs and ids found in the TS
+	struct program program[VDRSUB_PROGRAMS];	// those of the PAT chosen
+	int programs;
+	byte pat_version;			// of the PAT last parsed whole, 0xFF =none yet
+	int psi_changes;			// programs and PMTs taken on, video PTS found
+	qword packet_offset;		// in the input, of the TS or .VDR PES packet at hand
+	int packet_index;			// TS packets parsed, for tracing
+
+	struct reassembly psi_section;	// the PAT; each PMT is put together in its program
+
+	// Only used when processing a .VDR file
+	struct reassembly pes_data;	// aggregate subtitle PES payload here
+	qword pes_pts;				// obtain PTS from each leading packet
+
+	struct pid_filter pf;		// PIDs process_ts_packet() has any use for
+
+	// Only used by vdrsub_push(): a TS packet or .VDR PES packet split
+	// between pushes, and the offset in the input where it begins; while a
+	// TS is out of sync, the bytes being searched for TS_LOCK_COUNT packets
+	byte *carry;
+	size_t carry_len;
+	qword position;
+	int locked;
+};
+
+// the headers below are parsed by copying them into structs as they are
+#pragma pack(1)
+
+// Append at most up to complete_len (if known), growing the buffer only if
+// the data exceeds the size given above
+static void reassembly_add(struct reassembly *r, byte *p, size_t len)
+{
+	if (r->complete_len != -1 && len > r->complete_len - r->len)
+		len = r->complete_len - r->len;
+	if (r->data == NULL || r->len + len > r->size)
+	{
+		size_t size = r->size;
+		byte *data;
+		while (r->len + len > size)
+			size *= 2;
+		if ((data = (byte *) realloc(r->data, size)) == NULL)
+		{ verb(1,"Out of memory for %zu bytes, dropping %zu\n",size,len); return; }
+		r->data = data; r->size = size;
+	}
+	memcpy(r->data + r->len, p, len);
+	r->len += len;
+}
+
+// Tell if the .VDR payload aggregated so far is a whole display set, i.e.
+// its segments run up to the end marker with end_of_display_set last
+static int display_set_complete(struct reassembly *pes_data)
+{
+	byte *p = pes_data->data + 2, *end = pes_data->data + pes_data->len - 1;
+	int type = 0;
+
+	if (pes_data->len < 3 || *end != 0xFF)
+		return 0;
+	while (p + 6 <= end && p[0] == 0x0F)
+	{
+		type = p[1];
+		p += 6 + (p[4] << 8 | p[5]);
+	}
+	return p == end && type == 0x80;
+}
+
+// Pick the segments of the pages of track 't' out of the subtitling segments
+// (and end marker) at 'p', into t->pages; returns their length with the marker
+static size_t own_pages(struct track *t, const byte *p, size_t length)
+{
+	const byte *end = p + length - 1;
+	byte *q = t->pages;
+
+	while (p + 6 <= end && p[0] == 0x0F)
+	{
+		word page = ((word) p[2]) << 8 | p[3];
+		size_t len = 6 + (((word) p[4]) << 8 | p[5]);
+		if (p + len > end)
+			break;
+		if (page == t->s.page[0] || page == t->s.page[1])
+		{ memcpy(q,p,len); q += len; }
+		p += len;
+	}
+	*(q++) = 0xFF;
+	return q - t->pages;
+}
+
+static void process_dvbsub_data(vdrsub *v, struct track *t, byte *p, size_t length, qword pts)
+{
+	// When carrying a DVB subtitle stream, PES packet data content is:
+	// 1 byte : data_identifier 				=0x20
+	// 1 byte : subtitle_stream_id				=0x00
+	//  bytes : subtitling_segments  (begin with 0x0F)
+	// 1 byte : end_of_PES_data_field_marker	=0xFF
+
+	if (length < 3 || p[0] != 0x20 || p[1] != 0x00)
+		return;
+	p += 2; length -= 2;
+	if (t->pages)
+	{
+		if ((length = own_pages(t,p,length)) <= 1)
+			return;
+		p = t->pages;
+	}
+
+	verb(16,"Processing dvbsub data length=%zu\n",length);
+	subpicture *subp = &t->subp;
+	byte *vobsub = NULL;
+	if (v->cb.vobsub)
+	{
+		if ((vobsub = dvb2vobsub_translation(p,length-1,subp)) == NULL)
+			return;
+	}
+	else
+	{
+		// only decode, there being no one for the vobsub packets
+		STATS_START(t);
+		decode_dvbsub(p,length-1,subp);
+		STATS_STOP(t_decode,t);
+		if (subp->live_state != DRAW && subp->live_state != WIPE)
+			return;
+	}
+	pts -= t->prog ? t->prog->first_video_pts : v->psi.first_video_pts;
+	float s=pts/90000.0;
+	
+#ifdef VERBOSE
+	if (subp->live_state == DRAW)
+	{ verb(4,"%02d:%02d:%02d:%03d :\n",
+	 (int) s/3600,(int) (s/60) % 60,(int) s % 60,
+	 (int) ((s-((int) s))*1000));
+	if (verb_on(8))
+		for (int i=0; i<subp->h; i++, verb(8,"\n"))
+			for (int j=0; j<subp->w && j<80; j++)
+				verb(8,"%c",' '+subpicture_pixel(subp,subp->x + j,subp->y + i)); }
+	else
+		verb(4,"---> %02d:%02d:%02d:%03d\n-----------------\n",
+		 (int) s/3600,(int) (s/60) % 60,(int) s % 60,
+		 (int) ((s-((int) s))*1000));
+	if (vobsub && (verbose_level & 32768))
+	{
+		FILE *raw = fopen("vobsub.dat","ab");
+		fwrite(vobsub,1,((word) vobsub[0])<<8 | vobsub[1],raw);
+		fclose(raw);
+	}	 
+#endif
+
+	if (v->cb.subpicture)
+		v->cb.subpicture(t->user, subp, pts);
+	if (vobsub)
+		v->cb.vobsub(t->user, subp, vobsub, ((word) vobsub[0])<<8 | vobsub[1], pts);
+}
+
+// A run of bytes within a packet, valid for as long as the packet is
+struct view {
+	byte *data;
+	size_t len;
+};
+
+// Parsed PES packet header; the variable-length parts are views into the
+// packet, so parsing never allocates
+struct pes_header {
+	byte sync_bytes[3];
+	byte stream_id;
+	word packet_length;
+
+	word flags;
+	byte pes_header_length;
+
+	qword pts, dts;
+	qword escr_base;
+	word escr_ext;
+	qword es_rate;
+
+	byte trick;
+	byte copy_info;
+	word prev_crc;
+
+	byte ext_flags;
+	struct view pes_private;
+	struct view pack_header;
+
+	byte seq_counter;
+	byte orig_stuff_length;
+	word p_std;
+};
+
+// 'len' bytes of the packet are available at 'data'; a subtitle packet is
+// of track 't', a video one of program 'pr' (NULL =that of v->psi)
+static void process_pes_packet(vdrsub *v, struct track *t, struct program *pr, byte data[], size_t len)
+{
+	byte *p = data;
+
+	struct pes_header pes = { .pts = 0 };
+	if (len < 6)
+	{ verb(1,"PES: packet of %zu bytes is too short\n",len); return; }
+	memcpy(&pes,p,6); p+=6;
+
+	NETWORD(pes.packet_length);
+
+	verb(32,"PES: %d bytes, type id 0x%02X: ",pes.packet_length+6,pes.stream_id);
+	switch (pes.stream_id)
+	{
+	case 0xBC: verb(32,"Program stream map\n"); return;
+	case 0xBD: verb(32,"Subtitles, i.e. Private stream 1\n"); break;
+	case 0xBE: verb(32,"Padding stream\n"); return;
+	case 0xBF: verb(32,"Private stream 2\n"); return;
+	case 0xF0: verb(32,"ECM stream\n"); return;
+	case 0xF1: verb(32,"EMM stream\n"); return;
+	case 0xF2: verb(32,"ITU-T Rec. H.222.0 | ISO/IEC 13818-1-A etc.\n"); return;
+	case 0xF3: verb(32,"ISO/IEC_13522 stream\n"); break;
+	case 0xF4: verb(32,"ITU-T Rec. H.222.1 type A\n"); break;
+	case 0xF5: verb(32,"ITU-T Rec. H.222.1 type B\n"); break;
+	case 0xF6: verb(32,"ITU-T Rec. H.222.1 type C\n"); break;
+	case 0xF7: verb(32,"ITU-T Rec. H.222.1 type D\n"); break;
+	case 0xF8: verb(32,"ITU-T Rec. H.222.1 type E\n"); return;
+	case 0xF9: verb(32,"ancillary stream\n"); break;
+	case 0xFA: verb(32,"ISO/IEC14496-1 SL-packetized stream\n"); break;
+	case 0xFB: verb(32,"ISO/IEC14496-1 FlexMux stream\n"); break;
+	case 0xFC: case 0xFD: case 0xFE: verb(32,"reserved data stream\n"); break;
+	case 0xFF: verb(32,"Program stream directory\n"); return;
+	default: if ((pes.stream_id & 0xE0) == 0xC0)
+			verb(32,"Audio, i.e. ISO/IEC 13818-3, etc.\n");
+		else if ((pes.stream_id & 0xF0) == 0xE0)
+            verb(32,"Video, i.e. ITU-T Rec. H.262 | ISO/IEC 13818-2, etc.\n");
+		else verb(32,"stream_id=0x%X\n",pes.stream_id); break;
+	}
+
+	if (len < 9 || len < 9 + p[2])
+	{ verb(1,"PES: header does not fit into %zu bytes\n",len); return; }
+	memcpy(&pes.flags,p,3); p+=3;
+	NETWORD(pes.flags);
+
+	// the optional fields must all lie within PES_header_data_length
+	byte *end = p + pes.pes_header_length;
+#define NEED(n) if (p + (n) > end) goto overrun
+
+	if (pes.flags & 0x0080)
+	{
+		NEED(5);
+		pes.pts = (qword) (p[0] & 0x0E) << 29 | p[1] << 22
+		 | (p[2] & 0xFE) << 14 | p[3] << 7 | p[4] >> 1;
+		p += 5;
+		qword *first_video_pts = pr ? &pr->first_video_pts : &v->psi.first_video_pts;
+		if ((pes.stream_id & 0xF0) == 0xE0 && *first_video_pts == 0)
+		{
+			*first_video_pts = pes.pts; v->psi_changes += pr != NULL;
+			verb(16,"First video pts established\n");
+		}
+	}
+	if (pes.flags & 0x0040)
+	{
+		NEED(5);
+		pes.dts = (qword) (p[0] & 0x0E) << 29 | p[1] << 22
+		 | (p[2] & 0xFE) << 14 | p[3] << 7 | p[4] >> 1;
+		p += 5;
+	}
+	if (pes.flags & 0x0020)
+	{
+		NEED(6);
+		struct bitreader br;	// 2 + 3 + 1 + 15 + 1 + 15 + 1 + 9 + 1 bits
+		br_init(&br,p,p+6); p+=6;
+		br_get(&br,2); pes.escr_base = (qword) br_get(&br,3) << 30;
+		br_get(&br,1); pes.escr_base |= br_get(&br,15) << 15;
+		br_get(&br,1); pes.escr_base |= br_get(&br,15);
+		br_get(&br,1); pes.escr_ext = br_get(&br,9);
+	}
+	if (pes.flags & 0x0010)
+	{
+		NEED(3);
+		pes.es_rate = (p[0] & 0x7F) << 15 | p[1] << 7 | p[2] >> 1;
+		p += 3;
+	}
+	if (pes.flags & 0x0008)
+	{
+		NEED(1);
+		pes.trick = *(p++);
+	}
+	if (pes.flags & 0x0004)
+	{
+		NEED(1);
+		pes.copy_info = *(p++);
+	}
+	if (pes.flags & 0x0002)
+	{
+		NEED(2);
+		pes.prev_crc = p[0] << 8 | p[1]; p += 2;
+	}
+	if (pes.flags & 0x0001)
+	{
+		NEED(1);
+		pes.ext_flags = *(p++);
+		if (pes.ext_flags & 0x80)
+		{
+			NEED(16);
+			pes.pes_private = (struct view) { p, 16 }; p += 16;
+		}
+		if (pes.ext_flags & 0x40)
+		{
+			NEED(1);
+			pes.pack_header = (struct view) { p+1, *p }; p++;
+			NEED(pes.pack_header.len);
+			p += pes.pack_header.len;
+		}
+		if (pes.ext_flags & 0x20)
+		{
+			NEED(2);
+			pes.seq_counter = p[0] & 0x7F;
+			pes.orig_stuff_length = p[1] & 0x3F; p += 2;
+		}
+		if (pes.ext_flags & 0x10)
+		{
+			NEED(2);
+			pes.p_std = p[0] << 8 | p[1]; p += 2;
+		}
+		if (pes.ext_flags & 0x01)
+		{
+			NEED(1);
+			p += *p & 0x7F; p++;
+			NEED(0);
+		}
+	}
+#undef NEED
+	
+	// skip possible stuffing bytes
+	p = end;
+	
+	// Only process private stream 1 any further
+	if (pes.stream_id != 0xBD || t == NULL) return;
+	STATS_ADD(pes_packets,1);
+
+	if (6 + pes.packet_length > len || p + (v->cfg.vdr ? 4 : 0) > data + 6 + pes.packet_length)
+	{
+		verb(1,"PES: subtitle packet of %d bytes does not fit into %zu, or has no payload\n",
+		 6 + pes.packet_length, len);
+		return;
+	}
+	
+	if (v->cb.pes)
+		v->cb.pes(v->user, v->cfg.vdr ? v->packet_offset : t->sub_pes_first, v->packet_offset, pes.pts);
+
+	verb(16,"PES: subtitle packet, packet =%d, header =%d, payload: %02X %02X %02X %02X %02X %02X %02X\n",
+			pes.packet_length, pes.pes_header_length, p[0],p[1],p[2],p[3],p[4],p[5],p[6]);
+	if (v->cfg.vdr)
+	{
+		if (p[3] == 0)
+		{
+			if (v->pes_data.len > 0)
+				// before beginning a new packet sequence, process any previously accumulated payload
+				process_dvbsub_data(v, t, v->pes_data.data, v->pes_data.len, v->pes_pts);
+			v->pes_data.len = 0;
+			v->pes_pts = pes.pts;
+		}
+		p += 4;	// VDR quirks: skip a 0x20010000 (new PES sequence) or 0x20010001 (continued sequence) header
+	}
+
+	// PES.PACKET_LENGTH=     	extra fields + 2 +  dvbsub payload
+	pes.packet_length -= p - (data+6);
+	// now				=						 	dvbsub payload
+	
+	// cache subtitle payload from .VDR content, further processing is handled above
+	if (v->cfg.vdr)
+	{
+		verb(16,"Appending %d bytes to %zu\n",pes.packet_length,v->pes_data.len);
+		reassembly_add(&v->pes_data, p, pes.packet_length);
+		// when eager (e.g. following a recording), rather than wait for the
+		// next sequence to begin, process a display set as soon as it is whole
+		if (v->cfg.eager && display_set_complete(&v->pes_data))
+		{
+			process_dvbsub_data(v, t, v->pes_data.data, v->pes_data.len, v->pes_pts);
+			v->pes_data.len = 0;
+		}
+	}
+	// process subtitle payload immediately for TS content
+	else
+		process_dvbsub_data(v, t, p, pes.packet_length, pes.pts);
+	return;
+
+overrun:
+	verb(1,"PES: optional fields overrun the header of %d bytes\n",pes.pes_header_length);
+}
+
+static void process_subtitle_pes_chunk(vdrsub *v, struct track *t, byte *p, size_t len, byte continuity_counter)
+{
+	struct reassembly *r = &t->sub_pes;
+
+	if (r->counter == continuity_counter)
+	{	verb(32,"PES is a duplicate subtitle packet\n"); STATS_ADD(pes_duplicates,1); return; }
+	r->counter = continuity_counter;
+
+	if (r->complete_len == -1)
+	{
+		if (memcmp(p,(byte []) {0,0,1},3))
+		{
+			verb(32,"PES: sync bytes not found; skipping\n");
+			STATS_ADD(pes_sync_errors,1);
+			return;
+		}
+		r->complete_len = 6 + (((word) p[4])<<8 | p[5]); // header + payload
+		t->sub_pes_first = v->packet_offset;
+
+		// a PES packet contained in this one TS packet needs no copying
+		if (r->complete_len <= len)
+		{
+			verb(32,"PES packet of %zu bytes processed in place\n",r->complete_len);
+			process_pes_packet(v, t, NULL, p, len);
+			r->complete_len = -1;
+			return;
+		}
+	}
+	
+	verb(32,"PES packet has complete length 0x%zX (%zu), we have %zu\n",r->complete_len,r->complete_len,r->len);
+	reassembly_add(r, p, len);
+		
+	if (r->len >= r->complete_len)
+	{
+		process_pes_packet(v, t, NULL, r->data, r->len);
+		r->len = 0; r->complete_len = -1;
+	}
+}
+
+// The track of program 'pr' taken on for the PID and page of 's' by an
+// earlier version of its PMT, if any
+static struct track *find_track(vdrsub *v, const struct vdrsub_stream *s, struct program *pr)
+{
+	for (int k = 0; k < v->tracks; k++)
+		if (v->track[k].s.pid == s->pid && v->track[k].s.page[0] == s->page[0]
+		 && v->track[k].prog == pr && v->track[k].version != pr->version)
+			return &v->track[k];
+	return NULL;
+}
+
+// Stop converting track 't', e.g. one no longer of the language chosen
+static void drop_track(vdrsub *v, struct track *t)
+{
+	verb(1,"PSI: no longer converting PID 0x%04X, page %d\n",t->s.pid,t->s.page[0]);
+	release_subp(t->subp);
+	free(t->sub_pes.data);
+	free(t->pages);
+	memmove(t, t + 1, (v->track + --v->tracks - t) * sizeof *t);
+}
+
+// Take on subtitle track 's' of program 'pr' too, unless the caller has no
+// use for it. A track already taken on that a new PMT version lists in
+// another language or of another type goes on as told now: its subpictures
+// from here on go where the caller wants those of 's'
+static void add_track(vdrsub *v, const struct vdrsub_stream *s, struct program *pr)
+{
+	struct track *t = find_track(v, s, pr);
+	void *user = v->user;
+
+	if (t && !memcmp(t->s.language, s->language, 3) && t->s.type == s->type)
+	{ t->version = pr->version; return; }		// listed as before
+	if (t == NULL)
+	{
+		for (int k = 0; k < v->tracks; k++)
+			if (v->track[k].s.pid == s->pid && v->track[k].s.page[0] == s->page[0])
+				return;		// listed again, in this PMT or of another program
+		if (v->tracks == VDRSUB_TRACKS)
+		{ verb(1,"PSI: more than %d subtitle tracks, skipping the rest\n",VDRSUB_TRACKS); return; }
+	}
+	if (v->cb.track && (user = v->cb.track(v->user, s)) == NULL)
+	{
+		if (t)
+			drop_track(v, t);
+		return;
+	}
+	if (t)
+	{
+		verb(1,"PSI: PID 0x%04X, page %d now \"%.3s\" (was \"%.3s\")\n",
+		 s->pid,s->page[0],s->language,t->s.language);
+		t->s = *s;
+		t->user = user;
+		t->version = pr->version;
+		return;
+	}
+	t = &v->track[v->tracks];
+	*t = (struct track) { *s, pr, user, init_subp(),
+	 { malloc(PES_MAX), PES_MAX, 0, -1, 16 }, .version = pr->version };
+	// tracks sharing a PID tell their segments apart by page
+	for (int k = 0; k < v->tracks; k++)
+		if (v->track[k].s.pid == s->pid)
+		{
+			if (v->track[k].pages == NULL)
+				v->track[k].pages = malloc(PES_MAX);
+			if (t->pages == NULL)
+				t->pages = malloc(PES_MAX);
+		}
+	v->tracks++;
+}
+
+// Follow program 'number' with its PMT on 'pmt_pid', if one of those chosen
+static void add_program(vdrsub *v, word number, word pmt_pid)
+{
+	struct program *pr;
+
+	if (v->cfg.programs)
+	{
+		const word *w;
+		for (w = v->cfg.programs; *w && *w != number; w++);
+		if (*w == 0)
+			return;
+	}
+	for (pr = v->program; pr < v->program + v->programs; pr++)
+		if (pr->number == number)
+		{
+			// moved to another PID by a new version of the PAT, dropping
+			// what there is of a section from the old one
+			if (pr->pmt_pid != pmt_pid)
+			{
+				pr->pmt_pid = pmt_pid; pr->version = 0xFF; v->psi_changes++;
+				pr->pmt.len = 0; pr->pmt.complete_len = -1;
+				if (v->cb.program)
+					v->cb.program(v->user, number, pmt_pid);
+			}
+			return;
+		}
+	if (v->programs == VDRSUB_PROGRAMS)
+	{ verb(1,"PSI: more than %d programs, skipping the rest\n",VDRSUB_PROGRAMS); return; }
+	// the PMT buffer is only allocated if a section of it is ever split
+	*pr = (struct program) { number, pmt_pid, 0xFF, 0xFFFF, v->cfg.first_video_pts,
+	 { NULL, PSI_MAX, 0, -1, 16 } };
+	v->programs++;
+	v->psi_changes++;
+	if (v->cb.program)
+		v->cb.program(v->user, number, pmt_pid);
+	if (v->psi.pmt_pid == 0xFFFF)
+		v->psi.pmt_pid = pmt_pid;
+}
+
+static void process_psi_section(vdrsub *v, byte *data)
+{
+	byte *p = data;
+
+	switch (*(p++))
+	{
+	case 0: {
+		verb(128,"Program Association Section :\n");
+		struct {
+			word syntax_length;
+			word ts_stream_id;
+			byte ver_current_next;
+			byte section_number;
+			byte last_section_number;
+		} pat;
+		memcpy(&pat,p,sizeof pat); p += sizeof pat;
+		NETWORD(pat.syntax_length); NETWORD(pat.ts_stream_id);
+
+		verb(128,"syntax_length=%04X, ts_stream_id=%04X, ver_current_next=%02X, section_number=%02X\n",
+		 pat.syntax_length,pat.ts_stream_id,pat.ver_current_next,pat.section_number);
+		verb(128,"last_section_number=%02X, program/PMT assignments :\n",pat.last_section_number);
+		// only a version not yet in effect, or one already parsed whole, is skipped
+		byte version = pat.ver_current_next >> 1 & 0x1F;
+		if (!(pat.ver_current_next & 1) || version == v->pat_version)
+			break;
+		while (p <= data+3+(pat.syntax_length&0x0FFF)-8)
+		{
+			word program = ((word) p[0]) << 8 | p[1];
+			word pid = (((word) p[2]) << 8 | p[3]) & 0x1FFF; p += 4;
+			if (!program) { verb(128," -Network PID =%04X\n",pid); continue; }
+			if (pid < 0x10 || pid == 0x1FFF) continue;
+			verb(128," -Program %04X has PMT PID %04X\n",program,pid);
+			add_program(v, program, pid);
+		}
+		if (pat.section_number == pat.last_section_number)
+			v->pat_version = version;
+		p += 4; // skip CRC_32
+		} break;
+	case 2: {
+		verb(128,"Program Map Section :\n");
+		struct {
+			word section_length;
+			word program;
+			byte ver_current_next;
+			byte section_number;
+			byte last_section_number;
+			word pcr_pid;
+			word program_info_length;
+		} pmt;
+		memcpy(&pmt, p, sizeof pmt); p += sizeof pmt;
+		NETWORD(pmt.section_length);
+		pmt.section_length &= 0x0FFF;
+		NETWORD(pmt.program);
+		NETWORD(pmt.pcr_pid); NETWORD(pmt.program_info_length);
+
+		verb(128,"section_length=%04X, program=%04X, ver_current_next=%02X, section_number=%02X\n",
+		 pmt.section_length,pmt.program,pmt.ver_current_next,pmt.section_number);
+		verb(128,"last_section_number=%02X, pcr_pid=%04X, program_info_length=%04X\n",
+			pmt.last_section_number,pmt.pcr_pid,pmt.program_info_length&0x0FFF);
+
+		// of a program followed, and of a version not parsed yet
+		struct program *pr;
+		for (pr = v->program; pr < v->program + v->programs && pr->number != pmt.program; pr++);
+		byte version = pmt.ver_current_next >> 1 & 0x1F;
+		if (pr == v->program + v->programs || !(pmt.ver_current_next & 1) || version == pr->version)
+			break;
+		pr->version = version;
+		v->psi_changes++;
+		int found = 0;		// subtitles to convert
+
+		p += pmt.program_info_length & 0x0FFF;
+		while (p <= data+3+pmt.section_length-9)
+		{
+			byte stream_type = *(p++);
+			word elementary_pid = (((word) p[0]) << 8 | p[1]) & 0x1FFF;
+			word len = (((word) p[2]) << 8 | p[3]) & 0x0FFF; p += 4;
+			struct vdrsub_stream es = { elementary_pid, stream_type };
+			es.program = pmt.program;
+			verb(128," -type=%02X, pid=%04X, descriptor len=%d",
+				stream_type, elementary_pid, len);
+			if (stream_type == 2)
+			{ 
+				verb(128,", video track");
+				if (v->cb.stream)
+					v->cb.stream(v->user, &es);
+				pr->video_pid = elementary_pid;
+			}
+			if (stream_type == 4)
+			{
+				verb(128,", audio track");
+				if (v->cb.stream)
+					v->cb.stream(v->user, &es);
+			}
+			// Only process non-empty descriptors of private data streams
+			if (stream_type != 6 || len == 0) { verb(128,"\n"); p+=len; continue; }
+
+			// each of the descriptors, the subtitling one not always first
+			byte *es_end = p + len;
+			while (p + 2 <= es_end)
+			{
+				byte tag = *(p++); len = *(p++);	// descriptor tag and length
+				byte *desc_end = p + len;
+				switch (tag)
+				{
+				case 0x56:
+					while (len >= 5)
+					{
+						struct {
+							byte language[3];
+							byte magazine_number : 3; byte teletext_type : 5;
+							byte page_number;
+						} ttxt_desc;
+						memcpy(&ttxt_desc,p,sizeof ttxt_desc); p+=sizeof ttxt_desc; len-=sizeof ttxt_desc;
+						struct vdrsub_stream st = es;
+						st.tag = tag;
+						memcpy(st.language,ttxt_desc.language,3);
+						st.type = ttxt_desc.teletext_type;
+						st.page[0] = ttxt_desc.magazine_number; st.page[1] = ttxt_desc.page_number;
+						if (v->cb.stream)
+							v->cb.stream(v->user, &st);
+					}
+					break;
+				case 0x59:
+					while (len >= 8)
+					{
+						struct {
+							byte language[3];
+							byte subtitling_type;
+							word composition_id;
+							word ancillary_id;
+						} sub_desc;
+						memcpy(&sub_desc,p,sizeof sub_desc); p+=sizeof sub_desc; len-=sizeof sub_desc;
+						NETWORD(sub_desc.composition_id); NETWORD(sub_desc.ancillary_id);
+						struct vdrsub_stream st = es;
+						st.tag = tag;
+						memcpy(st.language,sub_desc.language,3);
+						st.type = sub_desc.subtitling_type;
+						st.page[0] = sub_desc.composition_id; st.page[1] = sub_desc.ancillary_id;
+						if (v->cb.stream)
+							v->cb.stream(v->user, &st);
+						if (v->cfg.language && memcmp(v->cfg.language,sub_desc.language,3))
+						{
+							// a track taken on, now in another language
+							struct track *t;
+							if (v->cfg.all_tracks && (t = find_track(v, &st, pr)))
+								drop_track(v, t);
+							continue;
+						}
+						if (v->cfg.all_tracks)
+							add_track(v, &st, pr);
+						else
+						{
+							// the last listed
+							v->track[0].s = st;
+							v->psi.sub_pid = elementary_pid;
+							v->psi.composition_id = sub_desc.composition_id;
+							v->psi.ancillary_id = sub_desc.ancillary_id;
+							found = 1;
+						}
+					}
+					break;
+				default:
+					verb(128, "Unhandled descriptor type: %02X\n", tag);
+				}
+				p = desc_end;
+			}
+			p = es_end;
+		}		
+		// the one program converted, along with its video
+		if (found)
+		{ v->psi.pmt_pid = pr->pmt_pid; v->psi.video_pid = pr->video_pid; }
+		p += 4; // skip crc-32
+		} break;
+	}
+}
+
+// Parsed TS adaptation field, private data as a view into the packet
+struct adaptation_field {
+	byte flags;
+
+	qword pcr_base;
+	word pcr_ext;
+
+	qword opcr_base;
+	word opcr_ext;
+
+	byte splice_countdown;
+
+	struct view private_data;
+
+	byte ext_length;
+	byte ext_flags;
+
+	word ltw;
+
+	dword piecewise;
+
+	byte splice_type;
+	qword dts_next_au;
+};
+
+// Parse the adaptation field from p (after adaptation_field_length) up to
+// 'end'; returns -1 if the fields flagged would overrun 'end', else 0
+static int parse_adaptation_field(byte *p, byte *end, struct adaptation_field *af)
+{
+#define NEED(n) if (p + (n) > end) return -1
+
+	*af = (struct adaptation_field) { *(p++) };
+	if (af->flags & 0x10)
+	{
+		NEED(6);
+		af->pcr_base = (qword) p[0] << 25 | p[1] << 17 | p[2] << 9 | p[3] << 1 | p[4] >> 7;
+		af->pcr_ext = (p[4] << 8 | p[5]) & 0x1FF;
+		p += 6;
+	}
+	if (af->flags & 0x08)
+	{
+		NEED(6);
+		af->opcr_base = (qword) p[0] << 25 | p[1] << 17 | p[2] << 9 | p[3] << 1 | p[4] >> 7;
+		af->opcr_ext = (p[4] << 8 | p[5]) & 0x1FF;
+		p += 6;
+	}
+	if (af->flags & 0x04)
+	{
+		NEED(1);
+		af->splice_countdown = *(p++);
+	}
+	if (af->flags & 0x02)
+	{
+		NEED(1);
+		af->private_data = (struct view) { p+1, *p }; p++;
+		NEED(af->private_data.len);
+		p += af->private_data.len;
+	}
+	if (af->flags & 0x01)
+	{
+		NEED(2);
+		af->ext_length = *(p++);
+		af->ext_flags = *(p++);
+		if (af->ext_flags & 0x80)
+		{
+			NEED(2);
+			af->ltw = p[0] << 8 | p[1]; p += 2;
+		}
+		if (af->ext_flags & 0x40)
+		{
+			NEED(3);
+			af->piecewise = (p[0] << 16 | p[1] << 8 | p[2]) & 0x3FFFFF; p += 3;
+		}
+		if (af->ext_flags & 0x20)
+		{
+			NEED(5);
+			af->splice_type = p[0] >> 4;
+			af->dts_next_au = (qword) (p[0] & 0x0E) << 29 | p[1] << 22
+			 | (p[2] & 0xFE) << 14 | p[3] << 7 | p[4] >> 1;
+			p += 5;
+		}
+	}
+	return 0;
+#undef NEED
+}
+
+// The program with its video on 'pid', its first video pts not found yet
+static struct program *video_program(vdrsub *v, word pid)
+{
+	for (int k = 0; k < v->programs; k++)
+		if (v->program[k].video_pid == pid && v->program[k].first_video_pts == 0)
+			return &v->program[k];
+	return NULL;
+}
+
+static void process_ts_packet(vdrsub *v, byte data[])
+{
+	byte *p = data;
+
+	struct {
+		byte sync_byte;
+		word flags_pid;
+		byte controls;
+	} tp = { p[0], p[1] << 8 | p[2], p[3] }; p+=4;
+
+	if (tp.sync_byte != 0x47)
+	{
+		verb(64,"TS packet # %d has sync byte 0x%02X != 0x47\n",v->packet_index++,tp.sync_byte);
+		return;
+	}
+	verb(64,"TS packet # %d : error=%d, payload_start=%d, priority=%d\n",
+	 v->packet_index++, (tp.flags_pid & 0x8000) != 0, (tp.flags_pid & 0x4000) != 0, (tp.flags_pid & 0x2000) != 0);
+	verb(64,"  PID=0x%X, scrambling=%d, adapt=%d, counter=%d\n",
+	 tp.flags_pid & 0x1FFF, tp.controls >> 6, (tp.controls >> 4)&3, tp.controls &0xF);
+	if ((tp.flags_pid & 0x1FFF) == 0x1FFF) 
+	{
+		verb(32,"TS: null packet, skipping\n"); return;
+    }
+	if ((tp.controls & 0x30) == 0) { verb(64,"TS packet has no payload or adaptation field\n"); return; }
+
+	int af_len = 0;
+	if ((tp.controls & 0x20) && (af_len = *(p++) + 1) > 1)
+	{
+		if (af_len > 184)
+		{ verb(64,"TS adaptation field (len=%d) overruns the packet\n",af_len); return; }
+		// only of interest for tracing
+		if (verb_on(64))
+		{
+			struct adaptation_field af;
+			verb(64, "TS adaptation field (len=%d): \n", af_len);
+			if (parse_adaptation_field(p, data + 4 + af_len, &af) < 0)
+			{ verb(64,"fields overrun the adaptation field, "); af.flags = 0; }
+			if (af.flags&0x10)
+			{
+				float s=af.pcr_base/90000.0;
+				verb(64,"TS: PCR for PID 0x%04X: %02d:%02d:%02d.%02d\n",
+				 tp.flags_pid & 0x1FFF,(int) s/3600,(int) (s/60) % 60,
+				 (int) s % 60,(int) ((s-((int) s))*100));
+			}
+			if (af.flags & 0x08)
+			{
+				float s=af.opcr_base/90000.0;
+				verb(64,"TS: Original PCR for PID 0x%04X: %02d:%02d:%02d.%02d\n",
+				 tp.flags_pid & 0x1FFF, (int) s/3600,(int) (s/60) % 60,
+				 (int) s % 60,(int) ((s-((int) s))*100));
+			}
+			if (af.flags & 0x04)
+				verb(64,"splice_countdown=%d, ", af.splice_countdown);
+			if (af.flags & 0x02)
+				verb(64,"private data (%zu bytes), ",af.private_data.len);
+			if (af.flags & 0x01)
+			{
+				if (af.ext_flags & 0x80)
+					verb(64,"ltw=%d, ", af.ltw);
+				if (af.ext_flags & 0x40)
+					verb(64,"piecewise=%lu, ", af.piecewise);
+				if (af.ext_flags & 0x20)
+					verb(64,"splice_type=%d, dts=0x%llX", af.splice_type, af.dts_next_au);
+			}
+			verb(64,"\n");
+		}
+	}
+
+	if (! (tp.controls & 0x10)) { verb(64,"TS packet has no payload\n"); return; }
+
+	p = data + 4 + af_len;
+	verb(64,"TS: %td bytes of data for PID 0x%X: ",
+	 188 - (p-data),tp.flags_pid & 0x1FFF);
+	if (verb_on(64))
+	{	for (int j=0; j<8 && p+j < data+188; j++) verb(64,"%02X ",p[j]); verb(64,"\n"); }
+	verb(64,"pmt_pid=%04X, sub_pid=%04X, video_pid=%04X\n",v->psi.pmt_pid,v->psi.sub_pid,v->psi.video_pid);
+
+	// assemble and parse complete PES packets for subtitle data, for each
+	// track the PID carries
+	struct program *pr;
+	int sub = 0;
+	for (int k = 0; k < v->tracks; k++)
+		if ((tp.flags_pid & 0x1FFF) == v->track[k].s.pid)
+		{
+			process_subtitle_pes_chunk(v,&v->track[k],p,188-(p-data),tp.controls & 0xF);
+			sub = 1;
+		}
+	if (sub)
+		return;
+
+	// parse first chunk of each video ES packet, until we have first_video_pts
+	if ((tp.flags_pid & 0x1FFF) == v->psi.video_pid)
+	{
+		if (v->psi.first_video_pts != 0) return;	// we already established 1st video pts
+		if ((tp.flags_pid & 0x4000) == 0) return; // no payload_unit_start indication
+		process_pes_packet(v, NULL, NULL, p, 188-(p-data));
+	}
+
+	// with all tracks, that of each program, until its first video pts
+	else if (v->cfg.all_tracks && (pr = video_program(v, tp.flags_pid & 0x1FFF)) != NULL)
+	{
+		if ((tp.flags_pid & 0x4000) == 0) return; // no payload_unit_start indication
+		process_pes_packet(v, NULL, pr, p, 188-(p-data));
+	}
+
+	// assemble and parse complete PAT and PMT sections until we have
+	// established a subtitle PID, or with all tracks throughout, so that the
+	// programs and tracks turning up later on are taken on as well
+	else if (v->psi.sub_pid == 0xFFFF || v->cfg.all_tracks)
+	{
+		word pid = tp.flags_pid & 0x1FFF;
+		struct reassembly *psi = pid == 0 ? &v->psi_section : NULL;
+		// each PID a section of its own, that of the PAT or of a PMT
+		for (int k = 0; psi == NULL && k < v->programs; k++)
+			if (v->program[k].pmt_pid == pid)
+				psi = &v->program[k].pmt;
+		if (psi == NULL)
+			return;
+
+/*		static byte psi_counter = 16;
+		if (psi_counter == (tp.controls & 0xF))
+		{	verb(32,"TS: duplicate PSI packet\n"); return; }
+		psi_counter=tp.controls & 0xF;
+*/
+		// if we have no current section nor is there one starting now, quit
+		if (psi->complete_len == -1 && !(tp.flags_pid & 0x4000)) return;
+
+		// if we have no current section but another one is starting, seek to that
+		if (psi->complete_len == -1)
+		{
+			verb(64,"TS: no current section (pointer %02X)\n",*p);
+			p += *p + 1;
+		}
+
+		// if there's both a current section and a new one, process the old one now
+		else if (tp.flags_pid & 0x4000) 
+		{
+			verb(64,"TS: parsing current, then new sections (pointer %02X)\n",*p);
+			reassembly_add(psi, p+1, *p); p += *p +1;
+			if (psi->complete_len > psi->len) verb(1,"PSI underflow by %zu\n",
+				psi->complete_len - psi->len);
+			else
+				process_psi_section(v, psi->data);
+			psi->len = 0; psi->complete_len = -1;
+		}
+
+		// we have a current section to parse, no new one is set to begin
+		else
+		{
+			verb(64,"TS: parsing current section (no pointer)\n");
+			reassembly_add(psi, p, 188-(p-data));
+			if (psi->len >= psi->complete_len)
+			{
+				process_psi_section(v, psi->data);
+				psi->len = 0; psi->complete_len = -1;
+			}
+			return;
+		}
+		
+		// process each section (or portion thereof) beginning in this packet
+		while (p < data+188)
+		{
+				psi->complete_len = 3 + ((((word) p[1])<<8 | p[2]) & 0x0FFF);
+				verb(64,"TS: parsing new section w/ len %04zX\n",psi->complete_len);
+				if (p + psi->complete_len > data+188)
+				{
+					reassembly_add(psi, p, 188-(p-data));
+					break;
+				}
+				process_psi_section(v, p); 
+				p += psi->complete_len; psi->complete_len = -1;
+				if (p >= data+188) break;
+				if (*p != (pid == 0 ? 0 : 2))	break;
+		}
+	}
+}
+
+// Fill in the PIDs that process_ts_packet() currently has any use for
+static void wanted_pids(vdrsub *v, struct pid_filter *pf)
+{
+	const struct vdrsub_psi *psi = &v->psi;
+	pidf_clear(pf);
+	if (psi->sub_pid != 0xFFFF || v->cfg.all_tracks)
+		for (int k = 0; k < v->tracks; k++)
+		{
+			pidf_add(pf,v->track[k].s.pid);
+			const struct program *pr = v->track[k].prog;
+			if (pr && pr->video_pid != 0xFFFF && pr->first_video_pts == 0)
+				pidf_add(pf,pr->video_pid);
+		}
+	if (psi->sub_pid == 0xFFFF || v->cfg.all_tracks)
+	{
+		// the PAT, and the PMTs of the programs it lists
+		pidf_add(pf,0);
+		for (int k = 0; k < v->programs; k++)
+			pidf_add(pf,v->program[k].pmt_pid);
+	}
+	if (psi->video_pid != 0xFFFF && psi->first_video_pts == 0)
+		pidf_add(pf,psi->video_pid);
+}
+
+// Summary of the state wanted_pids() depends on
+static qword pid_state(const vdrsub *v)
+{
+	const struct vdrsub_psi *psi = &v->psi;
+	return (qword) psi->pmt_pid << 32 | (qword) psi->sub_pid << 16 | psi->video_pid
+	 | (qword) (psi->first_video_pts == 0) << 48 | (qword) v->psi_changes << 49;
+}
+
+vdrsub *vdrsub_open(const struct vdrsub_config *cfg, const struct vdrsub_callbacks *cb, void *user)
+{
+	vdrsub *v = (vdrsub *) calloc(1, sizeof *v);
+
+	if (v == NULL)
+		return NULL;
+	v->cfg = *cfg;
+	if (v->cfg.stride == 0)
+		v->cfg.stride = 188;
+	v->cb = *cb;
+	v->user = user;
+	v->psi = (struct vdrsub_psi) { -1, -1, -1, -1, -1, cfg->first_video_pts };
+	v->cfg.all_tracks &= !cfg->vdr;	// a .VDR file has the one
+	v->pat_version = 0xFF;
+
+	// all at the largest size expected, so that pushing need not allocate
+	// (but for the tracks beyond the first, and PMT sections split over
+	// TS packets, as they turn up)
+	v->tracks = !v->cfg.all_tracks;
+	v->track[0] = (struct track) { { 0xFFFF }, NULL, user, { 0 },
+	 { cfg->vdr || v->cfg.all_tracks ? NULL : malloc(PES_MAX), PES_MAX, 0, -1, 16 } };
+	v->psi_section = (struct reassembly) { cfg->vdr ? NULL : malloc(PSI_MAX), PSI_MAX, 0, -1, 16 };
+	v->pes_data = (struct reassembly) { cfg->vdr ? malloc(1 << 16) : NULL, 1 << 16, 0, -1, 16 };
+	v->carry = malloc(cfg->vdr ? PES_MAX : TS_LOCK_COUNT*204);
+	if ((cfg->vdr ? v->pes_data.data == NULL : !v->cfg.all_tracks && v->track[0].sub_pes.data == NULL)
+	 || (!cfg->vdr && v->psi_section.data == NULL) || v->carry == NULL)
+	{
+		free(v->track[0].sub_pes.data); free(v->psi_section.data);
+		free(v->pes_data.data); free(v->carry); free(v);
+		return NULL;
+	}
+	if (v->tracks)
+		v->track[0].subp = init_subp();
+	return v;
+}
+
+void vdrsub_push_ts(vdrsub *v, const byte *p, size_t n, int stride, qword offset)
+{
+	word sel[VDRSUB_BLOCK];
+
+	while (n > 0)
+	{
+		size_t block = n < VDRSUB_BLOCK ? n : VDRSUB_BLOCK;
+
+		// only dispatch packets of the PIDs of interest
+		wanted_pids(v,&v->pf);
+		size_t m = pidf_select(&v->pf,p,block,stride,sel);
+		for (size_t k = 0; k < m; k++)
+		{
+			qword state = pid_state(v);
+			v->packet_offset = offset + (qword) sel[k]*stride;
+			process_ts_packet(v, (byte *) p + sel[k]*stride);
+			if (state == pid_state(v))
+				continue;
+			// PSI or first video PTS found: select the rest anew
+			size_t next = sel[k]+1;
+			wanted_pids(v,&v->pf);
+			m = pidf_select(&v->pf,p + next*stride,block-next,stride,sel);
+			for (size_t j = 0; j < m; j++)
+				sel[j] += next;
+			k = -1;
+		}
+		p += block*stride; offset += block*stride; n -= block;
+	}
+}
+
+void vdrsub_push_pes(vdrsub *v, const byte *p, size_t len, qword offset)
+{
+	v->packet_offset = offset;
+	process_pes_packet(v, &v->track[0], NULL, (byte *) p, len);
+}
+
+// Lock on to the TS in the carry at the configured stride, as tsread.h does
+// (see ts_locks()), pushing the packets there and keeping any part of one;
+// else drop what can no longer begin a packet that locks, 'last' telling if
+// the stream ends with the carry
+static void lock_carry(vdrsub *v, int last)
+{
+	const int stride = v->cfg.stride;
+	byte *s = v->carry, *end = v->carry + v->carry_len;
+
+	// with the carry full, only a sync byte within the first packet has all
+	// of TS_LOCK_COUNT packets to test
+	for (; s < end && (last || s < v->carry + stride); s++)
+		if (ts_locks(s, end, stride, last))
+			break;
+	if (s < end && (last || s < v->carry + stride))
+	{
+		size_t n = (end-s) / stride;
+		v->position += s - v->carry;
+		vdrsub_push_ts(v, s, n, stride, v->position);
+		v->position += n*stride; s += n*stride;
+		v->locked = 1;
+	}
+	else
+	{
+		s = last ? end : v->carry + stride;
+		v->position += s - v->carry;
+	}
+	v->carry_len = end-s;
+	memmove(v->carry, s, v->carry_len);
+}
+
+// Frame a TS in packets of the configured stride, locking on where
+// TS_LOCK_COUNT sync bytes follow in a row, and push them in blocks straight
+// from 'data' where whole while in sync
+static void push_ts_bytes(vdrsub *v, const byte *data, const byte *end)
+{
+	const int stride = v->cfg.stride;
+
+	while (data < end)
+	{
+		if (!v->locked)
+		{
+			// search a window of TS_LOCK_COUNT packets at a time
+			size_t k = TS_LOCK_COUNT*stride - v->carry_len;
+			k = k < end-data ? k : end-data;
+			memcpy(v->carry + v->carry_len, data, k);
+			v->carry_len += k; data += k;
+			if (v->carry_len == TS_LOCK_COUNT*stride)
+				lock_carry(v, 0);
+			continue;
+		}
+		if (v->carry_len == 0)
+		{
+			size_t n;
+			for (n = 0; data + (n+1)*stride <= end && data[n*stride] == 0x47; n++);
+			if (n > 0)
+			{
+				vdrsub_push_ts(v, data, n, stride, v->position);
+				v->position += n*stride; data += n*stride;
+				continue;
+			}
+			if (*data != 0x47)
+			{ v->locked = 0; continue; }	// lost sync, search again
+		}
+		// the packet runs on into the next push
+		size_t k = stride - v->carry_len < end-data ? stride - v->carry_len : end-data;
+		memcpy(v->carry + v->carry_len, data, k);
+		v->carry_len += k; data += k;
+		if (v->carry_len == stride)
+		{
+			vdrsub_push_ts(v, v->carry, 1, stride, v->position);
+			v->position += stride;
+			v->carry_len = 0;
+		}
+	}
+}
+
+// Frame .VDR PES packets by their lengths, skipping to the next start code
+// where one is missing, and push them straight from 'data' where whole
+static void push_pes_bytes(vdrsub *v, const byte *data, const byte *end)
+{
+	static const byte start_code[3] = { 0, 0, 1 };
+
+	while (data < end)
+	{
+		if (v->carry_len == 0 && end-data >= 6)
+		{
+			if (memcmp(data, start_code, 3))
+			{ data++; v->position++; continue; }
+			size_t len = 6 + (((word) data[4]) << 8 | data[5]);
+			if (end-data >= len)
+			{
+				vdrsub_push_pes(v, data, len, v->position);
+				v->position += len; data += len;
+				continue;
+			}
+		}
+		// the header first for the length, then the rest of the packet
+		size_t want = v->carry_len < 6 ? 6 : 6 + (((word) v->carry[4]) << 8 | v->carry[5]);
+		size_t k = want - v->carry_len < end-data ? want - v->carry_len : end-data;
+		memcpy(v->carry + v->carry_len, data, k);
+		v->carry_len += k; data += k;
+		if (v->carry_len == 6 && memcmp(v->carry, start_code, 3))
+		{
+			memmove(v->carry, v->carry + 1, 5);
+			v->carry_len = 5; v->position++;
+		}
+		else if (v->carry_len >= 6 && v->carry_len == 6 + (((word) v->carry[4]) << 8 | v->carry[5]))
+		{
+			vdrsub_push_pes(v, v->carry, v->carry_len, v->position);
+			v->position += v->carry_len;
+			v->carry_len = 0;
+		}
+	}
+}
+
+void vdrsub_push(vdrsub *v, const byte *data, size_t len)
+{
+	if (v->cfg.vdr)
+		push_pes_bytes(v, data, data + len);
+	else
+		push_ts_bytes(v, data, data + len);
+}
+
+void vdrsub_skip(vdrsub *v, qword offset)
+{
+	for (int k = 0; k < v->tracks; k++)
+	{
+		v->track[k].sub_pes.counter = 16;
+		v->track[k].sub_pes.len = 0; v->track[k].sub_pes.complete_len = -1;
+	}
+	v->carry_len = 0;
+	v->position = offset;
+	v->locked = 0;
+}
+
+void vdrsub_get_psi(const vdrsub *v, struct vdrsub_psi *psi)
+{
+	*psi = v->psi;
+	// with all tracks, those of the first one and its program
+	if (v->cfg.all_tracks && v->tracks > 0)
+	{
+		const struct track *t = &v->track[0];
+		*psi = (struct vdrsub_psi) { t->prog->pmt_pid, t->prog->video_pid, t->s.pid,
+		 t->s.page[0], t->s.page[1], t->prog->first_video_pts };
+	}
+}
+
+void vdrsub_set_psi(vdrsub *v, const struct vdrsub_psi *psi)
+{
+	v->psi = *psi;
+	if (!v->cfg.all_tracks)
+	{
+		v->track[0].s.pid = psi->sub_pid;
+		v->track[0].s.page[0] = psi->composition_id;
+		v->track[0].s.page[1] = psi->ancillary_id;
+	}
+}
+
+void vdrsub_finish(vdrsub *v)
+{
+	if (v->pes_data.len > 0)
+		// forward contents of any subtitle PES sequence remaining in the cache
+		process_dvbsub_data(v, &v->track[0], v->pes_data.data, v->pes_data.len, v->pes_pts);
+	v->pes_data.len = 0;
+	// the last TS packets pushed, while searching for sync, lock on with fewer
+	if (!v->cfg.vdr && !v->locked && v->carry_len > 0)
+		lock_carry(v, 1);
+}
+
+void vdrsub_close(vdrsub *v)
+{
+	for (int k = 0; k < v->tracks; k++)
+	{
+		release_subp(v->track[k].subp);
+		free(v->track[k].sub_pes.data);
+		free(v->track[k].pages);
+	}
+	for (int k = 0; k < v->programs; k++)
+		free(v->program[k].pmt.data);
+	free(v->psi_section.data);
+	free(v->pes_data.data);
+	free(v->carry);
+	free(v);
+}
@@ -0,0 +1,125 @@
+/*
+
+ libvdrsub: conversion of the DVB subtitles of a recording (TS or .VDR) into
+ vobsub, one stream per context
+
+ The caller opens a context per stream and pushes the stream into it, in
+ buffers of any size, or a block of whole TS packets or a whole .VDR PES
+ packet at a time when it frames them itself (as vdrsub does with tsread.h).
+ What turns up is reported through callbacks, from within the push that
+ gives rise to it: the programs and elementary streams of the PSI, each
+ subtitle PES packet found, and each subpicture drawn or wiped along with
+ its vobsub packet
+
+ The buffers a stream needs are allocated when its context is opened, and
+ pushing only allocates when the stream takes more room than that, e.g. a
+ region larger than any before. Contexts share nothing but the messages of
+ trace.h, and the counters of stats.h once stats_init() turns them on, so
+ that with those left off streams can be converted side by side, each on a
+ thread of its own
+
+*/
+
+#ifndef __LIBVDRSUB_H
+#define __LIBVDRSUB_H
+
+#include <stddef.h>
+#include "dvbsub.h"
+
+typedef struct vdrsub vdrsub;
+
+// An elementary stream listed in a PMT
+struct vdrsub_stream {
+	word pid;
+	byte stream_type;		// 2 =video, 4 =audio, 6 =private data
+	byte tag;				// of the latter: 0x56 =teletext, 0x59 =subtitles
+	char language[3];		// ... and what its descriptor entry tells
+	byte type;				// teletext_type or subtitling_type
+	word page[2];			// magazine and page number, or composition and ancillary id
+	word program;			// whose PMT lists it
+};
+
+struct vdrsub_callbacks {
+	// The PAT maps 'program', one of those configured, to the PMT on
+	// 'pmt_pid'; told as the program is first listed, and again if moved
+	void (*program)(void *user, word program, word pmt_pid);
+	// A PMT lists stream 's', once per teletext or subtitles descriptor entry
+	// and version of the PMT
+	void (*stream)(void *user, const struct vdrsub_stream *s);
+	// A subtitle PES packet with 'pts' came in the TS packets from offset
+	// 'first' to 'last', or in the .VDR PES packet at 'first' (= 'last')
+	void (*pes)(void *user, qword first, qword last, qword pts);
+	// Subpicture 'sp' is to be drawn or wiped (sp->live_state) at 'pts'
+	// relative to the start of the video
+	void (*subpicture)(void *user, subpicture *sp, qword pts);
+	// ... and this is its vobsub packet of 'len' bytes, valid until the next
+	// push; subpictures are only encoded when this is set
+	void (*vobsub)(void *user, subpicture *sp, const byte *spu, size_t len, qword pts);
+	// With all_tracks, subtitle track 's' is to be converted too: return the
+	// pointer to pass as 'user' to the two above for its subpictures, or NULL
+	// to skip it; when left NULL, every track gets the 'user' of the context.
+	// Called again for a track that a new PMT version relabels, i.e. lists in
+	// another language or of another type, for its subpictures from then on
+	void *(*track)(void *user, const struct vdrsub_stream *s);
+};
+
+struct vdrsub_config {
+	int vdr;				// .VDR PES packets rather than a TS
+	int stride;				// of TS packets pushed by vdrsub_push(): 188 (or 0), 192, 204
+	const char *language;	// the subtitles to convert, or NULL for the last listed
+	int eager;				// convert a .VDR display set once whole, not on the next one
+	qword first_video_pts;	// subtracted from each subpicture PTS, 0 =the stream's
+	int all_tracks;			// convert every subtitle track (of the language, if
+							// given) of a TS, from the one read of it
+	const word *programs;	// the programs to look into, 0-terminated, or NULL for
+							// all those of the PAT
+};
+
+// What has been found of the PSI and the video so far; 0xFFFF =not yet
+struct vdrsub_psi {
+	word pmt_pid, video_pid, sub_pid;
+	word composition_id, ancillary_id;
+	qword first_video_pts;	// 0 =not yet
+};
+
+// Open a context for converting a stream as configured, reporting to 'cb'
+// with 'user' passed on; the callbacks not of interest may be left NULL
+// Returns NULL if out of memory
+vdrsub *vdrsub_open(const struct vdrsub_config *cfg, const struct vdrsub_callbacks *cb, void *user);
+
+// Push the next 'len' bytes of the stream; a TS locks on where TS_LOCK_COUNT
+// sync bytes follow at the stride configured, as with tsread.h, and its
+// packets and .VDR PES packets may be split between pushes
+void vdrsub_push(vdrsub *v, const byte *data, size_t len);
+
+// Push 'n' TS packets from 'p' on, 'stride' bytes apart with the first one
+// at 'offset' in the input; only those of the PIDs of interest are parsed
+void vdrsub_push_ts(vdrsub *v, const byte *p, size_t n, int stride, qword offset);
+
+// Push a whole .VDR PES packet of 'len' bytes, at 'offset' in the input
+void vdrsub_push_pes(vdrsub *v, const byte *p, size_t len, qword offset);
+
+// Tell that the stream goes on at 'offset' in the input, some of it skipped
+// since the last push, e.g. when pushing only the packets an index lists
+void vdrsub_skip(vdrsub *v, qword offset);
+
+// Get what has been found of the PSI so far
+// Set it, e.g. as an index tells, so that it need not be looked for in the
+// stream
+// The subtitles converted are those of the first PMT to list any, of the
+// programs configured; the PSI is that of their program
+// With all_tracks, every PMT is followed through all of the TS, and the PSI
+// got is that of the first track and its program. Tracks are only taken
+// from PMTs, so setting the PSI leaves none
+void vdrsub_get_psi(const vdrsub *v, struct vdrsub_psi *psi);
+void vdrsub_set_psi(vdrsub *v, const struct vdrsub_psi *psi);
+
+// Convert what is still held at the end of the stream, i.e. the last
+// display set of a .VDR file, or the last packets of a TS pushed while out
+// of sync
+void vdrsub_finish(vdrsub *v);
+
+// Release the context
+void vdrsub_close(vdrsub *v);
+
+#endif
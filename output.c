@@ -0,0 +1,237 @@
+/*
+	Output stage on a writer thread; see output.h
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "output.h"
+#include "write-ps.h"
+
+#define SECTOR 2048
+
+// The ring indexes run freely and are taken modulo OUTPUT_SECTORS; 'head'
+// is only written by the producer and 'tail' by the writer thread, so that
+// publishing one to the other takes no more than a release store
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define STORE(x,v) __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+
+struct entry {
+	qword pts;
+	int first;			// a subpicture starts in this sector
+};
+
+struct output {
+	FILE *sub, *idx;
+	int fd;
+	byte *ring;			// OUTPUT_SECTORS sectors
+	struct entry entry[OUTPUT_SECTORS];
+	unsigned head;		// sectors queued so far
+	unsigned tail;		// ... and written
+	unsigned flush;		// write up to here even if short of a chunk
+	int quit;
+	qword offset;		// in the .sub file of the sector at 'tail'
+	off_t reserved;		// end of the space preallocated
+	int prealloc, error;
+
+	// slow path: either side sleeps here when it cannot go on
+	pthread_t writer;
+	pthread_mutex_t lock;
+	pthread_cond_t more, room;
+	int writer_idle, producer_full;
+};
+
+// anything for the writer to do: a whole chunk, a flush or quitting
+static int writer_ready(output *out, unsigned tail)
+{
+	return LOAD(out->head) - tail >= OUTPUT_CHUNK
+	 || (int) (LOAD(out->flush) - tail) > 0 || LOAD(out->quit);
+}
+
+// wake the writer if it is asleep and has something to do
+static void wake_writer(output *out)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);	// publish before peeking at the flag
+	if (__atomic_load_n(&out->writer_idle, __ATOMIC_SEQ_CST)
+	 && writer_ready(out, LOAD(out->tail)))
+	{
+		pthread_mutex_lock(&out->lock);
+		pthread_cond_signal(&out->more);
+		pthread_mutex_unlock(&out->lock);
+	}
+}
+
+static void idx_entry(output *out, qword pts, qword offset)
+{
+	float s = pts/90000.0;
+	fprintf(out->idx,"timestamp: %02d:%02d:%02d:%03d, filepos: %08X\n",
+	 (int) s/3600,(int) (s/60) % 60,(int) s % 60,
+	 (int) ((s-((int) s))*1000), (unsigned) offset);
+}
+
+// Write out the sectors from 'tail' up to 'head' or the end of the chunk,
+// along with their idx entries; returns the new tail
+static unsigned write_sectors(output *out, unsigned tail, unsigned head)
+{
+	unsigned i = tail % OUTPUT_SECTORS;
+	unsigned n = OUTPUT_CHUNK - i % OUTPUT_CHUNK;
+	if (n > head - tail)
+		n = head - tail;
+	size_t len = (size_t) n * SECTOR;
+
+	for (unsigned k = 0; k < n; k++)
+		if (out->entry[i+k].first)
+			idx_entry(out, out->entry[i+k].pts, out->offset + (qword) k * SECTOR);
+
+	if (out->prealloc && out->offset + len > out->reserved)
+	{
+		if (fallocate(out->fd, FALLOC_FL_KEEP_SIZE, out->reserved, OUTPUT_PREALLOC) == 0)
+			out->reserved += OUTPUT_PREALLOC;
+		else
+			out->prealloc = 0;		// not supported here, e.g. over NFS
+	}
+
+	byte *p = out->ring + (size_t) i * SECTOR;
+	for (size_t done = 0; done < len && !out->error; )
+	{
+		ssize_t r = write(out->fd, p + done, len - done);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+		{
+			fprintf(stderr,"Unable to write the .sub file: %s\n",
+			 r < 0 ? strerror(errno) : "no space");
+			out->error = 1;		// drop the rest rather than block the demux
+		}
+		else
+			done += r;
+	}
+	out->offset += len;
+
+	STORE(out->tail, tail + n);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&out->producer_full, __ATOMIC_SEQ_CST))
+	{
+		pthread_mutex_lock(&out->lock);
+		pthread_cond_signal(&out->room);
+		pthread_mutex_unlock(&out->lock);
+	}
+	return tail + n;
+}
+
+static void *writer_thread(void *arg)
+{
+	output *out = (output *) arg;
+	unsigned tail = out->tail;
+	int dirty = 0;		// idx entries not yet flushed
+
+	while (1)
+	{
+		int quit = LOAD(out->quit);
+		unsigned head = LOAD(out->head);
+		if (quit && head == tail)
+			break;
+		if (head - tail >= OUTPUT_CHUNK || (int) (LOAD(out->flush) - tail) > 0)
+		{
+			tail = write_sectors(out, tail, head);
+			dirty = 1;
+			continue;
+		}
+
+		// nothing to do for now: let the idx entries out, then sleep
+		if (dirty)
+			fflush(out->idx);
+		dirty = 0;
+		pthread_mutex_lock(&out->lock);
+		__atomic_store_n(&out->writer_idle, 1, __ATOMIC_SEQ_CST);
+		while (!writer_ready(out, tail))
+			pthread_cond_wait(&out->more, &out->lock);
+		__atomic_store_n(&out->writer_idle, 0, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&out->lock);
+	}
+	return NULL;
+}
+
+output *output_open(FILE *sub, FILE *idx, int prealloc)
+{
+	output *out = calloc(1, sizeof *out);
+	if (out == NULL)
+		return NULL;
+	if (posix_memalign((void **) &out->ring, 4096, (size_t) OUTPUT_SECTORS * SECTOR))
+	{ free(out); return NULL; }
+
+	fflush(sub);
+	fflush(idx);		// the header, for the palette may be rewritten in it
+	out->sub = sub; out->idx = idx;
+	out->fd = fileno(sub);
+	out->offset = out->reserved = ftell(sub);
+	out->prealloc = prealloc;
+
+	pthread_mutex_init(&out->lock, NULL);
+	pthread_cond_init(&out->more, NULL);
+	pthread_cond_init(&out->room, NULL);
+	if (pthread_create(&out->writer, NULL, writer_thread, out))
+	{ free(out->ring); free(out); return NULL; }
+	return out;
+}
+
+size_t output_subpicture(output *out, const byte *data, size_t size, qword pts)
+{
+	unsigned head = out->head;
+	size_t sectors = 0;
+
+	do
+	{
+		if (head - LOAD(out->tail) == OUTPUT_SECTORS)
+		{
+			// ring full: back-pressure until the writer makes room
+			wake_writer(out);
+			pthread_mutex_lock(&out->lock);
+			__atomic_store_n(&out->producer_full, 1, __ATOMIC_SEQ_CST);
+			while (head - LOAD(out->tail) == OUTPUT_SECTORS)
+				pthread_cond_wait(&out->room, &out->lock);
+			__atomic_store_n(&out->producer_full, 0, __ATOMIC_SEQ_CST);
+			pthread_mutex_unlock(&out->lock);
+		}
+		unsigned i = head % OUTPUT_SECTORS;
+		out->entry[i] = (struct entry) { pts, sectors == 0 };
+		vobsub_ps_sector(out->ring + (size_t) i * SECTOR, &data, &size, pts, sectors++ == 0);
+		STORE(out->head, ++head);
+	}
+	while (size > 0);
+
+	wake_writer(out);
+	return sectors * SECTOR;
+}
+
+void output_flush(output *out)
+{
+	STORE(out->flush, out->head);
+	wake_writer(out);
+}
+
+void output_close(output *out)
+{
+	STORE(out->flush, out->head);
+	STORE(out->quit, 1);
+	wake_writer(out);
+	pthread_join(out->writer, NULL);
+
+	// give back what was preallocated beyond the end
+	if (out->reserved > out->offset && !out->error)
+		ftruncate(out->fd, out->offset);
+	fclose(out->sub);
+	fclose(out->idx);
+
+	pthread_mutex_destroy(&out->lock);
+	pthread_cond_destroy(&out->more);
+	pthread_cond_destroy(&out->room);
+	free(out->ring);
+	free(out);
+}
@@ -0,0 +1,46 @@
+/*
+
+ Output stage of vdrsub: the .sub and .idx files are written on a separate
+ writer thread, so that slow storage does not hold up the demux
+
+ Subpictures are laid out as PS sectors straight into a ring of sectors,
+ which the writer thread drains into the .sub file a chunk at a time, also
+ writing the .idx entry of each at the offset it tracks itself. The ring is
+ a bounded single-producer single-consumer queue: its indexes are updated
+ without locking, and either side only sleeps when the ring is full or it
+ has nothing to do, respectively
+
+*/
+
+#ifndef __OUTPUT_H
+#define __OUTPUT_H
+
+#include <stdio.h>
+#include "dvbsub.h"
+
+#define OUTPUT_SECTORS 2048		// ring of 4 MiB
+#define OUTPUT_CHUNK 512		// written 1 MiB at a time (unless flushed)
+#define OUTPUT_PREALLOC (32 << 20)	// reserved ahead of the .sub file
+
+typedef struct output output;
+
+// Start writing subpictures into 'sub' and their entries into 'idx', which
+// should already hold the idx header; neither file may be touched after
+// this except through output_*()
+// 'prealloc' reserves disk space ahead of the .sub file with fallocate(),
+// where the file system supports that
+// Returns NULL if the writer thread cannot be started
+output *output_open(FILE *sub, FILE *idx, int prealloc);
+
+// Queue vobsub packet 'data' for writing at 'pts' (relative to the start of
+// the video), blocking only while the ring is full
+// Returns the number of bytes queued, i.e. 2048 per sector
+size_t output_subpicture(output *out, const byte *data, size_t size, qword pts);
+
+// Have everything queued so far written out without waiting for it
+void output_flush(output *out);
+
+// Write out everything queued, stop the writer thread and close the files
+void output_close(output *out);
+
+#endif
@@ -0,0 +1,144 @@
+/*
+	Vectorised PID prefilter for blocks of TS packets; see pidfilter.h
+*/
+
+#include <string.h>
+#include <pthread.h>
+
+#include "pidfilter.h"
+
+#ifdef __x86_64__	// where SSE2 can be taken for granted
+#include <immintrin.h>
+#define PIDF_X86
+#endif
+
+void pidf_clear(struct pid_filter *pf)
+{
+	for (int i = 0; i < pf->n && i < PIDF_SIMD_MAX; i++)
+		pf->bits[pf->pid[i] >> 3] = 0;
+	if (pf->n > PIDF_SIMD_MAX)
+		memset(pf->bits, 0, sizeof pf->bits);
+	pf->n = 0;
+}
+
+void pidf_add(struct pid_filter *pf, word pid)
+{
+	pid &= 0x1FFF;
+	if (pf->bits[pid >> 3] & 1 << (pid & 7))
+		return;
+	pf->bits[pid >> 3] |= 1 << (pid & 7);
+	if (pf->n < PIDF_SIMD_MAX)
+		pf->pid[pf->n] = pid;
+	pf->n++;
+}
+
+static inline word packet_pid(const byte *p)
+{
+	return ((word) p[1] & 0x1F) << 8 | p[2];
+}
+
+static size_t select_scalar(const struct pid_filter *pf, const byte *p,
+ size_t from, size_t n, int stride, word *sel)
+{
+	size_t m = 0;
+	for (size_t k = from; k < n; k++)
+	{
+		word pid = packet_pid(p + k*stride);
+		if (pf->bits[pid >> 3] & 1 << (pid & 7))
+			sel[m++] = k;
+	}
+	return m;
+}
+
+#ifdef PIDF_X86
+
+// Each packet contributes the 32 bits at its sync byte, in little-endian
+// order: sync | flags_pid_hi << 8 | pid_lo << 16 | controls << 24;
+// the PID is put together from those as (x & 0x1F00) | (x >> 16 & 0xFF)
+
+__attribute__((target("avx2")))
+static size_t select_avx2(const struct pid_filter *pf, const byte *p,
+ size_t n, int stride, word *sel)
+{
+	__m256i want[PIDF_SIMD_MAX];
+	for (int i = 0; i < pf->n; i++)
+		want[i] = _mm256_set1_epi32(pf->pid[i]);
+	const __m256i offsets = _mm256_mullo_epi32(_mm256_set1_epi32(stride),
+		_mm256_setr_epi32(0,1,2,3,4,5,6,7));
+	const __m256i hi = _mm256_set1_epi32(0x1F00), lo = _mm256_set1_epi32(0xFF);
+
+	size_t k, m = 0;
+	for (k = 0; k + 8 <= n; k += 8)
+	{
+		__m256i x = _mm256_i32gather_epi32((const int *) (p + k*stride), offsets, 1);
+		__m256i pid = _mm256_or_si256(_mm256_and_si256(x, hi),
+			_mm256_and_si256(_mm256_srli_epi32(x, 16), lo));
+		__m256i hit = _mm256_cmpeq_epi32(pid, want[0]);
+		for (int i = 1; i < pf->n; i++)
+			hit = _mm256_or_si256(hit, _mm256_cmpeq_epi32(pid, want[i]));
+		unsigned mask = _mm256_movemask_ps(_mm256_castsi256_ps(hit));
+		while (mask)
+		{
+			sel[m++] = k + __builtin_ctz(mask);
+			mask &= mask - 1;
+		}
+	}
+	return m + select_scalar(pf, p, k, n, stride, sel + m);
+}
+
+static size_t select_sse2(const struct pid_filter *pf, const byte *p,
+ size_t n, int stride, word *sel)
+{
+	__m128i want[PIDF_SIMD_MAX];
+	for (int i = 0; i < pf->n; i++)
+		want[i] = _mm_set1_epi32(pf->pid[i]);
+	const __m128i hi = _mm_set1_epi32(0x1F00), lo = _mm_set1_epi32(0xFF);
+
+	size_t k, m = 0;
+	for (k = 0; k + 4 <= n; k += 4)
+	{
+		int w[4];
+		for (int j = 0; j < 4; j++)
+			memcpy(&w[j], p + (k+j)*stride, 4);
+		__m128i x = _mm_loadu_si128((const __m128i *) w);
+		__m128i pid = _mm_or_si128(_mm_and_si128(x, hi),
+			_mm_and_si128(_mm_srli_epi32(x, 16), lo));
+		__m128i hit = _mm_cmpeq_epi32(pid, want[0]);
+		for (int i = 1; i < pf->n; i++)
+			hit = _mm_or_si128(hit, _mm_cmpeq_epi32(pid, want[i]));
+		unsigned mask = _mm_movemask_ps(_mm_castsi128_ps(hit));
+		while (mask)
+		{
+			sel[m++] = k + __builtin_ctz(mask);
+			mask &= mask - 1;
+		}
+	}
+	return m + select_scalar(pf, p, k, n, stride, sel + m);
+}
+
+#endif
+
+#ifdef PIDF_X86
+static int have_avx2;
+
+static void detect_cpu_once(void)
+{
+	have_avx2 = __builtin_cpu_supports("avx2");
+}
+#endif
+
+size_t pidf_select(const struct pid_filter *pf, const byte *p, size_t n,
+ int stride, word *sel)
+{
+	if (pf->n == 0)
+		return 0;
+#ifdef PIDF_X86
+	// found out once for all contexts, whichever thread gets there first
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	pthread_once(&once, detect_cpu_once);
+	if (pf->n <= PIDF_SIMD_MAX)
+		return have_avx2 ? select_avx2(pf, p, n, stride, sel)
+			: select_sse2(pf, p, n, stride, sel);
+#endif
+	return select_scalar(pf, p, 0, n, stride, sel);
+}
@@ -0,0 +1,36 @@
+/*
+
+ PID prefilter: picks out of a block of TS packets (see tsread.h) those with
+ a wanted PID, so that only they need to go through process_ts_packet()
+
+ PIDs are extracted and compared several packets at a time with AVX2 or
+ SSE2 where available (chosen at run time), with a scalar fallback
+
+*/
+
+#ifndef __PIDFILTER_H
+#define __PIDFILTER_H
+
+#include <stddef.h>
+#include "dvbsub.h"
+
+#define PIDF_SIMD_MAX 8		// wanted PIDs compared in SIMD registers
+
+struct pid_filter {
+	int n;					// number of wanted PIDs
+	word pid[PIDF_SIMD_MAX];
+	byte bits[0x2000/8];	// all wanted PIDs as a bitmap
+};
+
+// Empty the set of wanted PIDs
+void pidf_clear(struct pid_filter *pf);
+
+// Add a PID (0 - 0x1FFF) to the set of wanted PIDs
+void pidf_add(struct pid_filter *pf, word pid);
+
+// Store the indexes of the packets in 'p' (n packets, 'stride' bytes apart)
+// that carry a wanted PID into 'sel' and return how many there were
+size_t pidf_select(const struct pid_filter *pf, const byte *p, size_t n,
+ int stride, word *sel);
+
+#endif
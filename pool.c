@@ -0,0 +1,130 @@
+/*
+	Work-stealing pool of threads; see pool.h
+*/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "pool.h"
+
+struct deque {
+	pthread_mutex_t lock;
+	size_t *task;			// indexes of the tasks dealt to the worker,
+	size_t head, tail;		// ... of which those from head to tail are left
+};
+
+struct pool {
+	int workers;
+	struct deque *dq;
+	const qword *cost;
+	void (*run)(void *arg, size_t i);
+	void *arg;
+};
+
+struct worker {
+	struct pool *pool;
+	int self;
+	pthread_t thread;
+};
+
+// Take the head of deque 'd' into *task, if anything is left in it
+static int pop(struct deque *d, size_t *task)
+{
+	int ok;
+	pthread_mutex_lock(&d->lock);
+	if ((ok = d->head < d->tail))
+		*task = d->task[d->head++];
+	pthread_mutex_unlock(&d->lock);
+	return ok;
+}
+
+// Take the next task of worker 'self': the head of its own deque, or else
+// the largest head of the others; 0 once there is nothing left anywhere
+static int take(struct pool *p, int self, size_t *task)
+{
+	if (pop(&p->dq[self], task))
+		return 1;
+	while (1)
+	{
+		int victim = -1;
+		qword largest = 0;
+		for (int k = 0; k < p->workers; k++)
+		{
+			struct deque *d = &p->dq[k];
+			pthread_mutex_lock(&d->lock);
+			if (d->head < d->tail && (victim < 0 || p->cost[d->task[d->head]] > largest))
+			{ victim = k; largest = p->cost[d->task[d->head]]; }
+			pthread_mutex_unlock(&d->lock);
+		}
+		if (victim < 0)
+			return 0;
+		if (pop(&p->dq[victim], task))
+			return 1;
+		// taken by its owner or another thief meanwhile: look again
+	}
+}
+
+static void *worker_thread(void *arg)
+{
+	struct worker *w = (struct worker *) arg;
+	size_t task;
+
+	while (take(w->pool, w->self, &task))
+		w->pool->run(w->pool->arg, task);
+	return NULL;
+}
+
+static int by_cost(const void *a, const void *b, void *cost)
+{
+	qword x = ((const qword *) cost)[*(const size_t *) a];
+	qword y = ((const qword *) cost)[*(const size_t *) b];
+	return x < y ? 1 : x > y ? -1 : 0;
+}
+
+void pool_run(int workers, size_t n, const qword *cost, void (*run)(void *arg, size_t i), void *arg)
+{
+	size_t *order = (size_t *) malloc(2 * n * sizeof *order);	// sorted, then dealt
+	struct deque *dq = (struct deque *) calloc(workers, sizeof *dq);
+	struct worker *w = (struct worker *) calloc(workers, sizeof *w);
+	struct pool p = { workers, dq, cost, run, arg };
+	size_t at = 0;
+	int k;
+
+	if (order == NULL || dq == NULL || w == NULL)
+	{
+		// run them all here and now instead
+		for (size_t i = 0; i < n; i++)
+			run(arg, i);
+		free(order); free(dq); free(w);
+		return;
+	}
+
+	// largest first, dealt round-robin: each deque from its largest down
+	for (size_t i = 0; i < n; i++)
+		order[i] = i;
+	qsort_r(order, n, sizeof *order, by_cost, (void *) cost);
+	for (k = 0; k < workers; k++)
+	{
+		pthread_mutex_init(&dq[k].lock, NULL);
+		dq[k].task = order + n + at;
+		for (size_t i = k; i < n; i += workers)
+			order[n + at++] = order[i];
+		dq[k].tail = order + n + at - dq[k].task;
+		w[k] = (struct worker) { &p, k };
+	}
+
+	// the deques of any threads that cannot be started are emptied by the
+	// others, this one at least
+	for (k = 1; k < workers; k++)
+		if (pthread_create(&w[k].thread, NULL, worker_thread, &w[k]))
+			w[k].self = -1;
+	worker_thread(&w[0]);
+	for (k = 1; k < workers; k++)
+		if (w[k].self >= 0)
+			pthread_join(w[k].thread, NULL);
+
+	for (k = 0; k < workers; k++)
+		pthread_mutex_destroy(&dq[k].lock);
+	free(order); free(dq); free(w);
+}
@@ -0,0 +1,25 @@
+/*
+
+ Work-stealing pool of threads for running many tasks of known cost, e.g.
+ converting a batch of recordings of known size
+
+ The tasks are dealt out largest first, round-robin, into a deque for each
+ worker, so that each deque holds its share from the largest down. A worker
+ takes the head of its own deque, and once that is empty, steals the
+ largest task at the head of any other, so that the largest tasks still go
+ first and no worker idles while there is work left. Tasks are heavy enough
+ for a lock per deque to cost next to nothing
+
+*/
+
+#ifndef __POOL_H
+#define __POOL_H
+
+#include <stddef.h>
+#include "dvbsub.h"
+
+// Run task i = 0 .. n-1 of cost[i] as run(arg, i) on 'workers' threads, one
+// of them the calling thread, and return once they have all been run
+void pool_run(int workers, size_t n, const qword *cost, void (*run)(void *arg, size_t i), void *arg);
+
+#endif
@@ -0,0 +1,106 @@
+/*
+	Parallel scan of a TS file for the packets of one PID; see scan.h
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "scan.h"
+#include "input.h"
+#include "tsread.h"
+#include "pidfilter.h"
+
+static void keep_packet(struct scan_range *r, const byte *p, qword offset)
+{
+	if (r->n == r->size)
+	{
+		r->size = r->size ? 2 * r->size : 1024;
+		r->packets = realloc(r->packets, r->size * 188);
+		r->offsets = realloc(r->offsets, r->size * sizeof *r->offsets);
+	}
+	memcpy(r->packets + r->n * 188, p, 188);
+	r->offsets[r->n++] = offset;
+}
+
+static void *scan_thread(void *arg)
+{
+	struct scan_range *r = (struct scan_range *) arg;
+	// read on past the end as far as resyncing near it may need to look
+	input *in = input_open_range(r->name, r->from, r->to + TS_LOCK_COUNT * 204);
+	struct ts_reader tr = { in };
+	struct pid_filter pf;
+	word sel[TS_BLOCK];
+	byte *p;
+	size_t n;
+
+	if (in == NULL)
+	{ r->failed = 1; return NULL; }
+	pidf_clear(&pf);
+	pidf_add(&pf, r->pid);
+
+	while ((n = ts_read_block(&tr, &p)) > 0)
+	{
+		qword at = input_position(in);
+		if (at >= r->to)
+			break;
+		if (at + n * tr.stride > r->to)
+			n = (r->to - at + tr.stride - 1) / tr.stride;
+		r->ts_packets += n;
+		if (r->pid_packets)
+			for (size_t k = 0; k < n; k++)
+				r->pid_packets[(p[k*tr.stride+1] & 0x1F) << 8 | p[k*tr.stride+2]]++;
+		size_t m = pidf_select(&pf, p, n, tr.stride, sel);
+		for (size_t k = 0; k < m; k++)
+			keep_packet(r, p + sel[k] * tr.stride, at + (qword) sel[k] * tr.stride);
+	}
+	r->skipped = tr.skipped;
+	r->resyncs = tr.resyncs;
+	input_close(in);
+	return NULL;
+}
+
+struct scan_range *scan_start(const char *name, qword from, qword to, int stride, word pid,
+ int jobs, int count_pids)
+{
+	struct scan_range *r = (struct scan_range *) calloc(jobs, sizeof *r);
+	qword packets = (to - from) / stride;
+
+	if (r == NULL)
+		return NULL;
+	for (int k = 0; k < jobs; k++)
+	{
+		r[k].name = name;
+		r[k].pid = pid;
+		if (count_pids)
+			r[k].pid_packets = (qword *) calloc(0x2000, sizeof (qword));
+		r[k].from = from + packets * k / jobs * stride;
+		r[k].to = k < jobs-1 ? from + packets * (k+1) / jobs * stride : to;
+		if (pthread_create(&r[k].thread, NULL, scan_thread, &r[k]) == 0)
+			r[k].running = 1;
+		else
+			scan_thread(&r[k]);		// scan it here and now instead
+	}
+	return r;
+}
+
+struct scan_range *scan_wait(struct scan_range *r, int k)
+{
+	if (r[k].running)
+	{
+		pthread_join(r[k].thread, NULL);
+		r[k].running = 0;
+	}
+	return &r[k];
+}
+
+void scan_free(struct scan_range *r, int jobs)
+{
+	for (int k = 0; k < jobs; k++)
+	{
+		scan_wait(r, k);
+		free(r[k].packets);
+		free(r[k].offsets);
+		free(r[k].pid_packets);
+	}
+	free(r);
+}
@@ -0,0 +1,48 @@
+/*
+
+ Parallel scan of a TS file for the packets of one PID
+
+ The part of the file to scan is split into ranges at packet boundaries,
+ and each range is read by a thread of its own through the mmap backend
+ (see input.h), resynchronising and filtering its packets as tsread.h and
+ pidfilter.h do for the sequential scan. The packets found are handed back
+ a range at a time in file order, so that feeding them on in that order
+ goes just as a sequential scan would, PES packets spanning ranges included
+
+*/
+
+#ifndef __SCAN_H
+#define __SCAN_H
+
+#include <pthread.h>
+#include "dvbsub.h"
+
+struct scan_range {
+	const char *name;
+	qword from, to;			// packets starting in between are scanned
+	word pid;
+	byte *packets;			// those found, 188 bytes each
+	qword *offsets;			// ... and where in the file they were
+	size_t n, size;			// packets found, room for
+	qword ts_packets;		// packets scanned
+	qword *pid_packets;		// ... of each PID, if counted
+	qword skipped, resyncs;	// bytes skipped while out of sync, times in sync
+	int failed;				// the range could not be read
+	int running;			// on a thread of its own, not yet joined
+	pthread_t thread;
+};
+
+// Split bytes 'from' to 'to' of TS file 'name', whose packets are 'stride'
+// bytes apart from 'from' on, into 'jobs' ranges and start scanning each of
+// them for packets of 'pid', also counting the packets of each PID if asked
+// to. Returns the ranges, or NULL if out of memory
+struct scan_range *scan_start(const char *name, qword from, qword to, int stride, word pid,
+ int jobs, int count_pids);
+
+// Wait for range 'k' to be scanned and return it
+struct scan_range *scan_wait(struct scan_range *r, int k);
+
+// Release the ranges, all of them waited for
+void scan_free(struct scan_range *r, int jobs);
+
+#endif
@@ -0,0 +1,110 @@
+/*
+	Sidecar index of a recording; see sidecar.h
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "sidecar.h"
+
+#define SIDECAR_HEADER "# vdrsub sidecar index, v1\n"
+
+static char *sidecar_name(const char *name, const char *ext)
+{
+	char *s = malloc(strlen(name) + 12);
+	if (s != NULL)
+		sprintf(s, "%s.vdrsub%s", name, ext);
+	return s;
+}
+
+int sidecar_load(const char *name, struct sidecar *sc)
+{
+	char *sname = sidecar_name(name, ""), line[128], type[8];
+	FILE *f = sname ? fopen(sname, "r") : NULL;
+	struct stat st;
+	unsigned long long size, sec, nsec;
+	unsigned pmt, video, sub, composition, ancillary;
+	int ok;
+
+	free(sname);
+	memset(sc, 0, sizeof *sc);
+	if (f == NULL)
+		return -1;
+
+	ok = stat(name, &st) == 0
+	 && fgets(line, sizeof line, f) && !strcmp(line, SIDECAR_HEADER)
+	 && fscanf(f, "recording: size %llu, mtime %llu.%llu\n", &size, &sec, &nsec) == 3
+	 && size == st.st_size && sec == st.st_mtim.tv_sec && nsec == st.st_mtim.tv_nsec
+	 && fscanf(f, "input: %7[a-z], stride %d\n", type, &sc->stride) == 2
+	 && fscanf(f, "pids: pmt %x, video %x, subtitles %x\n", &pmt, &video, &sub) == 3
+	 && fscanf(f, "ids: composition %u, ancillary %u\n", &composition, &ancillary) == 2
+	 && fscanf(f, "first video pts: %llu\n", &sc->first_video_pts) == 1;
+	if (ok)
+	{
+		sc->vdr = !strcmp(type, "vdr");
+		sc->pmt_pid = pmt; sc->video_pid = video; sc->sub_pid = sub;
+		sc->composition_id = composition; sc->ancillary_id = ancillary;
+
+		qword first, last, pts;
+		while (fgets(line, sizeof line, f))
+			if (sscanf(line, "pes: %llx %llx %llu", &first, &last, &pts) == 3)
+				sidecar_add(sc, first, last, pts);
+			else
+			{ ok = 0; break; }
+	}
+	fclose(f);
+	if (!ok)
+		sidecar_free(sc);
+	return ok ? 0 : -1;
+}
+
+void sidecar_add(struct sidecar *sc, qword first, qword last, qword pts)
+{
+	if (sc->n == sc->size)
+	{
+		sc->size = sc->size ? 2 * sc->size : 1024;
+		sc->pes = realloc(sc->pes, sc->size * sizeof *sc->pes);
+	}
+	sc->pes[sc->n++] = (struct sidecar_pes) { first, last, pts };
+}
+
+int sidecar_save(const char *name, struct sidecar *sc)
+{
+	char *sname = sidecar_name(name, ""), *tmp = sidecar_name(name, ".tmp");
+	FILE *f = tmp ? fopen(tmp, "w") : NULL;
+	struct stat st;
+	int ok = f != NULL && stat(name, &st) == 0;
+
+	if (ok)
+	{
+		fputs(SIDECAR_HEADER, f);
+		fprintf(f, "recording: size %llu, mtime %llu.%09llu\n", (unsigned long long) st.st_size,
+		 (unsigned long long) st.st_mtim.tv_sec, (unsigned long long) st.st_mtim.tv_nsec);
+		fprintf(f, "input: %s, stride %d\n", sc->vdr ? "vdr" : "ts", sc->stride);
+		fprintf(f, "pids: pmt %04X, video %04X, subtitles %04X\n",
+		 sc->pmt_pid, sc->video_pid, sc->sub_pid);
+		fprintf(f, "ids: composition %u, ancillary %u\n", sc->composition_id, sc->ancillary_id);
+		fprintf(f, "first video pts: %llu\n", sc->first_video_pts);
+		for (size_t i = 0; i < sc->n; i++)
+			fprintf(f, "pes: %llX %llX %llu\n", sc->pes[i].first, sc->pes[i].last, sc->pes[i].pts);
+	}
+	if (f != NULL && fclose(f) != 0)
+		ok = 0;
+	// in place only once complete, so that a broken run leaves no index
+	if (ok && rename(tmp, sname) != 0)
+		ok = 0;
+	if (!ok && tmp)
+		remove(tmp);
+	free(sname); free(tmp);
+	return ok ? 0 : -1;
+}
+
+void sidecar_free(struct sidecar *sc)
+{
+	free(sc->pes);
+	sc->pes = NULL;
+	sc->n = sc->size = 0;
+}
@@ -0,0 +1,53 @@
+/*
+
+ Sidecar index of a recording, kept next to it as <recording>.vdrsub so
+ that converting it again takes no scan of the whole file
+
+ The first pass records what it found in the PSI, the first video PTS and,
+ for each subtitle PES packet, its PTS and the offsets of the first and the
+ last TS packet carrying it (of the PES packet itself in a .VDR file).
+ A later pass checks the index against the size and modification time of
+ the recording, and then only reads those spans
+
+ The index is a text file, one PES packet per line after a short header
+
+*/
+
+#ifndef __SIDECAR_H
+#define __SIDECAR_H
+
+#include <stddef.h>
+#include "dvbsub.h"
+
+struct sidecar_pes {
+	qword first, last;		// offsets of the first and last packet
+	qword pts;
+};
+
+struct sidecar {
+	int vdr;				// a .VDR file rather than TS
+	int stride;				// TS packet size (188, 192 or 204)
+	word pmt_pid, video_pid, sub_pid;
+	word composition_id, ancillary_id;
+	qword first_video_pts;
+	struct sidecar_pes *pes;
+	size_t n, size;			// PES packets recorded, allocated for
+};
+
+// Read the index of recording 'name' into sc, which it should be freed from
+// Returns 0 if done, -1 if there is none or it no longer matches the file
+int sidecar_load(const char *name, struct sidecar *sc);
+
+// Record a subtitle PES packet
+void sidecar_add(struct sidecar *sc, qword first, qword last, qword pts);
+
+// Write the index of recording 'name', stamped with its current size and
+// modification time, replacing any older one; returns 0 if done
+// NOTE: it is up to the caller to tell that the file did not change after
+// it was indexed, other than while following it to its end
+int sidecar_save(const char *name, struct sidecar *sc);
+
+// Release the PES list
+void sidecar_free(struct sidecar *sc);
+
+#endif
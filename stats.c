@@ -0,0 +1,88 @@
+/*
+	Run-time statistics for --stats; see stats.h
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <time.h>
+
+#include "stats.h"
+
+struct stats stats;
+int stats_enabled = 0;
+
+static qword started, next_report, interval_ns;
+
+qword stats_clock(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (qword) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void stats_init(int interval)
+{
+	stats_enabled = 1;
+	started = stats_clock();
+	interval_ns = (qword) interval * 1000000000;
+	next_report = interval ? started + interval_ns : 0;
+}
+
+void stats_tick(void)
+{
+	if (!next_report)
+		return;
+	qword now = stats_clock();
+	if (now < next_report)
+		return;
+	next_report = now + interval_ns;
+	stats_report();
+}
+
+static const char *segment_name(int type)
+{
+	switch (type)
+	{
+	case 0x10: return "page";
+	case 0x11: return "region";
+	case 0x12: return "CLUT";
+	case 0x13: return "object";
+	case 0x14: return "display definition";
+	case 0x80: return "end of display set";
+	case 0xFF: return "stuffing";
+	default: return NULL;
+	}
+}
+
+void stats_report(void)
+{
+	double elapsed = (stats_clock() - started) / 1e9, mb = stats.bytes_in / 1e6;
+	double t_late = (stats.t_decode + stats.t_encode + stats.t_write) / 1e9;
+
+	fprintf(stderr,"vdrsub stats after %.2f s :\n",elapsed);
+	fprintf(stderr," input: %.1f MB, %.1f MB/s\n",mb,elapsed > 0 ? mb/elapsed : 0);
+	if (stats.ts_packets)
+	{
+		fprintf(stderr," TS packets: %llu; lock acquired %llu times, %llu bytes skipped\n",
+		 stats.ts_packets,stats.ts_resyncs,stats.ts_skipped);
+		for (int pid = 0; pid < 0x2000; pid++)
+			if (stats.pid_packets[pid])
+				fprintf(stderr,"  PID 0x%04X: %llu\n",pid,stats.pid_packets[pid]);
+	}
+	fprintf(stderr," subtitle PES: %llu reassembled, %llu duplicates dropped, %llu sync errors\n",
+	 stats.pes_packets,stats.pes_duplicates,stats.pes_sync_errors);
+	fprintf(stderr," DVB segments:");
+	for (int type = 0, n = 0; type < 256; type++)
+		if (stats.segments[type])
+		{
+			const char *name = segment_name(type);
+			if (name) fprintf(stderr,"%s %s %llu",n++ ? "," : "",name,stats.segments[type]);
+			else fprintf(stderr,"%s 0x%02X %llu",n++ ? "," : "",type,stats.segments[type]);
+		}
+	fprintf(stderr,"\n subpictures: %llu drawn, %llu wiped; %llu reused from cache, %llu repeats coalesced\n",
+	 stats.drawn,stats.wiped,stats.reused,stats.coalesced);
+	fprintf(stderr," vobsub: %llu bytes\n",stats.vobsub_bytes);
+	fprintf(stderr," time: read %.3f s, demux %.3f s, decode %.3f s, encode %.3f s, write %.3f s, close %.3f s\n",
+	 stats.t_read/1e9,stats.t_demux/1e9 - t_late,stats.t_decode/1e9,
+	 stats.t_encode/1e9,stats.t_write/1e9,stats.t_close/1e9);
+}
@@ -0,0 +1,60 @@
+/*
+
+ Run-time statistics for --stats: per-stage counters and timing
+
+ Counters and clock readings are only kept when stats_enabled is set,
+ which is only ever done with one conversion at a time: conversions side by
+ side (batch and daemon mode) would share them. Times are taken from the
+ monotonic clock and reported per stage; 'demux' excludes the time spent in
+ the later stages it calls into, and closing the output, being done after
+ the demux, is timed on its own
+
+*/
+
+#ifndef __STATS_H
+#define __STATS_H
+
+#include "dvbsub.h"
+
+struct stats {
+	qword bytes_in;			// input consumed
+	qword ts_packets;		// TS packets received
+	qword pid_packets[0x2000];	// ... by PID (when enabled)
+	qword ts_resyncs, ts_skipped;	// times lock was gained, bytes skipped
+	qword pes_packets;		// subtitle PES packets put together
+	qword pes_duplicates;	// dropped as repeated continuity counter
+	qword pes_sync_errors;	// PES start code missing where expected
+	qword segments[256];	// DVB subtitling segments by type
+	qword drawn, wiped;		// subpictures
+	qword reused;			// ... drawn without encoding them again
+	qword coalesced;		// ... not drawn again, being on display already
+	qword vobsub_bytes;		// written into the .sub file
+
+	qword t_read, t_demux, t_decode, t_encode, t_write;	// ns, inclusive
+	qword t_close;			// ... of flushing and closing the output at the end
+};
+
+extern struct stats stats;
+extern int stats_enabled;
+
+// Monotonic time in nanoseconds
+qword stats_clock(void);
+
+// Add to a field, or set it
+#define STATS_ADD(field, n) (stats_enabled ? (void) (stats.field += (n)) : (void) 0)
+#define STATS_SET(field, x) (stats_enabled ? (void) (stats.field = (x)) : (void) 0)
+
+// Take the time at the start of a stage, and add the time since to a field
+#define STATS_START(t) qword t = stats_enabled ? stats_clock() : 0
+#define STATS_STOP(field, t) (stats_enabled ? (void) (stats.field += stats_clock() - (t)) : (void) 0)
+
+// Enable stats, to be reported every 'interval' seconds (0 =only at exit)
+void stats_init(int interval);
+
+// Report now if the interval has passed; cheap enough to call per block
+void stats_tick(void);
+
+// Write a report of everything so far to stderr
+void stats_report(void);
+
+#endif
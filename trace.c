@@ -0,0 +1,169 @@
+/*
+	Buffered trace sinks for verb(); see trace.h
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "dvbsub.h"
+#include "trace.h"
+
+unsigned verbose_level = 0;
+
+static enum { TEXT, JSON, BIN } sink = TEXT;
+static FILE *out;
+static struct timespec start;
+
+static char buf[1 << 16];		// output buffer
+static size_t buf_len;
+static char line[4096];			// message being put together (json, bin)
+static size_t line_len;
+static unsigned line_level;
+
+// messages may come from several threads, e.g. converting a batch of files
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void flush(void)
+{
+	if (buf_len)
+		fwrite(buf, 1, buf_len, out ? out : stderr);
+	buf_len = 0;
+	fflush(out ? out : stderr);
+}
+
+void trace_flush(void)
+{
+	pthread_mutex_lock(&lock);
+	flush();
+	pthread_mutex_unlock(&lock);
+}
+
+static void put(const void *data, size_t len)
+{
+	if (buf_len + len > sizeof buf)
+	{
+		flush();
+		if (len > sizeof buf)
+		{ fwrite(data, 1, len, out ? out : stderr); return; }
+	}
+	memcpy(buf + buf_len, data, len);
+	buf_len += len;
+}
+
+static qword elapsed_ns(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (qword) (now.tv_sec - start.tv_sec) * 1000000000 + now.tv_nsec - start.tv_nsec;
+}
+
+// emit the assembled line as one record
+static void put_record(void)
+{
+	qword t = elapsed_ns();
+	if (sink == BIN)
+	{
+		struct { uint64_t t; uint32_t cat, len; } hdr
+			= { t, line_level, line_len };
+		put(&hdr, sizeof hdr);
+		put(line, line_len);
+	}
+	else
+	{
+		char esc[8], head[64];
+		int n = snprintf(head, sizeof head, "{\"t\":%llu,\"cat\":%u,\"msg\":\"", t, line_level);
+		put(head, n);
+		for (size_t i = 0; i < line_len; i++)
+		{
+			unsigned char c = line[i];
+			if (c == '"' || c == '\\')
+			{ esc[0] = '\\'; esc[1] = c; put(esc, 2); }
+			else if (c < 0x20 || c >= 0x7F)
+				put(esc, snprintf(esc, sizeof esc, "\\u%04X", c));
+			else
+				put(&c, 1);
+		}
+		put("\"}\n", 3);
+	}
+	line_len = 0;
+}
+
+void verb_emit(unsigned level, const char *format, ...)
+{
+	char msg[sizeof line];
+	va_list args;
+	va_start(args, format);
+	int len = vsnprintf(msg, sizeof msg, format, args);
+	va_end(args);
+	if (len >= (int) sizeof msg)
+		len = sizeof msg - 1;
+	if (len <= 0)
+		return;
+
+	pthread_mutex_lock(&lock);
+	if (sink == TEXT)
+	{
+		put(msg, len);
+		if (level == 1)		// don't hold back errors
+			flush();
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+
+	// put lines together; a record ends at a newline
+	for (int i = 0; i < len; i++)
+	{
+		if (line_len == 0)
+			line_level = level;
+		if (msg[i] == '\n')
+			put_record();
+		else if (line_len < sizeof line)
+			line[line_len++] = msg[i];
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+static void trace_exit(void)
+{
+	if (line_len)
+		put_record();
+	trace_flush();
+	if (out)
+		fclose(out);
+}
+
+// Select the sink as per SUB_TRACE (see trace.h)
+static void init_sink(void)
+{
+	static int done = 0;
+	if (done++)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	char *spec = getenv("SUB_TRACE");
+	if (spec != NULL)
+	{
+		char *file = strchr(spec, ':');
+		if (!strncmp(spec, "json", 4)) sink = JSON;
+		else if (!strncmp(spec, "bin", 3)) sink = BIN;
+		if (file != NULL && (out = fopen(file+1, sink == BIN ? "wb" : "w")) == NULL)
+			fprintf(stderr, "Unable to write trace file %s\n", file+1);
+	}
+	if (sink == BIN && out == NULL)
+		sink = JSON;	// keep binary records off the terminal
+	atexit(trace_exit);
+}
+
+void init_verbose(int level)
+{
+	char *verb = getenv("SUB_VERBOSE");
+	if (verb != NULL) verbose_level=atoi(verb);
+	else verbose_level = level;
+	init_sink();
+}
@@ -0,0 +1,52 @@
+/*
+
+ Diagnostic tracing behind verb(level, format, ...)
+
+ 'level' is a set of category bits, the same ones SUB_VERBOSE selects :
+ 1 =errors; 2 =decoded subtitling segments; 4 =subpicture timing;
+ 8 =subpictures as text; 16 =subtitle PES and dvbsub data; 32 =PES headers;
+ 64 =TS packets; 128 =PSI; 32768 =dump vobsub packets into vobsub.dat
+ A message is output when all of its bits are enabled
+
+ A disabled message costs one test against the cached verbose_level, and
+ nothing at all when its bits are left out of VERBOSE_MASK at compile time
+ (e.g. -DVERBOSE_MASK=129 keeps only errors and PSI); without -DVERBOSE
+ every verb() compiles to nothing
+
+ Messages go through a buffer into the sink chosen by env. variable
+ SUB_TRACE, flushed when full and at exit :
+ text[:file]  plain text as before (default, to stderr)
+ json[:file]  one JSON object per line:  {"t":ns,"cat":level,"msg":"..."}
+ bin:file     binary records: 64-bit t (ns), 32-bit cat and len, then len
+              bytes of message text; integers in host byte order
+ where t is monotonic time since start-up, and a record covers one line
+ (messages are put together until a newline)
+
+*/
+
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#ifndef VERBOSE_MASK
+#define VERBOSE_MASK 0xFFFFFFFFu
+#endif
+
+extern unsigned verbose_level;
+
+#ifdef VERBOSE
+#define verb_on(level) (((level) & VERBOSE_MASK) == (level) \
+	&& __builtin_expect(((level) & verbose_level) == (level), 0))
+#define verb(level, ...) (verb_on(level) ? verb_emit((level), __VA_ARGS__) : (void) 0)
+#else
+#define verb_on(level) 0
+#define verb(...) ((void) 0)
+#endif
+
+// Format and queue a message of the given category; use verb() instead
+void verb_emit(unsigned level, const char *format, ...)
+	__attribute__((format(printf, 2, 3)));
+
+// Write out any buffered messages
+void trace_flush(void);
+
+#endif
@@ -0,0 +1,74 @@
+/*
+	Transport stream resynchronisation and fixed-stride packet blocks; see tsread.h
+*/
+
+#include <string.h>
+
+#include "tsread.h"
+
+static const int strides[] = { 188, 192, 204 };
+
+// return the stride at which the stream locks on at 's', or 0 if it doesn't
+static int find_stride(const byte *s, const byte *end, int last)
+{
+	for (int i = 0; i < sizeof strides / sizeof *strides; i++)
+		if (ts_locks(s, end, strides[i], last))
+			return strides[i];
+	return 0;
+}
+
+// find the next position where the stream locks on, skipping anything before it
+static int resync(struct ts_reader *tr)
+{
+	const size_t need = TS_LOCK_COUNT * 204;
+	byte *p, *s;
+	size_t len;
+
+	while ((len = input_peek(tr->in, need, &p)) >= 188)
+	{
+		byte *end = p + len;
+		int last = len < need, stride = 0;
+		for (s = p; (s = memchr(s, 0x47, end-s)) != NULL; s++)
+		{
+			// move the window up to a candidate too close to its end
+			if (!last && s + need > end)
+				break;
+			if ((stride = find_stride(s, end, last)) != 0)
+				break;
+		}
+		if (s == NULL)
+			s = end;
+		tr->skipped += s-p;
+		input_skip(tr->in, s-p);
+		if (stride)
+		{ tr->stride = stride; tr->resyncs++; return 1; }
+	}
+	tr->skipped += len;
+	input_skip(tr->in, len);
+	return 0;
+}
+
+size_t ts_read_block(struct ts_reader *tr, byte **p)
+{
+	input_skip(tr->in, tr->pending);
+	tr->pending = 0;
+
+	while (tr->stride || resync(tr))
+	{
+		size_t len = input_peek(tr->in, tr->stride, p), n, k;
+		if (len < 188)
+			break;
+		n = (len - 188) / tr->stride + 1;
+		if (n > TS_BLOCK)
+			n = TS_BLOCK;
+		// while locked, checking the sync byte of each packet suffices
+		for (k = 0; k < n && (*p)[k * tr->stride] == 0x47; k++);
+		if (k > 0)
+		{
+			tr->pending = k * tr->stride < len ? k * tr->stride : len;
+			return k;
+		}
+		tr->stride = 0;		// lost sync, search again
+	}
+	return 0;
+}
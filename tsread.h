@@ -0,0 +1,51 @@
+/*
+
+ Transport stream packet framing on top of the input layer (see input.h)
+
+ The reader searches for a sync byte with memchr() and only locks on when
+ TS_LOCK_COUNT sync bytes are found at the same stride, detecting the packet
+ size on the way: 188 (plain TS), 192 (M2TS, a 4-byte timecode before each
+ packet) or 204 (TS with 16 bytes of Reed-Solomon parity after each packet).
+ Once locked, packets are handed out in fixed-stride blocks straight from
+ the input buffer and only their sync bytes are checked.
+
+*/
+
+#ifndef __TSREAD_H
+#define __TSREAD_H
+
+#include "input.h"
+
+#define TS_LOCK_COUNT 5		// consecutive sync bytes needed to (re)gain lock
+#define TS_BLOCK 1024		// most packets handed out at once
+
+struct ts_reader {
+	input *in;
+	int stride;				// 188, 192 or 204 when locked, 0 when searching
+	size_t pending;			// bytes of the last block not yet consumed
+	qword resyncs;			// number of times lock has been (re)gained
+	qword skipped;			// bytes skipped while out of sync
+};
+
+// Return the number of packets in the next block and point *p to the sync
+// byte of the first one; packet k starts at *p + k * stride
+// The block stays valid until the next call; 0 is returned at end of input
+size_t ts_read_block(struct ts_reader *tr, byte **p);
+
+// Tell if the stream locks on at 's' at 'stride', i.e. there are sync bytes
+// at 's' + k*stride for as many packets as there are before 'end' (up to
+// TS_LOCK_COUNT); 'last' tells if the input ends at 'end'
+static inline int ts_locks(const byte *s, const byte *end, int stride, int last)
+{
+	int k;
+	if (*s != 0x47)
+		return 0;
+	for (k = 1; k < TS_LOCK_COUNT && s + k*stride < end; k++)
+		if (s[k*stride] != 0x47)
+			return 0;
+	// near the end of input, fewer will do if they are all there is, but a
+	// lone sync byte is no confirmation
+	return k == TS_LOCK_COUNT || (last && k >= 2 && s + 188 <= end);
+}
+
+#endif
@@ -1,636 +1,664 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdarg.h>
 #include <sys/stat.h>
 #include <stdlib.h>
 #include <string.h>
-#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <ftw.h>
+#include <sys/resource.h>
+
+#include "libvdrsub.h"
+#include "trace.h"
+#include "input.h"
+#include "tsread.h"
+#include "stats.h"
+#include "output.h"
+#include "sidecar.h"
+#include "scan.h"
+#include "pool.h"
+#include "daemon.h"
 
-#pragma pack(1)
-
-#include "dvbsub.h"
-
-#define NETWORD(x) (x = (word) ntohs(x))
 #define isnum(a) ((a)>='0' && (a)<='9')
 #define isalpha(a) ((a)>='a' && (a)<='z')
 
-// in dvbsub.c :
-#ifdef VERBOSE
-extern int verbose_level;
-void verb(int level, const char *format, ...);
-#else
-#define verb(...)
-#endif
-qword loadbits(int bits, byte **p, byte *b, byte *mask);
-
-// in write-ps.c :
-void write_vobsub_ps(byte*,size_t,qword,FILE*);
-
-subpicture subp;	// stores the subpicture decoding context
-FILE *dotsub;		// output files
-FILE *dotidx;
-qword first_video_pts = 0;	// subtracted from each subpicture PTS
-word pmt_pid = -1, video_pid = -1, sub_pid = -1;	// PIDs found in the TS
-word composition_id = -1, ancillary_id = -1;
-
-enum { TS, VDR } input_type = TS;
+enum { TS, VDR };
 enum { CONVERT=1, PSI=2 } operation = CONVERT | PSI;
-char *language = NULL;
 
-// Only used when processing a .VDR file
-static byte *pes_data = NULL;	// aggregate subtitle PES payload here
-static size_t pes_len = 0;
-static qword pes_pts = 0;		// obtain PTS from each leading packet
+#define JOB_TRACKS 64
+#define PROGRAMS 64		// chosen with --program, at most
+
+// What becomes of the subpictures and the PSI of the recording converted
+struct job {
+	output *out;		// the .sub and .idx files are written through this
+	FILE *idx;			// ... that one also for rewriting the palette
+	long palette_at;	// offset of the palette line in idx
+	int palette_changes;	// ... last written with this many changes made
+	int follow;			// idle timeout when following a growing recording, or 0
+	struct sidecar *indexing;	// subtitle PES packets found, when indexing
+	qword subpictures;	// drawn
+	qword bytes_in;		// of the recording read through
+	const char *error;	// why it could not be converted, or NULL
+
+	// with --all-tracks, those of each subtitle track found, written into
+	// files named after 'base' and what 'name' the track is given, the
+	// program in it too when more than one program is followed
+	const char *base;
+	int prealloc, psi;
+	word program;
+	int programs;
+	char name[24];
+	struct job *track[JOB_TRACKS];
+	int tracks;
+};
+
+// The palette line of the .idx file, always of the same length so that it
+// can be rewritten in place as the palette fills up
+#define IDX_PALETTE_LINE (9 + 16*8 + 1)
+static void idx_palette(char *line, const dword rgb[16])
+{
+	line += sprintf(line,"palette: ");
+	for (int i = 0; i < 16; i++)
+		line += sprintf(line,"%06lX%s",rgb[i] & 0xFFFFFF,i < 15 ? ", " : "\n");
+}
 
-void process_dvbsub_data(byte *p, size_t length, qword pts)
+// Start writing the .sub and .idx files of 'job', 'base'.sub and 'base'.idx,
+// for subtitles in language 'id'; returns 0, or 1 with job->error set
+static int open_output(struct job *job, const char *base, const char *id, int prealloc)
 {
-	// When carrying a DVB subtitle stream, PES packet data content is:
-	// 1 byte : data_identifier 				=0x20
-	// 1 byte : subtitle_stream_id				=0x00
-	//  bytes : subtitling_segments  (begin with 0x0F)
-	// 1 byte : end_of_PES_data_field_marker	=0xFF
-
-	if (p[0] != 0x20 || p[1] != 0x00)
-		return;
-	p += 2; length -= 2;
-
-	verb(16,"Processing dvbsub data length=%d\n",length);
-	byte *vobsub = dvb2vobsub_translation(p,length-1,&subp);
-
-	if (!vobsub)
-		return;
-	float s=(pts - first_video_pts)/90000.0;
-	
-#ifdef VERBOSE
-	if (subp.live_state == DRAW)
-	{ verb(4,"%02d:%02d:%02d:%03d :\n",
-	 (int) s/3600,(int) (s/60) % 60,(int) s % 60,
-	 (int) ((s-((int) s))*1000));
-	for (int i=0; i<subp.h; i++, verb(8,"\n"))
-		for (int j=0; j<subp.w && j<80; j++)
-			verb(8,"%c",' '+subp.pix[i*subp.w + j]); }
-	else
-		verb(4,"---> %02d:%02d:%02d:%03d\n-----------------\n",
-		 (int) s/3600,(int) (s/60) % 60,(int) s % 60,
-		 (int) ((s-((int) s))*1000));
-	if (verbose_level & 32768)
+	char *name = (char *) malloc(strlen(base)+5);
+	FILE *dotsub, *dotidx;
+
+	sprintf(name,"%s.sub",base); dotsub = fopen(name,"wb");
+	sprintf(name,"%s.idx",base); dotidx = fopen(name,"w");
+	free(name);
+	if (dotsub == NULL || dotidx == NULL)
 	{
-		FILE *raw = fopen("vobsub.dat","ab");
-		fwrite(vobsub,1,((word) vobsub[0])<<8 | vobsub[1],raw);
-		fclose(raw);
-	}	 
-#endif
+		fprintf(stderr,"Unable to write .sub and/or .idx file\n");
+		job->error = "unable to write .sub and/or .idx file";
+		goto failed;
+	}
 
-	if (operation & CONVERT)
+	fputs("# VobSub index file, v7 (do not modify this line!)\n",dotidx);
+	// all black for now, filled in as the colours turn up
+	char line[IDX_PALETTE_LINE];
+	idx_palette(line,(dword [16]) {0});
+	job->palette_at = ftell(dotidx);
+	fputs(line,dotidx);
+	fprintf(dotidx,"\nid: %s, index: 0\n",id);
+	job->idx = dotidx;
+	if ((job->out = output_open(dotsub,dotidx,prealloc)) == NULL)
+	{
+		fprintf(stderr,"Unable to start writing .sub and .idx files\n");
+		job->error = "unable to start writing .sub and .idx files";
+		goto failed;
+	}
+	return 0;
+
+failed:
+	if (dotsub) fclose(dotsub);
+	if (dotidx) fclose(dotidx);
+	return 1;
+}
+
+// The ISO 639-2 codes of subtitling descriptors, and the ISO 639-1 ones of
+// VobSub for them; others go by their first two letters
+static const char *const languages[][2] = {
+	{ "fin","fi" }, { "swe","sv" }, { "sme","se" }, { "eng","en" }, { "nor","no" },
+	{ "dan","da" }, { "isl","is" }, { "ice","is" }, { "est","et" }, { "rus","ru" },
+	{ "ger","de" }, { "deu","de" }, { "fre","fr" }, { "fra","fr" }, { "spa","es" },
+	{ "ita","it" }, { "dut","nl" }, { "nld","nl" }, { "pol","pl" }, { "por","pt" },
+};
+
+// A subtitle track found, with --all-tracks: into <base>.<language>.sub and
+// .idx, the hard of hearing ones <base>.<language>-hoh.*, the language
+// repeated <base>.<language>.2.* and so on; of several programs followed,
+// <base>.<program>.<language>.* and so on
+static void *open_track(void *user, const struct vdrsub_stream *s)
+{
+	struct job *job = (struct job *) user, *t;
+	char lang[4], id[3];
+
+	if (job->tracks == JOB_TRACKS || (t = (struct job *) calloc(1, sizeof *t)) == NULL)
+		return NULL;
+	for (int i = 0; i < 3; i++)
+		lang[i] = isalpha(s->language[i] | 0x20) ? s->language[i] | 0x20 : 'x';
+	lang[3] = 0;
+	sprintf(id,"%.2s",lang);
+	for (int i = 0; i < sizeof languages / sizeof *languages; i++)
+		if (!strcmp(languages[i][0],lang))
+			strcpy(id,languages[i][1]);
+	char *name = t->name;
+	if (job->programs > 1)
+		name += sprintf(name,"%d.",s->program);
+	sprintf(name,"%s%s",lang,s->type >= 0x20 && s->type <= 0x24 ? "-hoh" : "");
+	for (int n = 2, k = 0; k < job->tracks; k++)
+		if (!strcmp(job->track[k]->name,t->name))
+		{
+			sprintf(name,"%s%s.%d",lang,s->type >= 0x20 && s->type <= 0x24 ? "-hoh" : "",n++);
+			k = -1;		// look the new name up again
+		}
+
+	char *base = (char *) malloc(strlen(job->base) + sizeof t->name + 1);
+	sprintf(base,"%s.%s",job->base,t->name);
+	t->follow = job->follow;
+	if (open_output(t,base,id,job->prealloc))
 	{
-		fprintf(dotidx,"timestamp: %02d:%02d:%02d:%03d, filepos: %08X\n",
-		 (int) s/3600,(int) (s/60) % 60,(int) s % 60,
-		 (int) ((s-((int) s))*1000), ftell(dotsub));
-		write_vobsub_ps(vobsub, ((word) vobsub[0])<<8 | vobsub[1], pts - first_video_pts, dotsub);
+		job->error = t->error;
+		free(base); free(t);
+		return NULL;
 	}
-	free(vobsub);
+	verb(1,"Subtitles in language \"%.3s\" of program %d (PID 0x%04X, page %d) into %s.sub\n",
+	 s->language,s->program,s->pid,s->page[0],base);
+	free(base);
+	return job->track[job->tracks++] = t;
 }
-	
-void process_pes_packet(byte data[])
+
+static void write_vobsub(void *user, subpicture *sp, const byte *spu, size_t len, qword pts)
 {
-	byte *p = data;
+	struct job *job = (struct job *) user;
+
+	job->subpictures += sp->live_state == DRAW;
+	STATS_START(t);
+	size_t written = output_subpicture(job->out, spu, len, pts);
+	STATS_ADD(vobsub_bytes,written);
+	dword rgb[16];
+	int changes = vobsub_palette(sp,rgb);
+	if (changes != job->palette_changes)
+	{
+		// rewrite the palette in place, for it is in the header
+		char line[IDX_PALETTE_LINE];
+		idx_palette(line,rgb);
+		if (pwrite(fileno(job->idx),line,strlen(line),job->palette_at) < 0)
+			fprintf(stderr,"Unable to write the palette into the .idx file\n");
+		job->palette_changes = changes;
+	}
+	if (job->follow)
+		output_flush(job->out);	// out now rather than a chunk at a time
+	STATS_STOP(t_write,t);
+}
 
-	struct pes_packet {
-		byte sync_bytes[3];
-		byte stream_id;
-		word packet_length;
+static void index_pes(void *user, qword first, qword last, qword pts)
+{
+	struct job *job = (struct job *) user;
 
-		word flags;
-		byte pes_header_length;
+	if (job->indexing)
+		sidecar_add(job->indexing, first, last, pts);
+}
 
-		qword pts, dts;
-		qword escr_base;
-		word escr_ext;
-		qword es_rate;
+static void print_program(void *user, word program, word pmt_pid)
+{
+	printf("Carrying program 0x%04X with PMT PID 0x%04X\n",program,pmt_pid);
+}
 
-		byte trick;
-		byte copy_info;
-		word prev_crc;
+// With --all-tracks, whether the tracks are to be told apart by program,
+// i.e. more than one program (of those chosen) is followed
+static void count_program(void *user, word program, word pmt_pid)
+{
+	struct job *job = (struct job *) user;
 
-		byte ext_flags;
-		byte pes_private[16];
-		byte pack_length;
-		byte *pack_header;
+	if (job->programs == 0 || (job->programs == 1 && program != job->program))
+	{ job->program = program; job->programs++; }
+	if (job->psi)
+		print_program(user,program,pmt_pid);
+}
 
-		byte seq_counter;
-		byte orig_stuff_length;
-		word p_std;
-	} pes = { .pts = 0 };
-	memcpy(&pes,p,6); p+=6;
+static void print_stream(void *user, const struct vdrsub_stream *s)
+{
+	if (s->stream_type == 2)
+		printf("Video track with PID 0x%04X\n",s->pid);
+	else if (s->stream_type == 4)
+		printf("Audio track with PID 0x%04X\n",s->pid);
+	else if (s->tag == 0x56)
+		printf("Teletext data in language \"%.3s\" - PID 0x%04X, type %02X, page numbers (%d,%d)\n",
+		 s->language, s->pid, s->type, s->page[0], s->page[1]);
+	else if (s->tag == 0x59)
+		printf("Subtitles in language \"%.3s\" - PID 0x%04X, type %02X, page numbers (%d,%d)\n",
+		 s->language, s->pid, s->type, s->page[0], s->page[1]);
+}
 
-	NETWORD(pes.packet_length);
+// Convert the subtitle PES packets listed in a sidecar index, reading just
+// them (and in a TS, the other packets in between) instead of the whole file
+static void replay_sidecar(vdrsub *v, const char *name, struct sidecar *sc)
+{
+	int fd = open(name, O_RDONLY);
+	byte *buf = NULL;
+	size_t size = 0;
 
-	verb(32,"PES: %d bytes, type id 0x%02X: ",pes.packet_length+6,pes.stream_id);
-	switch (pes.stream_id)
+	for (size_t i = 0; fd >= 0 && i < sc->n; i++)
 	{
-	case 0xBC: verb(32,"Program stream map\n"); return;
-	case 0xBD: verb(32,"Subtitles, i.e. Private stream 1\n"); break;
-	case 0xBE: verb(32,"Padding stream\n"); return;
-	case 0xBF: verb(32,"Private stream 2\n"); return;
-	case 0xF0: verb(32,"ECM stream\n"); return;
-	case 0xF1: verb(32,"EMM stream\n"); return;
-	case 0xF2: verb(32,"ITU-T Rec. H.222.0 | ISO/IEC 13818-1-A etc.\n"); return;
-	case 0xF3: verb(32,"ISO/IEC_13522 stream\n"); break;
-	case 0xF4: verb(32,"ITU-T Rec. H.222.1 type A\n"); break;
-	case 0xF5: verb(32,"ITU-T Rec. H.222.1 type B\n"); break;
-	case 0xF6: verb(32,"ITU-T Rec. H.222.1 type C\n"); break;
-	case 0xF7: verb(32,"ITU-T Rec. H.222.1 type D\n"); break;
-	case 0xF8: verb(32,"ITU-T Rec. H.222.1 type E\n"); return;
-	case 0xF9: verb(32,"ancillary stream\n"); break;
-	case 0xFA: verb(32,"ISO/IEC14496-1 SL-packetized stream\n"); break;
-	case 0xFB: verb(32,"ISO/IEC14496-1 FlexMux stream\n"); break;
-	case 0xFC: case 0xFD: case 0xFE: verb(32,"reserved data stream\n"); break;
-	case 0xFF: verb(32,"Program stream directory\n"); return;
-	default: if ((pes.stream_id & 0xE0) == 0xC0)
-			verb(32,"Audio, i.e. ISO/IEC 13818-3, etc.\n");
-		else if ((pes.stream_id & 0xF0) == 0xE0)
-            verb(32,"Video, i.e. ITU-T Rec. H.262 | ISO/IEC 13818-2, etc.\n");
-		else verb(32,"stream_id=0x%X\n",pes.stream_id); break;
+		STATS_START(t_read);
+		// up to the end of the last TS packet, i.e. 188 bytes past its sync
+		// byte, whatever the stride (the file may end right there)
+		size_t len = (sc->pes[i].last - sc->pes[i].first) + 188;
+		if (sc->vdr)
+		{
+			byte h[6];
+			if (pread(fd, h, 6, sc->pes[i].first) != 6)
+				break;
+			len = 6 + (((word) h[4]) << 8 | h[5]);
+		}
+		if (len > size && (buf = realloc(buf, size = len)) == NULL)
+			break;
+		if (pread(fd, buf, len, sc->pes[i].first) != len)
+		{ fprintf(stderr,"Sidecar index does not match %s\n",name); break; }
+		STATS_STOP(t_read,t_read);
+		STATS_ADD(bytes_in,len);
+
+		STATS_START(t_demux);
+		vdrsub_skip(v, sc->pes[i].first);	// the packets in between were skipped
+		if (sc->vdr)
+			vdrsub_push_pes(v, buf, len, sc->pes[i].first);
+		else if (len >= 188)
+			vdrsub_push_ts(v, buf, (len - 188) / sc->stride + 1, sc->stride, sc->pes[i].first);
+		STATS_STOP(t_demux,t_demux);
+		stats_tick();
 	}
+	free(buf);
+	if (fd >= 0)
+		close(fd);
+}
 
-	memcpy(&pes.flags,p,3); p+=3;
-	NETWORD(pes.flags);
-	if (pes.flags & 0x0080)
-	{
-		pes.pts = (*(p++) & 0x0E) << 29; pes.pts |= *(p++) << 22;
-		pes.pts |= (*(p++) & 0xFE) << 14;
-		pes.pts |= *(p++) << 7; pes.pts |= *(p++) >> 1;
-		if ((pes.stream_id & 0xF0) == 0xE0 && first_video_pts == 0)
-		{ first_video_pts = pes.pts; verb(16,"First video pts established\n"); }
-	}
-	if (pes.flags & 0x0040)
-	{
-		pes.dts = (*(p++) & 0x0E) << 29; pes.dts |= *(p++) << 22;
-		pes.dts |= (*(p++) & 0xFE) << 14;
-		pes.dts |= *(p++) << 7; pes.dts |= *(p++) >> 1;
-	}
-	if (pes.flags & 0x0020)
-	{
-		byte b,m=0;
-		loadbits(2,&p,&b,&m); pes.escr_base = loadbits(3,&p,&b,&m) << 30;
-		loadbits(1,&p,&b,&m); pes.escr_base |= loadbits(8,&p,&b,&m) << 22;
-		pes.escr_base |= loadbits(7,&p,&b,&m) << 15;
-		loadbits(1,&p,&b,&m); pes.escr_base |= loadbits(8,&p,&b,&m) << 7;
-        pes.escr_base |= loadbits(7,&p,&b,&m);
-		loadbits(1,&p,&b,&m); pes.escr_ext = loadbits(8,&p,&b,&m) << 1;
-		pes.escr_ext |= loadbits(1,&p,&b,&m);
-		loadbits(0,NULL,&b,&m);
-	}
-	if (pes.flags & 0x0010)
+// Scan TS file 'name' from 'from' on in 'jobs' parts at once, each on a thread
+// of its own, and process the subtitle packets found in file order, i.e. just
+// as the sequential scan would; tr has the packet size and takes the counts
+// Returns -1 if the threads could not be set to work, with nothing processed
+static int scan_parallel(vdrsub *v, const char *name, qword from, struct ts_reader *tr, int jobs)
+{
+	struct scan_range *r;
+	struct vdrsub_psi psi;
+	struct stat st;
+
+	vdrsub_get_psi(v,&psi);
+
+	if (stat(name,&st) || (r = scan_start(name,from,st.st_size,tr->stride,psi.sub_pid,jobs,stats_enabled)) == NULL)
+		return -1;
+	for (int k = 0; k < jobs; k++)
 	{
-		pes.es_rate = (*(p++) & 0x7F) << 15;
-		pes.es_rate |= *(p++) << 7; pes.es_rate |= *(p++) >> 1;
+		STATS_START(t_read);
+		scan_wait(r,k);
+		STATS_STOP(t_read,t_read);
+		if (r[k].failed)
+		{ fprintf(stderr,"Unable to scan %s from %llu on\n",name,r[k].from); break; }
+
+		STATS_START(t_demux);
+		for (size_t i = 0; i < r[k].n; i++)
+			vdrsub_push_ts(v,r[k].packets + i*188,1,188,r[k].offsets[i]);
+		STATS_STOP(t_demux,t_demux);
+		// each part locks on anew at its start, which does not count
+		tr->resyncs += r[k].resyncs > 1 ? r[k].resyncs - 1 : 0;
+		tr->skipped += r[k].skipped;
+		STATS_ADD(ts_packets,r[k].ts_packets);
+		if (r[k].pid_packets)
+			for (int pid = 0; pid < 0x2000; pid++)
+				STATS_ADD(pid_packets[pid],r[k].pid_packets[pid]);
+		STATS_SET(bytes_in,r[k].to);
+		STATS_SET(ts_resyncs,tr->resyncs); STATS_SET(ts_skipped,tr->skipped);
+		stats_tick();
 	}
-	if (pes.flags & 0x0008)
-		pes.trick = *(p++);
-	if (pes.flags & 0x0004)
-		pes.copy_info = *(p++);
-	if (pes.flags & 0x0002)
+	scan_free(r,jobs);
+	return 0;
+}
+
+// How each recording is to be converted, as told on the command line
+struct options {
+	enum input_backend backend;
+	int vdr;			// .VDR input (else a TS, unless the name ends in .vdr)
+	int prealloc, use_index, jobs;
+	int all_tracks;		// each subtitle track into files of its own
+	const word *programs;	// those to look into, 0-terminated, or NULL for all
+	int psi;			// print what the PSI tells
+	qword first_video_pts;	// subtracted from each subpicture PTS, 0 =from the video
+};
+
+// Convert recording 'name' (standard input if NULL) as told by 'o', following
+// it as job->follow tells; returns 0, or 1 with job->error set to why not
+static int convert(const struct options *o, const char *name, struct job *job)
+{
+	input *in;
+	int input_type = o->vdr ? VDR : TS, replayed = 0, jobs = o->jobs, scanned = 0;
+	struct sidecar index = { 0 };
+	struct stat st;
+	char *base = NULL;	// of the output files
+	vdrsub *v;
+
+	if ((in = input_open(name,o->backend,job->follow)) == NULL)
 	{
-		pes.prev_crc = *(p++) << 8; pes.prev_crc |= *(p++);
+		fprintf(stderr,"Unable to open: %s\n",name ? name : "stdin");
+		job->error = "unable to open";
+		return 1;
 	}
-	if (pes.flags & 0x0001)
+	// parts of the file can only be scanned at once if it is all there, and
+	// just for the one subtitle PID
+	if (name == NULL || job->follow || input_backend(in) != IO_MMAP || o->all_tracks)
+		jobs = 1;
+	if (name == NULL)
+		base = strdup("out");
+	else
 	{
-		pes.ext_flags = *(p++);
-		if (pes.ext_flags & 0x80)
-		{
-			memcpy(pes.pes_private,p,16); p += 16;
-		}
-		if (pes.ext_flags & 0x40)
-		{
-			pes.pack_length = *(p++);
-			memcpy(pes.pack_header = malloc(pes.pack_length),
-			 p,pes.pack_length);
-			p += pes.pack_length;
-		}
-		if (pes.ext_flags & 0x20)
-		{
-			pes.seq_counter = *(p++) & 0x7F;
-			pes.orig_stuff_length = *(p++) & 0x3F;
-		}
-		if (pes.ext_flags & 0x10)
-		{
-			pes.p_std = *(p++) << 8; pes.p_std |= *(p++);
-		}
-		if (pes.ext_flags & 0x01)
-			p += *(p++) & 0x7F;
+		char *ext;
+		base = strdup(name);
+		ext = (ext=strrchr(base,'.')) != NULL ? ext : base+strlen(base);
+		if (!strcmp(ext,".vdr")) 
+			input_type = VDR;
+		*ext = 0;
 	}
-	
-	// skip possible stuffing bytes
-	p = data + 9 + pes.pes_header_length;
-	
-	// Only process private stream 1 any further
-	if (pes.stream_id != 0xBD) return;
-	
-	verb(16,"PES: subtitle packet, packet =%d, header =%d, payload: %02X %02X %02X %02X %02X %02X %02X\n",
-			pes.packet_length, pes.pes_header_length, p[0],p[1],p[2],p[3],p[4],p[5],p[6]);
-	if (input_type == VDR)
+	// with all tracks, the files of each are started once it is found
+	if ((operation & CONVERT) && !(o->all_tracks && input_type == TS)
+	 && open_output(job,base,"fi",o->prealloc))
+		goto failed;
+
+	struct vdrsub_config cfg = { input_type == VDR, 188, NULL, job->follow != 0, o->first_video_pts,
+	 o->all_tracks && input_type == TS && (operation & CONVERT), o->programs };
+	struct vdrsub_callbacks cb = { NULL, NULL, index_pes };
+	if (o->psi)
+	{ cb.program = print_program; cb.stream = print_stream; }
+	if (operation & CONVERT)
+		cb.vobsub = write_vobsub;
+	if (cfg.all_tracks)
 	{
-		if (p[3] == 0)
-		{
-			if (pes_len > 0)
-				// before beginning a new packet sequence, process any previously accumulated payload
-				process_dvbsub_data(pes_data, pes_len, pes_pts);
-			pes_len = 0;
-			pes_pts = pes.pts;
-		}
-		p += 4;	// VDR quirks: skip a 0x20010000 (new PES sequence) or 0x20010001 (continued sequence) header
+		cb.track = open_track;
+		cb.program = count_program;
+		job->base = base;
+		job->prealloc = o->prealloc;
+		job->psi = o->psi;
 	}
-
-	// PES.PACKET_LENGTH=     	extra fields + 2 +  dvbsub payload
-	pes.packet_length -= p - (data+6);
-	// now				=						 	dvbsub payload
-	
-	// cache subtitle payload from .VDR content, further processing is handled above
-	if (input_type == VDR)
+	if ((v = vdrsub_open(&cfg,&cb,job)) == NULL)
 	{
-		verb(16,"Appending %d bytes to %d\n",pes.packet_length,pes_len);
-		pes_data = realloc(pes_data, pes_len + pes.packet_length);
-		memcpy(pes_data+pes_len, p, pes.packet_length);
-		pes_len += pes.packet_length;
+		fprintf(stderr,"Out of memory\n");
+		job->error = "out of memory";
+		if (job->out)
+			output_close(job->out);
+		job->out = NULL;
+		goto failed;
 	}
-	// process subtitle payload immediately for TS content
-	else
-		process_dvbsub_data(p, pes.packet_length, pes.pts);
-}
-
-void process_subtitle_pes_chunk(byte *p, size_t len, byte continuity_counter)
-{
-	static byte *sub_pes = NULL;
-	static size_t sub_len = 0, sub_complete_len = -1;
 
-	static byte sub_counter = 16;
-	if (sub_counter == continuity_counter)
-	{	verb(32,"PES is a duplicate subtitle packet\n"); return; }
-	sub_counter=continuity_counter;
-
-	if (sub_complete_len == -1)
+	// with an index up to date, the PSI and the rest are known already
+	// (only the one subtitle PID is indexed, of whichever program it was)
+	if (o->use_index && name && (operation & CONVERT) && !cfg.all_tracks && !o->programs)
 	{
-		if (memcmp(p,(byte []) {0,0,1},3))
+		if (sidecar_load(name,&index) == 0 && index.vdr == (input_type == VDR))
 		{
-			verb(32,"PES: sync bytes not found; skipping\n");
-			return;
+			vdrsub_set_psi(v,&(struct vdrsub_psi) { index.pmt_pid, index.video_pid, index.sub_pid,
+			 index.composition_id, index.ancillary_id,
+			 o->first_video_pts ? o->first_video_pts : index.first_video_pts });
+			replay_sidecar(v,name,&index);
+			replayed = 1;
 		}
-		sub_complete_len = 6 + (((word) p[4])<<8 | p[5]); // header + payload
-	}
-	
-	verb(32,"PES packet has complete length 0x%X (%d), we have %d\n",sub_complete_len,sub_complete_len,sub_len);
-	sub_pes = realloc(sub_pes, sub_len + len); memcpy(sub_pes+sub_len, p, len); sub_len += len;
-		
-	if (sub_len >= sub_complete_len)
-	{
-		process_pes_packet(sub_pes);
-		free(sub_pes); sub_pes = NULL; 
-		sub_len = 0; sub_complete_len = -1;
+		// index this pass, unless the start of the video is not to be found
+		else if (o->first_video_pts == 0 && stat(name,&st) == 0)
+			memset(job->indexing = &index, 0, sizeof index);
 	}
-}
-
-void process_psi_section(byte *data)
-{
-	byte *p = data;
 
-	switch (*(p++))
+	if (!replayed) switch (input_type)
 	{
-	case 0: {
-		verb(128,"Program Association Section :\n");
-		struct {
-			word syntax_length;
-			word ts_stream_id;
-			byte ver_current_next;
-			byte section_number;
-			byte last_section_number;
-		} pat;
-		memcpy(&pat,p,sizeof pat); p += sizeof pat;
-		NETWORD(pat.syntax_length); NETWORD(pat.ts_stream_id);
-
-		verb(128,"syntax_length=%04X, ts_stream_id=%04X, ver_current_next=%02X, section_number=%02X\n",
-		 pat.syntax_length,pat.ts_stream_id,pat.ver_current_next,pat.section_number);
-		verb(128,"last_section_number=%02X, program/PMT assignments :\n",pat.last_section_number);
-		while (p <= data+3+(pat.syntax_length&0x0FFF)-8)
+	case TS: {
+		// process packets in place, a block of them at a time
+		struct ts_reader tr = { in };
+		struct vdrsub_psi psi;
+		byte *p;
+		size_t n;
+		while (1)
 		{
-			word program = ((word) *(p++)) << 8 | *(++p);
-			word pid = (((word) *(p++)) << 8 | *(++p)) & 0x1FFF;
-			if (!program) { verb(128," -Network PID =%04X\n",pid); continue; }
-			if (pid < 0x10 || pid == 0x1FFF) continue;
-			verb(128," -Program %04X has PMT PID %04X\n",program,pid);
-			if (operation & PSI) 
-				printf("Carrying program 0x%04X with PMT PID 0x%04X\n",program,pid);
-			pmt_pid = pid;
+			STATS_START(t_read);
+			if ((n = ts_read_block(&tr,&p)) == 0)
+				break;
+			STATS_STOP(t_read,t_read);
+			STATS_START(t_demux);
+			STATS_ADD(ts_packets,n);
+			if (stats_enabled)
+				for (size_t k = 0; k < n; k++)
+					stats.pid_packets[(p[k*tr.stride+1] & 0x1F) << 8 | p[k*tr.stride+2]]++;
+			vdrsub_push_ts(v,p,n,tr.stride,input_position(in));
+			STATS_STOP(t_demux,t_demux);
+			STATS_SET(bytes_in,input_position(in));
+			STATS_SET(ts_resyncs,tr.resyncs); STATS_SET(ts_skipped,tr.skipped);
+			stats_tick();
+			// once the head of the file has given away all there is to know,
+			// leave the rest to threads scanning a part of it each
+			if (jobs > 1)
+				vdrsub_get_psi(v,&psi);
+			if (jobs > 1 && psi.sub_pid != 0xFFFF && psi.first_video_pts != 0)
+			{
+				if (scan_parallel(v,name,input_position(in) + tr.pending,&tr,jobs) == 0)
+				{ scanned = 1; break; }
+				jobs = 1;
+			}
 		}
-		p += 4; // skip CRC_32
+		if (tr.resyncs > 1 || tr.skipped)
+			verb(1,"TS: %d-byte packets, lock acquired %llu times, %llu bytes skipped\n",
+			 tr.stride ? tr.stride : 188, tr.resyncs, tr.skipped);
+		if (job->indexing)
+			job->indexing->stride = tr.stride ? tr.stride : 188;
 		} break;
-	case 2: {
-		verb(128,"Program Map Section :\n");
-		struct {
-			word section_length;
-			word program;
-			byte ver_current_next;
-			byte section_number;
-			byte last_section_number;
-			word pcr_pid;
-			word program_info_length;
-		} pmt;
-		memcpy(&pmt, p, sizeof pmt); p += sizeof pmt;
-		NETWORD(pmt.section_length);
-		pmt.section_length &= 0x0FFF;
-		NETWORD(pmt.program);
-		NETWORD(pmt.pcr_pid); NETWORD(pmt.program_info_length);
-
-		verb(128,"section_length=%04X, program=%04X, ver_current_next=%02X, section_number=%02X\n",
-		 pmt.section_length,pmt.program,pmt.ver_current_next,pmt.section_number);
-		verb(128,"last_section_number=%02X, pcr_pid=%04X, program_info_length=%04X\n",
-			pmt.last_section_number,pmt.pcr_pid,pmt.program_info_length&0x0FFF);
-		p += pmt.program_info_length & 0x0FFF;
-		while (p <= data+3+pmt.section_length-9)
+	case VDR: {
+		byte *pes_packet;
+		size_t len;
+		while (1)
 		{
-			byte stream_type = *(p++);
-			word elementary_pid = (((word) *(p++)) << 8 | *(++p)) & 0x1FFF;
-			word len = (((word) *(p++)) << 8 | *(++p)) & 0x0FFF;
-			verb(128," -type=%02X, pid=%04X, descriptor len=%d",
-				stream_type, elementary_pid, len);
-			if (stream_type == 2)
-			{ 
-				verb(128,", video track");
-				if (operation & PSI)
-					printf("Video track with PID 0x%04X\n",elementary_pid);
-				video_pid = elementary_pid;
-			}
-			if (stream_type == 4)
-			{
-				verb(128,", audio track");
-				if (operation & PSI)
-					printf("Audio track with PID 0x%04X\n",elementary_pid);
-			}
-			// Only process non-empty descriptors of private data streams
-			if (stream_type != 6 || len == 0) { verb(128,"\n"); p+=len; continue; }
-			
-			byte tag = *(p++); len = *(p++);	// descriptor tag and length
-			switch (tag)
-			{
-			case 0x56:
-				while (len >= 5)
-				{
-					struct {
-						byte language[3];
-						byte magazine_number : 3; byte teletext_type : 5;
-						byte page_number;
-					} ttxt_desc;
-					memcpy(&ttxt_desc,p,sizeof ttxt_desc); p+=sizeof ttxt_desc; len-=sizeof ttxt_desc;
-					if (operation & PSI) 
-						printf("Teletext data in language \"%.3s\" - PID 0x%04X, type %02X, page numbers (%d,%d)\n",
-						 ttxt_desc.language, elementary_pid, ttxt_desc.teletext_type,
-						 ttxt_desc.magazine_number, ttxt_desc.page_number);
-				}
+			STATS_START(t_read);
+			if (input_peek(in,6,&pes_packet) < 6)
 				break;
-			case 0x59:
-				while (len >= 8)
-				{
-					struct {
-						byte language[3];
-						byte subtitling_type;
-						word composition_id;
-						word ancillary_id;
-					} sub_desc;
-					memcpy(&sub_desc,p,sizeof sub_desc); p+=sizeof sub_desc; len-=sizeof sub_desc;
-					NETWORD(sub_desc.composition_id); NETWORD(sub_desc.ancillary_id);
-					if (operation & PSI) 
-						printf("Subtitles in language \"%.3s\" - PID 0x%04X, type %02X, page numbers (%d,%d)\n",
-						 sub_desc.language, elementary_pid, sub_desc.subtitling_type,
-						 sub_desc.composition_id,sub_desc.ancillary_id);
-					if (!language || !memcmp(language,sub_desc.language,3))
-					{
-						sub_pid = elementary_pid;
-						composition_id = sub_desc.composition_id;
-						ancillary_id = sub_desc.ancillary_id;
-					}
-				}
+			size_t pes_length = 6 + ((((word) pes_packet[4]) << 8) + pes_packet[5]);
+			if ((len = input_peek(in,pes_length,&pes_packet)) < pes_length)
 				break;
-			default:
-				verb(128, "Unhandled descriptor type: %02X\n", tag);
-				p += len;
-			}
-		}		
-		p += 4; // skip crc-32
+			STATS_STOP(t_read,t_read);
+			STATS_START(t_demux);
+			vdrsub_push_pes(v,pes_packet,pes_length,input_position(in));
+			input_skip(in,pes_length);
+			STATS_STOP(t_demux,t_demux);
+			STATS_SET(bytes_in,input_position(in));
+			stats_tick();
+		}
 		} break;
 	}
-}
-
-void process_ts_packet(byte data[])
-{
-	byte *p = data;
-
-	struct {
-		byte sync_byte;
-		word flags_pid;
-		byte controls;
-	} tp = { p[0], p[1] << 8 | p[2], p[3] }; p+=4;
-
-	static int packet_index = 0;
-	if (tp.sync_byte != 0x47)
+	STATS_START(t_demux);
+	vdrsub_finish(v);
+	STATS_STOP(t_demux,t_demux);
+
+	if (!replayed && !scanned)
+		STATS_SET(bytes_in,input_position(in));
+	job->bytes_in = replayed ? 0 : input_position(in);
+	if (job->indexing)
 	{
-		verb(64,"TS packet # %d has sync byte 0x%02X != 0x47\n",packet_index++,tp.sync_byte);
-		return;
+		// only if the recording stayed as it was, or was followed to its end
+		struct stat now;
+		struct vdrsub_psi psi;
+		vdrsub_get_psi(v,&psi);
+		index.vdr = input_type == VDR;
+		index.pmt_pid = psi.pmt_pid; index.video_pid = psi.video_pid; index.sub_pid = psi.sub_pid;
+		index.composition_id = psi.composition_id; index.ancillary_id = psi.ancillary_id;
+		index.first_video_pts = psi.first_video_pts;
+		if (stat(name,&now) == 0 && (job->follow || (now.st_size == st.st_size
+		 && now.st_mtim.tv_sec == st.st_mtim.tv_sec && now.st_mtim.tv_nsec == st.st_mtim.tv_nsec)))
+			if (sidecar_save(name,&index))
+				fprintf(stderr,"Unable to write the sidecar index of %s\n",name);
+		job->indexing = NULL;
 	}
-	verb(64,"TS packet # %d : error=%d, payload_start=%d, priority=%d\n",
-	 packet_index++, (tp.flags_pid & 0x8000) != 0, (tp.flags_pid & 0x4000) != 0, (tp.flags_pid & 0x2000) != 0);
-	verb(64,"  PID=0x%X, scrambling=%d, adapt=%d, counter=%d\n",
-	 tp.flags_pid & 0x1FFF, tp.controls >> 6, (tp.controls >> 4)&3, tp.controls &0xF);
-	if ((tp.flags_pid & 0x1FFF) == 0x1FFF) 
-	{
-		verb(32,"TS: null packet, skipping\n"); return;
-    }
-	if (tp.controls & 0x30 == 0) { verb(64,"TS packet has no payload or adaptation field\n"); return; }
-
-	int af_len = 0;
-	if ((tp.controls & 0x20) && (af_len = *(p++) + 1) > 1)
+	sidecar_free(&index);
+	if (operation & CONVERT)
 	{
-		struct {
-			byte flags;
-
-			qword pcr_base;
-			word pcr_ext;
-
-			qword opcr_base;
-			word opcr_ext;
-
-			byte splice_countdown;
-
-			byte private_length;
-			byte *private_data;
-
-			byte ext_length;
-			byte ext_flags;
-
-			word ltw;
-
-			dword piecewise;
-
-			byte splice_type;
-			qword dts_next_au;
-		} af = { *(p++) };
-
-		verb(64, "TS adaptation field (len=%d): \n", af_len);
-		if (af.flags&0x10)
-		{
-			af.pcr_base = *(p++) << 25 | *(p++) << 17 | *(p++) << 9 | *(p++) << 1;
-			af.pcr_ext = *(p++); af.pcr_base |= (af.pcr_ext & 0x80 != 0);
-			af.pcr_ext = (af.pcr_ext<<8 | *(p++)) & 0x1FF;
-			float s=af.pcr_base/90000.0;
-           	verb(64,"TS: PCR for PID 0x%04X: %02d:%02d:%02d.%02d\n",
-			 tp.flags_pid & 0x1FFF,(int) s/3600,(int) (s/60) % 60,
-			 (int) s % 60,(int) ((s-((int) s))*100));
-		}
-		if (af.flags & 0x08)
-		{
-			af.opcr_base = *(p++) << 25 | *(p++) << 17 | *(p++) << 9 | *(p++) << 1;
-			af.opcr_ext = *(p++); af.opcr_base |= (af.opcr_ext & 0x80 != 0);
-			af.opcr_ext = (af.opcr_ext<<8 | *(p++)) & 0x1FF;
-             float s=af.opcr_base/90000.0;
-             verb(64,"TS: Original PCR for PID 0x%04X: %02d:%02d:%02d.%02d\n",
-			 tp.flags_pid & 0x1FFF, (int) s/3600,(int) (s/60) % 60,
-			 (int) s % 60,(int) ((s-((int) s))*100));
-		}
-		if (af.flags & 0x04)
-		{
-			af.splice_countdown = *(p++);
-			verb(64,"splice_countdown=%d, ", af.splice_countdown);
-		}
-		if (af.flags & 0x02)
-		{
-			af.private_length = *(p++);
-			af.private_data = malloc(af.private_length);
-			memcpy(af.private_data,p,af.private_length); p+=af.private_length;
-			verb(64,"private data (%d bytes), ",af.private_length);
-		}
-		if (af.flags & 0x01)
+		STATS_START(t);
+		if (job->out)
+			output_close(job->out);
+		for (int k = 0; k < job->tracks; k++)
 		{
-			af.ext_length = *(p++);
-			af.ext_flags = *(p++);
-			if (af.ext_flags & 0x80)
-			{
-				af.ltw = *(p++) << 8 | *(p++);
-				verb(64,"ltw=%d, ", af.ltw);
-			}
-			if (af.ext_flags & 0x40)
-			{
-				af.piecewise = (*(p++) << 16 | *(p++) << 8 | *(p++)) & 0x3FFFFF;
-				verb(64,"piecewise=%d, ", af.piecewise);
-			}
-			if (af.ext_flags & 0x20)
-			{
-				af.dts_next_au = *(p++); af.splice_type = af.dts_next_au >> 4;
-				af.dts_next_au = (af.dts_next_au & 0x0E) << 29 | *(p++) << 22;
-				af.dts_next_au |= (*(p++) & 0xFE) << 14 | *(p++) << 7 | *(p++) >> 1;
-				verb(64,"splice_type=%d, dts=0x%X", af.splice_type, af.dts_next_au);
-			}
+			output_close(job->track[k]->out);
+			job->subpictures += job->track[k]->subpictures;
+			free(job->track[k]);
 		}
-		verb(64,"\n");
+		STATS_STOP(t_close,t);
+		if (cfg.all_tracks && job->tracks == 0)
+			fprintf(stderr,"No subtitle tracks found in %s\n",name ? name : "stdin");
 	}
+	vdrsub_close(v);
+	input_close(in);
+	free(base);
+	return 0;
 
-	if (! (tp.controls & 0x10)) { verb(64,"TS packet has no payload\n"); return; }
+failed:
+	input_close(in);
+	free(base);
+	return 1;
+}
+
+// Batch conversion: the recordings named, those under the directories named
+// included, converted side by side on a work-stealing pool (see pool.h)
+struct batch {
+	const struct options *o;
+	char **name;
+	qword *size;		// bytes, i.e. the cost of converting it
+	struct job *job;
+	double *secs;		// time taken
+	size_t n, room;
+};
+
+// Rough memory and file descriptors a conversion takes: the input mapped
+// but not yet dropped (up to 16 MiB, see input.c); the input, the sidecar
+// index and a replay; and for each output, i.e. each track with
+// --all-tracks, the output ring and the decoder, and the .sub and .idx
+#define BATCH_FILE_MEM (16 << 20)
+#define BATCH_FILE_FDS 3
+#define BATCH_OUTPUT_MEM ((qword) OUTPUT_SECTORS * 2048 + (1 << 20))
+#define BATCH_OUTPUT_FDS 2
+
+// Cap the number of conversions at once, of up to 'outputs' outputs each,
+// to what the memory cap 'mem' (in bytes) and the open file limit leave
+// room for
+static int cap_workers(int workers, qword mem, int outputs)
+{
+	struct rlimit nofile;
+	qword file_mem = BATCH_FILE_MEM + outputs * BATCH_OUTPUT_MEM;
+	rlim_t file_fds = BATCH_FILE_FDS + outputs * BATCH_OUTPUT_FDS;
+
+	if (mem / file_mem < workers)
+		workers = mem / file_mem;
+	if (getrlimit(RLIMIT_NOFILE,&nofile) == 0 && nofile.rlim_cur != RLIM_INFINITY
+	 && (nofile.rlim_cur - 16) / file_fds < workers)
+		workers = nofile.rlim_cur > 16 + file_fds ? (nofile.rlim_cur - 16) / file_fds : 1;
+	return workers < 1 ? 1 : workers;
+}
 
-	p = data + 4 + af_len;
-	verb(64,"TS: %d bytes of data for PID 0x%X: ",
-	 188 - (p-data),tp.flags_pid & 0x1FFF);
-	for (int j=0; j<8; j++) verb(64,"%02X ",p[j]); verb(64,"\n");
-	verb(64,"pmt_pid=%04X, sub_pid=%04X, video_pid=%04X\n",pmt_pid,sub_pid,video_pid);
+// One line of the summary, on the conversion of 'name' of 'size' bytes
+static void summary_line(FILE *f, const char *name, const struct job *job, double secs, qword size)
+{
+	fprintf(f,"%-6s %9.3f s %13llu bytes %7llu subpictures  %s%s%s\n",
+	 job->error ? "FAILED" : "ok", secs, size, job->subpictures,
+	 name, job->error ? ": " : "", job->error ? job->error : "");
+}
 
-	// assemble and parse complete PES packets for subtitle data
-	if ((tp.flags_pid & 0x1FFF) == sub_pid)
-		process_subtitle_pes_chunk(p,188-(p-data),tp.controls & 0xF);
+static struct batch *collecting;	// for nftw(), which passes no pointer
 
-	// parse first chunk of each video ES packet, until we have first_video_pts
-	else if ((tp.flags_pid & 0x1FFF) == video_pid)
+static void batch_add(struct batch *b, const char *name, qword size)
+{
+	if (b->n == b->room)
 	{
-		if (first_video_pts != -1) return;	// we already established 1st video pts
-		if (tp.flags_pid & 0x4000 == 0) return; // no payload_unit_start indication
-		process_pes_packet(p);
+		b->room = b->room ? 2 * b->room : 64;
+		b->name = (char **) realloc(b->name, b->room * sizeof *b->name);
+		b->size = (qword *) realloc(b->size, b->room * sizeof *b->size);
 	}
+	b->name[b->n] = strdup(name);
+	b->size[b->n++] = size;
+}
 
-	// assemble and parse complete PAT packets until we have established PMT-PID
-	// then a.&p. complete PMT packets until we have established a subtitle PID
-	else if (sub_pid == 0xFFFF)
-	{
-		// ensure that packets of only one pid (i.e. pat or pmt) are processed here
-		if ((tp.flags_pid & 0x1FFF) != pmt_pid && (pmt_pid != 0xFFFF
-		 || (tp.flags_pid & 0x1FFF) != 0 /* ==pat_pid */ ))
-			return;
-
-		static byte *psi = NULL;
-		static size_t psi_len = 0, psi_complete_len = -1;
-
-/*		static byte psi_counter = 16;
-		if (psi_counter == (tp.controls & 0xF))
-		{	verb(32,"TS: duplicate PSI packet\n"); return; }
-		psi_counter=tp.controls & 0xF;
-*/
-		// if we have no current section nor is there one starting now, quit
-		if (psi_complete_len == -1 && !(tp.flags_pid & 0x4000)) return;
-
-		// if we have no current section but another one is starting, seek to that
-		if (psi_complete_len == -1)
-		{
-			verb(64,"TS: no current section (pointer %02X)\n",*p);
-			p += *p + 1;
-		}
+// Pick the recordings out of a directory tree by their names
+static int collect_file(const char *name, const struct stat *st, int type, struct FTW *ftw)
+{
+	const char *ext = strrchr(name,'.');
+	if (type == FTW_F && S_ISREG(st->st_mode) && ext != NULL
+	 && (!strcmp(ext,".ts") || !strcmp(ext,".vdr") || !strcmp(ext,".m2ts")))
+		batch_add(collecting,name,st->st_size);
+	return 0;
+}
 
-		// if there's both a current section and a new one, process the old one now
-		else if (tp.flags_pid & 0x4000) 
-		{
-			verb(64,"TS: parsing current, then new sections (pointer %02X)\n",*p);
-			psi = realloc(psi, psi_len + *p);
-			memcpy(psi+psi_len, p+1, *p); psi_len += *p; p += *p +1;
-			if (psi_complete_len > psi_len) verb(1,"PSI underflow by %d\n",
-				psi_complete_len - psi_len);
-			process_psi_section(psi);
-			free(psi); psi = NULL; psi_len = 0; psi_complete_len = -1;
-		}
+static void convert_one(void *arg, size_t i)
+{
+	struct batch *b = (struct batch *) arg;
+	qword t = stats_clock();
 
-		// we have a current section to parse, no new one is set to begin
+	// nothing but the options is shared with the conversions of the others
+	b->job[i] = (struct job) { NULL };
+	convert(b->o,b->name[i],&b->job[i]);
+	b->secs[i] = (stats_clock() - t) / 1e9;
+}
+
+// Convert the recordings in names[] on up to 'workers' threads, as many as
+// the memory cap 'mem' (in bytes) and the open file limit leave room for,
+// and write a summary of each into 'summary'; returns the number failed
+static int batch_convert(const struct options *o, char **names, int n_names,
+ int workers, qword mem, FILE *summary)
+{
+	struct batch b = { o };
+	struct stat st;
+	int failed = 0;
+
+	collecting = &b;
+	for (int i = 0; i < n_names; i++)
+		if (stat(names[i],&st))
+			batch_add(&b,names[i],0);	// to fail and be listed as such
+		else if (S_ISDIR(st.st_mode))
+			nftw(names[i],collect_file,16,FTW_PHYS);
 		else
-		{
-			verb(64,"TS: parsing current section (no pointer)\n");
-			psi = realloc(psi, psi_len + 188-(p-data));
-			memcpy(psi+psi_len, p, 188-(p-data)); psi_len += 188-(p-data);
-			if (psi_len >= psi_complete_len)
-			{
-				process_psi_section(psi);
-				free(psi); psi = NULL; psi_len = 0; psi_complete_len = -1;
-			}
-			return;
-		}
-		
-		// process each section (or portion thereof) beginning in this packet
-		while (p < data+188)
-		{
-				psi_complete_len = 3 + ((((word) p[1])<<8 | p[2]) & 0x0FFF);
-				verb(64,"TS: parsing new section w/ len %04X\n",psi_complete_len);
-				if (p + psi_complete_len > data+188)
-				{
-					psi_len = 188-(p-data); psi = malloc(psi_len);
-					memcpy(psi,p,psi_len); break;
-				}
-				process_psi_section(p); 
-				p += psi_complete_len; psi_complete_len = -1;
-				if ((tp.flags_pid & 0x1FFF) != pmt_pid && *p != 0 ||
-				 (tp.flags_pid & 0x1FFF) == pmt_pid && *p != 2)	break;
-		}
+			batch_add(&b,names[i],st.st_size);
+	if (b.n == 0)
+	{ fprintf(stderr,"No recordings to convert\n"); return 0; }
+
+	// with all tracks, as many outputs as there may be tracks
+	workers = cap_workers(workers,mem,o->all_tracks ? JOB_TRACKS : 1);
+	if (workers > b.n)
+		workers = b.n;
+
+	b.job = (struct job *) calloc(b.n, sizeof *b.job);
+	b.secs = (double *) calloc(b.n, sizeof *b.secs);
+	qword t = stats_clock();
+	pool_run(workers,b.n,b.size,convert_one,&b);
+	double secs = (stats_clock() - t) / 1e9, busy = 0;
+
+	for (size_t i = 0; i < b.n; i++)
+	{
+		struct job *job = &b.job[i];
+		summary_line(summary,b.name[i],job,b.secs[i],b.size[i]);
+		failed += job->error != NULL;
+		busy += b.secs[i];
+		free(b.name[i]);
 	}
+	fprintf(summary,"%zu recordings, %d failed, in %.3f s on %d threads (%.3f s converting)\n",
+	 b.n, failed, secs, workers, busy);
+	free(b.name); free(b.size); free(b.job); free(b.secs);
+	return failed;
+}
+
+// Convert a recording found finished by the daemon, see daemon.h
+static int convert_finished(void *arg, const char *name)
+{
+	struct job job = { NULL };
+	qword t = stats_clock();
+
+	convert((const struct options *) arg,name,&job);
+	summary_line(stdout,name,&job,(stats_clock() - t) / 1e9,job.bytes_in);
+	fflush(stdout);
+	return job.error != NULL;
 }
 
 int main(int argc, char *argv[])
 {
-	FILE *input = NULL;
+	struct options o = { IO_AUTO };
+	struct job job = { NULL };
+	char *names[argc];
+	int n_names = 0, batch = 0, stats_interval = -1;
+	qword batch_mem = 1024;		// MiB
+	FILE *summary = stdout;
+	const char *watch = NULL, *state = NULL;
+	struct daemon_config dc = { 1, 10, 3, 0, 60 };
+	word programs[PROGRAMS+1] = { 0 };
 
-	dotsub = dotidx = NULL;
 	for (int i=1; i < argc; i++)
 		if (!strcmp(argv[i],"-h"))
 		{
-			fprintf(stderr,"vdrsub [-h] [-d ss.ss] [-vdr][-ts] [lähtötiedosto]\n");
+			fprintf(stderr,"vdrsub [-h] [-d ss.ss] [-vdr][-ts] [-io mmap|stream] [-prealloc] [-index] [--all-tracks] [--program=N,...] [-j N] [--follow[=N]] [--stats[=N]]\n");
+			fprintf(stderr,"       [--batch[=N] [--batch-mem=M] [--summary=tiedosto]] [lähtötiedosto ...]\n");
+			fprintf(stderr,"vdrsub --daemon=hakemisto [--workers=N] [--nice=N] [--ionice=L[:T]] [--state=tiedosto] [--batch-mem=M]\n");
 			fprintf(stderr,"(Antti Hautaniemi 2011-12)\n\n");
 			fprintf(stderr,"Muuntaa vdr-nauhoitustiedoston (.vdr tai .ts) sisältämän tai oletussyötteestä\n");
 			fprintf(stderr,"luetun tekstitysraidan VobSub-muotoon .sub- ja .idx-tiedostoksi\n");
@@ -638,88 +666,142 @@ int main(int argc, char *argv[])
 			fprintf(stderr," -d   aseta videoraidan aloitus-PTS sekunteina (luetaan automaattisesti)\n");
 			fprintf(stderr," -vdr aseta lähtötiedoston tyypiksi .vdr (oletus .vdr-päätteiselle tiedostolle)\n");
 			fprintf(stderr," -ts  aseta lähtötiedoston tyypiksi .ts (oletus muutoin)\n");
+			fprintf(stderr," -io  valitse lukutapa: mmap (oletus tavalliselle tiedostolle) tai\n");
+			fprintf(stderr,"      stream (kaksoispuskuroitu luku omassa säikeessään, esim. putkille)\n");
+			fprintf(stderr," -prealloc  varaa .sub-tiedostolle levytilaa etukäteen (fallocate)\n");
+			fprintf(stderr," -index  lue tekstitykset nauhoituksen sivuindeksin (<tiedosto>.vdrsub) kohdista,\n");
+			fprintf(stderr,"      tai luo se tällä kertaa, jos sitä ei ole tai nauhoitus on muuttunut\n");
+			fprintf(stderr," --all-tracks  muunna .ts-tiedoston kaikki tekstitysraidat yhdellä lukukerralla,\n");
+			fprintf(stderr,"      kukin omiksi <tiedosto>.<kieli>.sub- ja .idx-tiedostoikseen (usean ohjelman\n");
+			fprintf(stderr,"      .ts-tiedostosta, esim. koko kanavanipun tallenteesta, <tiedosto>.<ohjelma>.<kieli>.*)\n");
+			fprintf(stderr," --program  katso vain ohjelmien (palvelutunnisteiden) N,... tekstityksiä;\n");
+			fprintf(stderr,"      --all-tracks-valitsimen kanssa muunna niiden kaikki raidat yhdellä lukukerralla\n");
+			fprintf(stderr," -j   etsi tekstityspaketit .ts-tiedostosta N säikeellä, kunkin omasta osastaan\n");
+			fprintf(stderr," --follow  seuraa vielä nauhoittuvaa tiedostoa, kunnes nauhoitus päättyy tai\n");
+			fprintf(stderr,"      siihen ei ole kirjoitettu 60 sekuntiin (--follow=N: N sekuntiin)\n");
+			fprintf(stderr," --stats  tulosta lopuksi tilastot luetusta datasta ja vaiheiden ajankäytöstä,\n");
+			fprintf(stderr,"      --stats=N myös N sekunnin välein\n");
+			fprintf(stderr," --batch  muunna kaikki annetut tiedostot ja hakemistojen .ts-, .vdr- ja\n");
+			fprintf(stderr,"      .m2ts-tiedostot rinnakkain, suurimmat ensin, N säikeellä (oletus: suorittimien\n");
+			fprintf(stderr,"      määrä) ja tulosta lopuksi yhteenveto; ei PSI-tulosteita eikä tilastoja\n");
+			fprintf(stderr," --batch-mem  käytä muunnoksiin enintään M Mt muistia (oletus 1024)\n");
+			fprintf(stderr," --summary  kirjoita yhteenveto tiedostoon (oletus: vakiotuloste)\n");
+			fprintf(stderr," --daemon  vahdi hakemistopuuta (esim. vdr:n videohakemistoa) ja muunna kukin\n");
+			fprintf(stderr,"      nauhoitustiedosto, kun se on valmis; yhteenvetorivi kustakin vakiotulosteeseen\n");
+			fprintf(stderr," --workers  muunna enintään N tiedostoa kerrallaan (oletus 1)\n");
+			fprintf(stderr," --nice  muunna prioriteetilla N kuten nice(1) (oletus 10)\n");
+			fprintf(stderr," --ionice  muunna I/O-luokassa L tasolla T kuten ionice(1): 1 reaaliaika,\n");
+			fprintf(stderr,"      2 paras yritys, 3 jouten (oletus)\n");
+			fprintf(stderr," --state  pidä kirjaa muunnetuista tiedostoista tiedostossa\n");
+			fprintf(stderr,"      (oletus <hakemisto>/.vdrsub-state)\n");
 			return 0;
 		}
 		else if (!strcmp(argv[i],"-d"))
-			first_video_pts = (i <= argc-2) ? atof(argv[++i])*90000 : 0;
+			o.first_video_pts = (i <= argc-2) ? atof(argv[++i])*90000 : 0;
 		else if (!strcmp(argv[i],"-vdr"))
-			input_type = VDR;
+			o.vdr = 1;
 		else if (!strcmp(argv[i],"-ts"))
-			input_type = TS;
+			o.vdr = 0;
 		else if (!strcmp(argv[i],"-psi"))
 			operation = PSI;
-		else if (argv[i][0] != '-')
+		else if (!strcmp(argv[i],"-io") && i <= argc-2)
 		{
-			char *name = (char *) malloc(strlen(argv[i])+4), *ext;
-			strcpy(name,argv[i]); 
-			if ((input = fopen(name,"rb")) == NULL) 
-			{ fprintf(stderr,"Unable to open: %s\n",name); continue; }
-			if (operation & CONVERT)
+			i++;
+			if (!strcmp(argv[i],"mmap")) o.backend = IO_MMAP;
+			else if (!strcmp(argv[i],"stream")) o.backend = IO_STREAM;
+			else { fprintf(stderr,"Unknown input backend: %s\n",argv[i]); return 1; }
+		}
+		else if (!strcmp(argv[i],"-prealloc"))
+			o.prealloc = 1;
+		else if (!strcmp(argv[i],"-index"))
+			o.use_index = 1;
+		else if (!strcmp(argv[i],"--all-tracks"))
+			o.all_tracks = 1;
+		else if (!strncmp(argv[i],"--program=",10))
+		{
+			char *p = argv[i]+10;
+			int n = 0;
+			while (*p && n < PROGRAMS)
 			{
-				ext = (ext=strrchr(name,'.')) != NULL ? ext : name+strlen(name);
-				if (!strcmp(ext,".vdr")) 
-					input_type = VDR;
-				strcpy(ext,".sub"); dotsub = fopen(name,"wb");
-				strcpy(ext,".idx"); dotidx = fopen(name,"w");
+				long program = strtol(p,&p,0);
+				if (program <= 0 || program > 0xFFFF || (*p && *p != ','))
+				{ fprintf(stderr,"Unknown program: %s\n",argv[i]+10); return 1; }
+				programs[n++] = program;
+				p += *p == ',';
 			}
+			programs[n] = 0;
+			o.programs = n ? programs : NULL;
 		}
+		else if (!strcmp(argv[i],"-j") && i <= argc-2)
+			o.jobs = atoi(argv[++i]) > 1 ? atoi(argv[i]) : 1;
+		else if (!strncmp(argv[i],"--follow",8) && (argv[i][8] == 0 || argv[i][8] == '='))
+			job.follow = argv[i][8] && atoi(argv[i]+9) > 0 ? atoi(argv[i]+9) : 60;
+		else if (!strncmp(argv[i],"--stats",7) && (argv[i][7] == 0 || argv[i][7] == '='))
+			stats_interval = argv[i][7] ? atoi(argv[i]+8) : 0;
+		else if (!strncmp(argv[i],"--batch-mem=",12))
+			batch_mem = atoi(argv[i]+12) > 0 ? atoi(argv[i]+12) : batch_mem;
+		else if (!strncmp(argv[i],"--batch",7) && (argv[i][7] == 0 || argv[i][7] == '='))
+			batch = argv[i][7] && atoi(argv[i]+8) > 0 ? atoi(argv[i]+8) : sysconf(_SC_NPROCESSORS_ONLN);
+		else if (!strncmp(argv[i],"--daemon=",9))
+			watch = argv[i]+9;
+		else if (!strncmp(argv[i],"--workers=",10))
+			dc.workers = atoi(argv[i]+10) > 0 ? atoi(argv[i]+10) : 1;
+		else if (!strncmp(argv[i],"--nice=",7))
+			dc.nice = atoi(argv[i]+7);
+		else if (!strncmp(argv[i],"--ionice=",9))
+		{
+			dc.ioclass = atoi(argv[i]+9);
+			dc.iolevel = strchr(argv[i],':') ? atoi(strchr(argv[i],':')+1) : dc.ioclass == 3 ? 0 : 4;
+			if (dc.ioclass < 0 || dc.ioclass > 3 || dc.iolevel < 0 || dc.iolevel > 7)
+			{ fprintf(stderr,"Unknown I/O priority: %s\n",argv[i]+9); return 1; }
+		}
+		else if (!strncmp(argv[i],"--state=",8))
+			state = argv[i]+8;
+		else if (!strncmp(argv[i],"--summary=",10))
+		{
+			if ((summary = fopen(argv[i]+10,"w")) == NULL)
+			{ fprintf(stderr,"Unable to write the summary into %s\n",argv[i]+10); return 1; }
+		}
+		else if (argv[i][0] != '-')
+			names[n_names++] = argv[i];
+	init_verbose(1);
 
-	if (input == NULL)
-	{	input = stdin;
-		if (operation & CONVERT)
-		{ dotsub = fopen("out.sub","wb"); dotidx = fopen("out.idx","w"); }
-	}
-	if (operation & CONVERT)
+	if (batch)
 	{
-		if (dotsub == NULL || dotidx == NULL)
-		{ fprintf(stderr,"Unable to write .sub and/or .idx file\n"); return 1; }
-
-		fputs("# VobSub index file, v7 (do not modify this line!)\n",dotidx);
-		fputs("palette: 000000, 131313, 868686, D6D6D6, ",dotidx);
-		fputs("000000, 000000, 000000, 000000, 000000, 000000, ",dotidx);
-		fputs("000000, 000000, 000000, 000000, 000000, 000000\n",dotidx);
-		fputs("\nid: fi, index: 0\n",dotidx);
+		// the files, rather than parts of one, are what is done side by side,
+		// and the counters of --stats would be shared between them
+		o.jobs = 1;
+		o.psi = 0;
+		int failed = batch_convert(&o,names,n_names,batch,batch_mem << 20,summary);
+		if (summary != stdout)
+			fclose(summary);
+		return failed > 0;
 	}
-	subp = init_subp();
-	init_verbose(1);
 
-	switch (input_type)
+	if (watch)
 	{
-	case TS: {
-		byte ts_packet[188];
-		int sync_byte;
-		while (1)
+		// as in batch mode, and each file is done with once converted
+		char *name = NULL;
+		o.jobs = 1;
+		o.psi = 0;
+		dc.workers = cap_workers(dc.workers,batch_mem << 20,o.all_tracks ? JOB_TRACKS : 1);
+		if (state == NULL)
 		{
-			do if ((sync_byte = fgetc(input)) == EOF) break;
-			while (sync_byte != 0x47);
-		 	if (fread(ts_packet+1,1,187,input) != 187)
-				break;
-			ts_packet[0] = sync_byte;
-			process_ts_packet(ts_packet);
+			state = name = (char *) malloc(strlen(watch) + sizeof "/.vdrsub-state");
+			sprintf(name,"%s/.vdrsub-state",watch);
 		}
-		} break;
-	case VDR: {
-		byte *pes_packet = malloc(6);
-		while (1)
-		{
-			if (fread(pes_packet,1,6,input) < 6)
-				break;
-			word pes_length = (((word) pes_packet[4]) << 8) + pes_packet[5];
-			if ((pes_packet = realloc(pes_packet, 6+pes_length)) == NULL)
-			{ fprintf(stderr, "Out of memory, requested %d bytes\n",6+pes_length); return 2; }
-			if (fread(pes_packet+6,1,pes_length,input) < pes_length)
-				break;
-			process_pes_packet(pes_packet);
-		}
-		free(pes_packet);
-		if (pes_len > 0)
-			// forward contents of any subtitle PES sequence remaining in the cache
-			process_dvbsub_data(pes_data, pes_len, pes_pts);
-		} break;
+		dc.state = state;
+		int status = daemon_run(watch,&dc,convert_finished,&o);
+		free(name);
+		return status;
 	}
-				
-	release_subp(subp);
-	if (operation & CONVERT) { fclose(dotsub); fclose(dotidx); }
-	if (input != stdin) fclose(input);
-	return 0;
+
+	o.psi = (operation & PSI) != 0;
+	if (stats_interval >= 0)
+		stats_init(stats_interval);
+	// the last one named, if any
+	int status = convert(&o,n_names ? names[n_names-1] : NULL,&job);
+	if (status == 0 && stats_enabled)
+		stats_report();
+	return status;
 }
@@ -5,122 +5,88 @@
    (in mkvtoolnix code : xtr_vobsub.cpp)
  */
 
-#include <stdio.h>
 #include <string.h>
 
-typedef unsigned char byte;
-typedef unsigned short word;
-typedef unsigned long dword;
-typedef unsigned long long qword;
+#include "write-ps.h"
 
-// Write vobsub packet in 'data' to 'fp' formatted into dvd-compatible ps packets
-void write_vobsub_ps(byte *data, size_t size, qword pts, FILE *fp)
-{
-	static byte padding_data[8] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
-
-	struct mpeg_es_header_t {
-		byte pfx[3];               // 00 00 01
-		byte stream_id;            // BD
-		byte len[2];
-		byte flags[2];
-		byte hlen;
-		byte pts[5];
-		byte lidx;
-	} es;
-	memset(&es, 0, sizeof es);
-
-	struct mpeg_ps_header_t {
-		byte pfx[4];               // 00 00 01 BA
-		byte scr[6];
-		byte muxr[3];
-		byte stlen;
-	} ps;
-	memset(&ps, 0, sizeof ps);
-
-	dword padding = (2048 - (size + sizeof ps + sizeof es)) & 2047;
-	dword first   = size + sizeof ps + sizeof es > 2048
-					? 2048 - sizeof ps - sizeof es : size;
-
-	ps.pfx[2]  = 0x01;
-	ps.pfx[3]  = 0xba;
-	ps.scr[0]  = 0x40 | ((byte)(pts >> 27) & 0x38) | 0x04 | ((byte)(pts >> 28) & 0x03);
-	ps.scr[1]  = (byte)(pts >> 20);
-	ps.scr[2]  = ((byte)(pts >> 12) & 0xf8) | 0x04 | ((byte)(pts >> 13) & 0x03);
-	ps.scr[3]  = (byte)(pts >> 5);
-	ps.scr[4]  = ((byte)(pts << 3) & 0xf8) | 0x04;
-	ps.scr[5]  = 1;
-	ps.muxr[0] = 1;
-	ps.muxr[1] = 0x89;
-	ps.muxr[2] = 0xc3; // just some value
-	ps.stlen   = 0xf8;
+#define FIRST_PAYLOAD 2019		// after the PES header with a PTS (15 bytes)
+#define NEXT_PAYLOAD 2024		// after the PES header without one (10 bytes)
+#define MAX_STUFFING 5			// ... and beyond that a padding packet
 
-	es.pfx[2]    = 1;
-	es.stream_id = 0xbd;
-	es.len[0]    = (byte)((first + 9) >> 8);
-	es.len[1]    = (byte)(first + 9);
-	es.flags[0]  = 0x81;
-	es.flags[1]  = 0x80;
-	es.hlen      = 5;
-	es.pts[0]    = 0x20 | ((byte)(pts >> 29) & 0x0e) | 0x01;
-	es.pts[1]    = (byte)(pts >> 22);
-	es.pts[2]    = ((byte)(pts >> 14) & 0xfe) | 0x01;
-	es.pts[3]    = (byte)(pts >> 7);
-	es.pts[4]    = (byte)(pts << 1) | 0x01;
-	es.lidx      = 0x20;
-	if ((6 > padding) && (first == size))
+// Lay out the pack header and private stream 1 PES header of a sector
+// carrying 'payload' bytes of subpicture stream 0x20, the first sector of a
+// packet with the PTS, and 'stuffing' bytes in the PES header of the last one
+// Returns the length of the headers
+static int sector_headers(byte *h, qword pts, int first, size_t payload, int stuffing)
+{
+	size_t len = (first ? 9 : 4) + stuffing + payload;
+	byte *p = h;
+
+	*p++ = 0x00; *p++ = 0x00; *p++ = 0x01; *p++ = 0xba;
+	*p++ = 0x40 | ((byte)(pts >> 27) & 0x38) | 0x04 | ((byte)(pts >> 28) & 0x03);
+	*p++ = (byte)(pts >> 20);
+	*p++ = ((byte)(pts >> 12) & 0xf8) | 0x04 | ((byte)(pts >> 13) & 0x03);
+	*p++ = (byte)(pts >> 5);
+	*p++ = ((byte)(pts << 3) & 0xf8) | 0x04;
+	*p++ = 1;
+	*p++ = 1; *p++ = 0x89; *p++ = 0xc3;	// mux rate, just some value
+	*p++ = 0xf8;
+
+	*p++ = 0x00; *p++ = 0x00; *p++ = 0x01; *p++ = 0xbd;
+	*p++ = (byte)(len >> 8);
+	*p++ = (byte)len;
+	*p++ = 0x81;
+	*p++ = first ? 0x80 : 0;
+	*p++ = (first ? 5 : 0) + stuffing;
+	if (first)
 	{
-		es.hlen += (byte)padding;
-		es.len[0]  = (byte)((first + 9 + padding) >> 8);
-		es.len[1]  = (byte)(first + 9 + padding);
+		*p++ = 0x20 | ((byte)(pts >> 29) & 0x0e) | 0x01;
+		*p++ = (byte)(pts >> 22);
+		*p++ = ((byte)(pts >> 14) & 0xfe) | 0x01;
+		*p++ = (byte)(pts >> 7);
+		*p++ = (byte)(pts << 1) | 0x01;
 	}
+	memset(p, 0xff, stuffing);
+	p += stuffing;
+	*p++ = 0x20;				// substream id
+	return p - h;
+}
 
-	fwrite(&ps, 1, sizeof ps, fp);
-	fwrite(&es, 1, sizeof es -1, fp);
-	if ((0 < padding) && (6 > padding) && (first == size))
-		fwrite(padding_data, 1, padding, fp);
-  	fputc(es.lidx, fp);
-
-	fwrite(data, 1, first, fp);
-	while (first < size)
-	{
-		size    -= first;
-		data    += first;
+// Work out how many of the 'size' bytes left of a packet go into its next
+// sector, and the stuffing in its PES header or padding after it, if any
+static size_t sector_payload(size_t size, int first, int *stuffing, size_t *padding)
+{
+	size_t room = first ? FIRST_PAYLOAD : NEXT_PAYLOAD;
+	size_t payload = size < room ? size : room;
 
-		padding  = (2048 - (size + 10 + sizeof ps)) & 2047;
-		first    = size + 10 + sizeof ps > 2048 ? 2048 - 10 - sizeof ps : size;
+	*padding = room - payload;
+	*stuffing = payload == size && *padding <= MAX_STUFFING ? *padding : 0;
+	return payload;
+}
 
-		es.len[0]   = (byte)((first + 4) >> 8);
-		es.len[1]   = (byte)(first + 4);
-		es.flags[1] = 0;
-		es.hlen     = 0;
-		if ((6 > padding) && (first == size))
-		{
-			es.hlen += (byte)padding;
-			es.len[0]  = (byte)((first + 4 + padding) >> 8);
-			es.len[1]  = (byte)(first + 4 + padding);
-		}
+// Lay out the header of a padding packet filling the last 'padding' bytes
+// of a sector
+static void padding_header(byte *h, size_t padding)
+{
+	padding -= 6;
+	h[0] = 0x00; h[1] = 0x00; h[2] = 0x01; h[3] = 0xbe;
+	h[4] = (byte)(padding >> 8);
+	h[5] = (byte)padding;
+}
 
-		fwrite(&ps, 1, sizeof ps, fp);
-		fwrite(&es, 1, 9, fp);
-		if ((0 < padding) && (6 > padding) && (first == size))
-			fwrite(padding_data, 1, padding, fp);
-		fputc(es.lidx, fp);
-		fwrite(data, 1, first, fp);
-	}
-	if (6 <= padding)
+void vobsub_ps_sector(byte *sector, const byte **data, size_t *size, qword pts, int first)
+{
+	int stuffing;
+	size_t padding, payload = sector_payload(*size, first, &stuffing, &padding);
+	byte *p = sector + sector_headers(sector, pts, first, payload, stuffing);
+
+	memcpy(p, *data, payload);
+	p += payload;
+	*data += payload;
+	*size -= payload;
+	if (padding > MAX_STUFFING)
 	{
-		padding      -= 6;
-    	es.stream_id  = 0xbe;
-    	es.len[0]     = (byte)(padding >> 8);
-    	es.len[1]     = (byte)padding;
-
-    	fwrite(&es, 1, 6, fp);
-
-    	while (0 < padding)
-		{
-			dword todo = 8 < padding ? 8 : padding;
-			fwrite(padding_data, 1, todo, fp);
-			padding -= todo;
-		}
+		padding_header(p, padding);
+		memset(p + 6, 0xff, padding - 6);
 	}
 }
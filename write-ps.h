@@ -0,0 +1,19 @@
+/*
+
+ PS packetising of vobsub packets into DVD-compatible 2048-byte sectors,
+ each with a pack header and a private stream 1 PES header for subpicture
+ stream 0x20; the first sector of a packet carries its PTS
+
+*/
+
+#ifndef __WRITE_PS_H
+#define __WRITE_PS_H
+
+#include <stddef.h>
+#include "dvbsub.h"
+
+// Lay out the next PS sector of the vobsub packet at *data (*size bytes of
+// it left) into 'sector', 'first' or not, and advance past its payload
+void vobsub_ps_sector(byte *sector, const byte **data, size_t *size, qword pts, int first);
+
+#endif